@@ -82,6 +82,14 @@ static const char rcsid[] = "$Id: css.c,v 1.139 2007/12/16 11:57:43 danielk1977
  */
 #define TRACE_PARSER_CALLS 0
 
+/*
+ * The CssProperty.eType value used by a detached parse for url() values
+ * that are still to be translated by the -urlcmd script (see 
+ * propertyUrlCmd()). Values of this type are never seen outside of this
+ * file.
+ */
+#define CSS_TYPE_URLCMD -2
+
 static int cssParse(HtmlTree*,int,CONST char*,int,int,Tcl_Obj*,Tcl_Obj*,Tcl_Obj*,Tcl_Obj*,CssStyleSheet**);
 
 /*
@@ -393,8 +401,7 @@ propertyIsLength(pParse, pProp)
 
         case CSS_TYPE_FLOAT:
             return ((
-                INTEGER(pProp->v.rVal) == 0 || 
-                pParse->pTree->options.mode == HTML_MODE_QUIRKS
+                INTEGER(pProp->v.rVal) == 0 || pParse->isQuirks
             ) ? 1 : 0);
     }
 
@@ -486,14 +493,54 @@ rgbToColor(zOut, zRgb, nRgb)
     return;
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * urlCacheDelete --
+ *
+ *     Remove all entries from the url() translation cache pCache. Each
+ *     value in the cache is a Tcl_Obj* with its ref-count incremented.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Decrements the ref-count of cached translations.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+urlCacheDelete(pCache)
+    Tcl_HashTable *pCache;
+{
+    Tcl_HashEntry *pEntry;
+    Tcl_HashSearch search;
+
+    while ((pEntry = Tcl_FirstHashEntry(pCache, &search))) {
+        Tcl_DecrRefCount((Tcl_Obj *)Tcl_GetHashValue(pEntry));
+        Tcl_DeleteHashEntry(pEntry);
+    }
+}
+
 /*
  *---------------------------------------------------------------------------
  *
  * doUrlCmd --
  *
+ *     Translate the url() argument zArg (nArg bytes in size) by evaluating
+ *     the -urlcmd script of the current parse.
+ *
+ *     Each translation is memoized for the duration of the parse, so
+ *     that a stylesheet that refers to the same url() many times only 
+ *     invokes the -urlcmd script once. If the -urlcache option is set,
+ *     translations are also memoized in the widget until the next
+ *     [reset], keyed by the full text of the evaluated script.
+ *
  * Results:
+ *     TCL_OK. The translated URL is left in the interpreter result.
  *
  * Side effects:
+ *     May invoke the -urlcmd script.
  *
  *---------------------------------------------------------------------------
  */
@@ -504,25 +551,114 @@ doUrlCmd(pParse, zArg, nArg)
     int nArg;
 {
     const int eval_flags = TCL_EVAL_DIRECT|TCL_EVAL_GLOBAL;
+    HtmlTree *pTree = pParse->pTree;
+    Tcl_HashTable *pWidgetCache = 0;
+    Tcl_HashEntry *pParseEntry;
+    Tcl_HashEntry *pWidgetEntry = 0;
     char *zCopy = HtmlAlloc("temp", nArg + 1);
     Tcl_Obj *pCopy;
-    Tcl_Obj *pScript = Tcl_DuplicateObj(pParse->pUrlCmd);
+    Tcl_Obj *pScript;
+    Tcl_Obj *pRes;
+    int isNew;
 
     memcpy(zCopy, zArg, nArg);
     zCopy[nArg] = '\0';
     dequote(zCopy);
-    pCopy = Tcl_NewStringObj(zCopy, -1);
 
+    /* Check the per-parse cache first. */
+    if (!pParse->isUrlCacheInit) {
+        Tcl_InitHashTable(&pParse->aUrlCache, TCL_STRING_KEYS);
+        pParse->isUrlCacheInit = 1;
+    }
+    pParseEntry = Tcl_CreateHashEntry(&pParse->aUrlCache, zCopy, &isNew);
+    if (!isNew) {
+        Tcl_SetObjResult(pParse->interp, 
+            (Tcl_Obj *)Tcl_GetHashValue(pParseEntry)
+        );
+        HtmlFree(zCopy);
+        return TCL_OK;
+    }
+
+    pCopy = Tcl_NewStringObj(zCopy, -1);
+    pScript = Tcl_DuplicateObj(pParse->pUrlCmd);
     Tcl_IncrRefCount(pScript);
     Tcl_ListObjAppendElement(0, pScript, pCopy);
-    Tcl_EvalObjEx(pParse->interp, pScript, eval_flags);
-    Tcl_DecrRefCount(pScript);
 
+    /* Then the per-widget cache, if it is enabled. */
+    if (pTree && pTree->options.urlcache) {
+        pWidgetCache = &pTree->aUrlCache;
+        pWidgetEntry = Tcl_FindHashEntry(pWidgetCache,Tcl_GetString(pScript));
+    }
+
+    if (pWidgetEntry) {
+        pRes = (Tcl_Obj *)Tcl_GetHashValue(pWidgetEntry);
+        Tcl_SetObjResult(pParse->interp, pRes);
+    } else if (TCL_OK == Tcl_EvalObjEx(pParse->interp, pScript, eval_flags)) {
+        pRes = Tcl_GetObjResult(pParse->interp);
+        if (pWidgetCache && !pTree->isDeleted) {
+            pWidgetEntry = Tcl_CreateHashEntry(
+                pWidgetCache, Tcl_GetString(pScript), &isNew
+            );
+            assert(isNew);
+            Tcl_IncrRefCount(pRes);
+            Tcl_SetHashValue(pWidgetEntry, pRes);
+        }
+    } else {
+        /* Do not cache the result of a failed -urlcmd script. */
+        Tcl_DeleteHashEntry(pParseEntry);
+        pParseEntry = 0;
+    }
+
+    if (pParseEntry) {
+        pRes = Tcl_GetObjResult(pParse->interp);
+        Tcl_IncrRefCount(pRes);
+        Tcl_SetHashValue(pParseEntry, pRes);
+    }
+
+    Tcl_DecrRefCount(pScript);
     HtmlFree(zCopy);
 
     return TCL_OK;
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCssUrlCacheInit --
+ * HtmlCssUrlCacheClear --
+ * HtmlCssUrlCacheShutdown --
+ *
+ *     Manage the widget-wide cache of -urlcmd translations used when the
+ *     -urlcache option is set. The cache is cleared by [reset].
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     See above.
+ *
+ *---------------------------------------------------------------------------
+ */
+void
+HtmlCssUrlCacheInit(pTree)
+    HtmlTree *pTree;
+{
+    Tcl_InitHashTable(&pTree->aUrlCache, TCL_STRING_KEYS);
+}
+void
+HtmlCssUrlCacheClear(pTree)
+    HtmlTree *pTree;
+{
+    urlCacheDelete(&pTree->aUrlCache);
+}
+void
+HtmlCssUrlCacheShutdown(pTree)
+    HtmlTree *pTree;
+{
+    urlCacheDelete(&pTree->aUrlCache);
+    Tcl_DeleteHashTable(&pTree->aUrlCache);
+}
+
 /*
  *---------------------------------------------------------------------------
  *
@@ -610,6 +746,7 @@ tokenToProperty(pParse, pToken)
                 if (l==functions[i].len && 0==strnicmp(zFunc, z, l)) {
                     char CONST *zArg;
                     int nArg;
+                    int eType = functions[i].type;
 
                     zArg = &z[l+1];
                     nArg = (n-l-2); /* len(token)-len(func)-len('(')-len(')') */
@@ -627,9 +764,13 @@ tokenToProperty(pParse, pToken)
                         pParse &&
                         pParse->pUrlCmd
                     ) {
-                        doUrlCmd(pParse, zArg, nArg);
-                        zArg = Tcl_GetStringResult(pParse->interp);
-                        nArg = strlen(zArg);
+                        if (pParse->isDetached) {
+                            eType = CSS_TYPE_URLCMD;
+                        } else {
+                            doUrlCmd(pParse, zArg, nArg);
+                            zArg = Tcl_GetStringResult(pParse->interp);
+                            nArg = strlen(zArg);
+                        }
                     }
 
                     if (functions[i].type==-1) {
@@ -646,7 +787,7 @@ tokenToProperty(pParse, pToken)
                     } else {
                         int nAlloc = sizeof(CssProperty) + nArg + 1;
                         pProp = (CssProperty *)HtmlAlloc("CssProperty", nAlloc);
-                        pProp->eType = functions[i].type;
+                        pProp->eType = eType;
                         pProp->v.zVal = (char *)&pProp[1];
                         strncpy(pProp->v.zVal, zArg, nArg);
                         pProp->v.zVal[nArg] = '\0';
@@ -702,6 +843,49 @@ tokenToProperty(pParse, pToken)
     return pProp;
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * propertyUrlCmd --
+ *
+ *     Argument pProp is a CSS_TYPE_URLCMD value created by a detached
+ *     parse. Invoke the -urlcmd script to translate it, exactly as 
+ *     tokenToProperty() does when the parse is not detached, and return
+ *     the equivalent CSS_TYPE_URL value. The caller passes ownership of
+ *     pProp to this function.
+ *
+ * Results:
+ *     Allocated CssProperty object.
+ *
+ * Side effects:
+ *     Frees pProp. May invoke the -urlcmd script.
+ *
+ *---------------------------------------------------------------------------
+ */
+static CssProperty *
+propertyUrlCmd(pParse, pProp)
+    CssParse *pParse;
+    CssProperty *pProp;
+{
+    CssProperty *pNew;
+    const char *zUrl;
+    int nUrl;
+
+    assert(pProp->eType == CSS_TYPE_URLCMD && !pParse->isDetached);
+    doUrlCmd(pParse, pProp->v.zVal, strlen(pProp->v.zVal));
+    zUrl = Tcl_GetStringResult(pParse->interp);
+    nUrl = strlen(zUrl);
+
+    pNew = (CssProperty *)HtmlAlloc("CssProperty", sizeof(CssProperty)+nUrl+1);
+    pNew->eType = CSS_TYPE_URL;
+    pNew->v.zVal = (char *)&pNew[1];
+    memcpy(pNew->v.zVal, zUrl, nUrl + 1);
+    dequote(pNew->v.zVal);
+
+    HtmlFree(pProp);
+    return pNew;
+}
+
 /*
  *---------------------------------------------------------------------------
  *
@@ -841,11 +1025,385 @@ propertySetGet(p, i)
     return 0;
 }
 
+/*
+ * Per-thread table of interned CssProperty values. See the comments above
+ * struct CssInternedProperty in cssInt.h. The same structure holds the
+ * interned class names used by compiled class selectors and by the
+ * HtmlElementNode.azClass arrays (see HtmlCssNodeClassesSet()).
+ *
+ * While the isDetached flag is set, propertyIntern() and propertyRelease()
+ * do not use the table. Property sets built by a detached parse (see
+ * cssParseRun()) hold uninterned values, which are interned by the thread
+ * that owns the widget before the stylesheet is used.
+ */
+typedef struct CssInternTable CssInternTable;
+struct CssInternTable {
+    int isInit;
+    int isDetached;           /* True while running a detached parse */
+    Tcl_HashTable aProperty;  /* Map from property key to CssInternedProperty */
+    Tcl_HashTable aClass;     /* Map from class name to reference count */
+};
+static Tcl_ThreadDataKey internKey;
+
+static CssInternTable *
+internTable()
+{
+    CssInternTable *pTable = (CssInternTable *)Tcl_GetThreadData(
+        &internKey, sizeof(CssInternTable)
+    );
+    if (!pTable->isInit) {
+        Tcl_InitHashTable(&pTable->aProperty, TCL_STRING_KEYS);
+        Tcl_InitHashTable(&pTable->aClass, TCL_STRING_KEYS);
+        pTable->isInit = 1;
+    }
+    return pTable;
+}
+
+#define propertyToInterned(p) ((CssInternedProperty *)( \
+    (char *)(p) - (size_t)(&((CssInternedProperty *)0)->prop) \
+))
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * propertyKey --
+ *
+ *     Write a key that uniquely identifies the value of property pProp
+ *     into dynamic string pKey. Two properties have the same key if 
+ *     and only if they are interchangeable. For CSS_TYPE_LIST properties
+ *     the members must already be interned, so that they may be 
+ *     identified by pointer.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Appends to pKey.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+propertyKey(pProp, pKey)
+    CssProperty *pProp;
+    Tcl_DString *pKey;
+{
+    char zBuf[64];
+    int eType = pProp->eType;
+
+    sprintf(zBuf, "%d:", eType);
+    Tcl_DStringAppend(pKey, zBuf, -1);
+
+    if (eType >= CSS_TYPE_EM && eType <= CSS_TYPE_FLOAT) {
+        sprintf(zBuf, "%.17g", pProp->v.rVal);
+        Tcl_DStringAppend(pKey, zBuf, -1);
+    } else if (eType == CSS_TYPE_LIST) {
+        CssProperty **apProp = (CssProperty **)pProp->v.p;
+        int ii;
+        for (ii = 0; apProp[ii]; ii++) {
+            sprintf(zBuf, "%p ", (void *)apProp[ii]);
+            Tcl_DStringAppend(pKey, zBuf, -1);
+        }
+    } else if (eType != CSS_TYPE_NONE) {
+        Tcl_DStringAppend(pKey, pProp->v.zVal, -1);
+    }
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * propertyIntern --
+ *
+ *     Return the interned property with the same value as pProp. The 
+ *     caller passes ownership of pProp (a property allocated by
+ *     tokenToProperty() or similar) to this function and receives a
+ *     reference to the interned value. The reference should be released
+ *     using propertyRelease().
+ *
+ *     The members of a CssProperty.eType==CSS_TYPE_LIST property are 
+ *     interned as well.
+ *
+ *     If the isDetached flag of the intern table is set, pProp is
+ *     returned unmodified.
+ *
+ * Results:
+ *     Interned property, or NULL if pProp is NULL.
+ *
+ * Side effects:
+ *     Frees pProp. May add an entry to the intern table.
+ *
+ *---------------------------------------------------------------------------
+ */
+static CssProperty *
+propertyIntern(pProp)
+    CssProperty *pProp;
+{
+    CssInternTable *pTable;
+    CssInternedProperty *pInterned;
+    Tcl_HashEntry *pEntry;
+    Tcl_DString key;
+    int isNew;
+    int nByte;
+    int nList = 0;
+    const char *zVal = 0;
+
+    if (!pProp) return 0;
+
+    pTable = internTable();
+    if (pTable->isDetached) return pProp;
+
+    if (pProp->eType == CSS_TYPE_LIST) {
+        CssProperty **apProp = (CssProperty **)pProp->v.p;
+        for (nList = 0; apProp[nList]; nList++) {
+            apProp[nList] = propertyIntern(apProp[nList]);
+        }
+    }
+
+    Tcl_DStringInit(&key);
+    propertyKey(pProp, &key);
+    pEntry = Tcl_CreateHashEntry(
+        &pTable->aProperty, Tcl_DStringValue(&key), &isNew
+    );
+    Tcl_DStringFree(&key);
+
+    if (!isNew) {
+        /* An identical value is already interned. Release the members
+         * of pProp if it is a list (the interned list holds its own
+         * references to the same members).
+         */
+        pInterned = (CssInternedProperty *)Tcl_GetHashValue(pEntry);
+        pInterned->nRef++;
+        if (pProp->eType == CSS_TYPE_LIST) {
+            CssProperty **apProp = (CssProperty **)pProp->v.p;
+            int ii;
+            for (ii = 0; ii < nList; ii++) {
+                propertyToInterned(apProp[ii])->nRef--;
+            }
+        }
+        HtmlFree(pProp);
+        return &pInterned->prop;
+    }
+
+    nByte = sizeof(CssInternedProperty);
+    if (pProp->eType == CSS_TYPE_LIST) {
+        nByte += (nList + 1) * sizeof(CssProperty *);
+    } else if (pProp->eType != CSS_TYPE_NONE && (
+        pProp->eType < CSS_TYPE_EM || pProp->eType > CSS_TYPE_FLOAT
+    )) {
+        zVal = pProp->v.zVal;
+        nByte += strlen(zVal) + 1;
+    }
+
+    pInterned = (CssInternedProperty *)HtmlAlloc("CssInternedProperty", nByte);
+    pInterned->nRef = 1;
+    pInterned->pEntry = pEntry;
+    pInterned->prop = *pProp;
+    if (pProp->eType == CSS_TYPE_LIST) {
+        pInterned->prop.v.p = (void *)&pInterned[1];
+        memcpy(pInterned->prop.v.p, pProp->v.p, (nList+1)*sizeof(CssProperty*));
+    } else if (zVal) {
+        pInterned->prop.v.zVal = (char *)&pInterned[1];
+        strcpy(pInterned->prop.v.zVal, zVal);
+    }
+    Tcl_SetHashValue(pEntry, pInterned);
+
+    HtmlFree(pProp);
+    return &pInterned->prop;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * propertyRelease --
+ *
+ *     Release a reference to an interned property obtained from
+ *     propertyIntern(). If this is the last reference, the property is
+ *     removed from the intern table and freed. If the isDetached flag
+ *     of the intern table is set, pProp is an uninterned value and is
+ *     freed immediately.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May free memory.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void 
+propertyRelease(pProp)
+    CssProperty *pProp;
+{
+    CssInternedProperty *pInterned;
+    if (!pProp) return;
+
+    if (internTable()->isDetached) {
+        if (pProp->eType == CSS_TYPE_LIST) {
+            int ii;
+            CssProperty **apProp = (CssProperty **)pProp->v.p;
+            for (ii = 0; apProp[ii]; ii++) {
+                HtmlFree(apProp[ii]);
+            }
+        }
+        HtmlFree(pProp);
+        return;
+    }
+
+    pInterned = propertyToInterned(pProp);
+    assert(pInterned->nRef > 0);
+    pInterned->nRef--;
+    if (pInterned->nRef == 0) {
+        if (pProp->eType == CSS_TYPE_LIST) {
+            int ii;
+            CssProperty **apProp = (CssProperty **)pProp->v.p;
+            for (ii = 0; apProp[ii]; ii++) {
+                propertyRelease(apProp[ii]);
+            }
+        }
+        Tcl_DeleteHashEntry(pInterned->pEntry);
+        HtmlFree(pInterned);
+    }
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * classAtom --
+ *
+ *     Return the interned copy of the n byte class name z, folded to 
+ *     lower-case. Two class names that match (class names are compared
+ *     without regard to case) are represented by the same pointer. The
+ *     reference obtained should be released using classAtomRelease().
+ *
+ *     Class names are only interned by the Tk thread. Style-engine
+ *     worker threads compare the pointers but never call this function.
+ *
+ * Results:
+ *     Pointer to interned class name.
+ *
+ * Side effects:
+ *     May add an entry to the intern table.
+ *
+ *---------------------------------------------------------------------------
+ */
+static const char *
+classAtom(z, n)
+    const char *z;
+    int n;
+{
+    CssInternTable *pTable = internTable();
+    Tcl_HashEntry *pEntry;
+    Tcl_DString key;
+    char *zKey;
+    int nRef = 0;
+    int isNew;
+    int ii;
+
+    Tcl_DStringInit(&key);
+    Tcl_DStringAppend(&key, z, n);
+    zKey = Tcl_DStringValue(&key);
+    for (ii = 0; zKey[ii]; ii++) {
+        zKey[ii] = tolower((unsigned char)zKey[ii]);
+    }
+    pEntry = Tcl_CreateHashEntry(&pTable->aClass, zKey, &isNew);
+    Tcl_DStringFree(&key);
+
+    if (!isNew) {
+        nRef = (int)(size_t)Tcl_GetHashValue(pEntry);
+    }
+    Tcl_SetHashValue(pEntry, (ClientData)(size_t)(nRef + 1));
+    return (const char *)Tcl_GetHashKey(&pTable->aClass, pEntry);
+}
+
+static void
+classAtomRelease(zAtom)
+    const char *zAtom;
+{
+    CssInternTable *pTable = internTable();
+    Tcl_HashEntry *pEntry = Tcl_FindHashEntry(&pTable->aClass, zAtom);
+    int nRef;
+
+    assert(pEntry && Tcl_GetHashKey(&pTable->aClass, pEntry) == zAtom);
+    nRef = (int)(size_t)Tcl_GetHashValue(pEntry) - 1;
+    if (nRef == 0) {
+        Tcl_DeleteHashEntry(pEntry);
+    } else {
+        Tcl_SetHashValue(pEntry, (ClientData)(size_t)nRef);
+    }
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCssNodeClassesSet --
+ * HtmlCssNodeClassesFree --
+ *
+ *     HtmlCssNodeClassesSet() sets the HtmlElementNode.azClass array of
+ *     element pElem to the interned class names (see classAtom()) of the
+ *     current value of its "class" attribute, in order and without 
+ *     duplicates. HtmlCssNodeClassesFree() releases the array. Both are
+ *     called by the id and class index code in htmltree.c, which runs
+ *     whenever the "class" attribute of an element is set.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Modifies pElem->azClass and pElem->nClass.
+ *
+ *---------------------------------------------------------------------------
+ */
+void
+HtmlCssNodeClassesSet(pElem)
+    HtmlElementNode *pElem;
+{
+    const char *zClass;
+    const char *z;
+    int nAlloc = 0;
+    int n;
+
+    HtmlCssNodeClassesFree(pElem);
+    zClass = HtmlNodeAttr(&pElem->node, "class");
+    if (!zClass) return;
+
+    for (z = zClass; (z = HtmlCssGetNextListItem(z, strlen(z), &n)); z += n) {
+        nAlloc++;
+    }
+    if (nAlloc == 0) return;
+
+    pElem->azClass = (const char **)HtmlAlloc(
+        "HtmlElementNode.azClass", nAlloc * sizeof(const char *)
+    );
+    for (z = zClass; (z = HtmlCssGetNextListItem(z, strlen(z), &n)); z += n) {
+        const char *zAtom = classAtom(z, n);
+        int ii;
+        for (ii = 0; ii < pElem->nClass && pElem->azClass[ii] != zAtom; ii++);
+        if (ii < pElem->nClass) {
+            classAtomRelease(zAtom);
+        } else {
+            pElem->azClass[pElem->nClass++] = zAtom;
+        }
+    }
+}
+void
+HtmlCssNodeClassesFree(pElem)
+    HtmlElementNode *pElem;
+{
+    int ii;
+    for (ii = 0; ii < pElem->nClass; ii++) {
+        classAtomRelease(pElem->azClass[ii]);
+    }
+    HtmlFree(pElem->azClass);
+    pElem->azClass = 0;
+    pElem->nClass = 0;
+}
+
 /*--------------------------------------------------------------------------
  *
  * propertySetAdd --
  *
- *     Insert or replace a value into a property set.
+ *     Insert or replace a value into a property set. Ownership of v is
+ *     passed to this function. The value stored in the property set is
+ *     the interned equivalent of v (see propertyIntern()).
  *
  * Results:
  *     None.
@@ -884,24 +1442,12 @@ propertySetAdd(p, i, v)
     p->a = (struct CssPropertySetItem *)HtmlRealloc(
         "CssPropertySet.a", (char *)p->a, nBytes
     );
-    p->a[p->n].pProp = v;
+    p->a[p->n].pProp = propertyIntern(v);
     p->a[p->n].eProp = i;
     p->n++;
 }
 
 
-static void 
-propertyFree(CssProperty *p){
-  if (p && p->eType == CSS_TYPE_LIST) {
-    int ii;
-    CssProperty **apProp = (CssProperty **)p->v.p;
-    for (ii = 0; apProp[ii]; ii++) {
-        propertyFree(apProp[ii]);
-    }
-  }
-  HtmlFree(p);
-}
-
 /*--------------------------------------------------------------------------
  *
  * propertySetFree --
@@ -921,7 +1467,7 @@ propertySetFree(CssPropertySet *p){
     int i;
     if( !p ) return;
     for (i = 0; i < p->n; i++) {
-        propertyFree(p->a[i].pProp);
+        propertyRelease(p->a[i].pProp);
     }
     HtmlFree(p->a);
     HtmlFree(p);
@@ -1087,20 +1633,14 @@ static void propertySetAddShortcutBorder(pParse, p, prop, v)
         pBorderStyle = HtmlCssStringToProperty("none", -1);
     }
 
+    /* propertySetAdd() takes ownership of (and may free) the value passed
+     * to it, so pass a copy each time.
+     */
     for (i = iOffset; i < iOffset+nProp; i++) {
-        CssProperty *pC = pBorderColor;
-        CssProperty *pW = pBorderWidth;
-        CssProperty *pS = pBorderStyle;
-        if (i != iOffset) {
-            pC = propertyDup(pC);
-            pW = propertyDup(pW);
-            pS = propertyDup(pS);
-        }
-        propertySetAdd(p, aColor[i], pC);
-        propertySetAdd(p, aWidth[i], pW);
-        propertySetAdd(p, aStyle[i], pS);
+        propertySetAdd(p, aColor[i], propertyDup(pBorderColor));
+        propertySetAdd(p, aWidth[i], propertyDup(pBorderWidth));
+        propertySetAdd(p, aStyle[i], propertyDup(pBorderStyle));
     }
-    return;
 
   parse_error:
     HtmlFree(pBorderStyle);
@@ -1233,6 +1773,7 @@ shortcutBackground(pParse, p, v)
                     break;
 
                 case CSS_TYPE_URL:
+                case CSS_TYPE_URLCMD:
                 case CSS_CONST_NONE:
                     if (pImage) goto error_out;
                     pImage = pProp;
@@ -1376,6 +1917,7 @@ shortcutListStyle(pParse, p, v)
                     break;
 
                 case CSS_TYPE_URL:
+                case CSS_TYPE_URLCMD:
                 case CSS_TYPE_STRING:
                 case CSS_TYPE_RAW:
                     if (pImage) goto bad_parse;
@@ -1461,6 +2003,20 @@ propertySetAddList(pParse, eProp, p, v)
     }
     assert(apProp[nElem] == 0);
 
+    /* Record whether or not the stylesheet uses counters. If it does not,
+     * the style engine does not need to track counter values at all (see
+     * HtmlCssStyleSheetCounters()).
+     */
+    if (eProp != CSS_PROPERTY_CONTENT) {
+        pParse->pStyle->isCounters = 1;
+    }
+    for (n = 0; apProp[n]; n++) {
+        int eType = apProp[n]->eType;
+        if (eType == CSS_TYPE_COUNTER || eType == CSS_TYPE_COUNTERS) {
+            pParse->pStyle->isCounters = 1;
+        }
+    }
+
     propertySetAdd(p, eProp, pProp);
 }
 
@@ -1529,7 +2085,7 @@ textToFontFamilyProperty(pParse, zText, nText)
 {
     const char *zFamily = 0;
 
-    Tcl_HashTable *aFamily = &pParse->pTree->aFontFamilies;
+    Tcl_HashTable *aFamily = pParse->pFontFamilies;
     const char *zCsr = zText;
     const char *zEnd = &zText[nText];
 
@@ -1992,8 +2548,15 @@ static void selectorFree(pSelector)
 {
     if( !pSelector ) return;
     selectorFree(pSelector->pNext);
-    HtmlFree(pSelector->zValue);
+    if (pSelector->aOp) {
+        CssMatchOp *pOp;
+        for (pOp = pSelector->aOp; pOp->eOp; pOp++) {
+            if (pOp->zAtom) classAtomRelease(pOp->zAtom);
+        }
+    }
+    HtmlFree(pSelector->zValue);
     HtmlFree(pSelector->zAttr);
+    HtmlFree(pSelector->aOp);
     HtmlFree(pSelector);
 }
 
@@ -2129,78 +2692,78 @@ newCssPriority(pStyle, origin, pIdTail, important)
 /*
  *---------------------------------------------------------------------------
  *
- * cssParse --
+ * cssParseInit --
+ * cssParseRun --
+ * cssParseFinish --
  *
- *     This routine does the work of parsing stylesheets or style
- *     attributes on behalf of HtmlCssParse() and HtmlCssInlineParse()
- *     respectively. 
- * 
- *     The first two argument identify the length of, and the text to be
- *     parsed.
+ *     These three functions are used by cssParse() and by the 
+ *     [style -async] code (see HtmlStyleParseAsync()) to parse a 
+ *     stylesheet or style attribute.
  *
- *     The third argument is true if z points to the text of a style
- *     attribute, i.e: "color:red ; margin:0.4em". If false, then z points
- *     to a complete stylesheet document, i.e. "H1 {text-size: 1.2em}". 
- *     The stylesheet produced when parsing a style is the same as 
- *     "* {<style text>}".
+ *     cssParseInit() initializes parse context *pParse. The arguments
+ *     are as for cssParse(). If *ppStyle is NULL, a new CssStyleSheet
+ *     object is created to add the parsed rules to. If pStyleId is not
+ *     NULL, the priority entries for this stylesheet are added to it.
+ *
+ *     cssParseRun() runs the parser. Unless the CssParse.isDetached flag
+ *     is set, this must be called by the thread that owns the widget.
+ *     If it is set, the parse does not use the widget or interpreter
+ *     (see the comments above struct CssParse in cssInt.h). It may then
+ *     be run by any thread.
+ *
+ *     cssParseFinish() frees the resources used by the parse context and
+ *     sets the -errorvar variable, if any, to the list of syntax errors.
+ *     The stylesheet object at pParse->pStyle is not freed.
  *
  * Results:
  *     None.
  *
  * Side effects:
- *     None.
+ *     See above.
  *
  *---------------------------------------------------------------------------
  */
-static int 
-cssParse(
-pTree, n, z, isStyle, origin, pStyleId, pImportCmd, pUrlCmd, pErrorVar, ppStyle)
+static void
+cssParseInit(pParse, pTree, origin, pStyleId, pImportCmd, pUrlCmd, isErrorLog, pStyle)
+    CssParse *pParse;
     HtmlTree *pTree;
-    int n;                       /* Size of z in bytes */
-    CONST char *z;               /* Text of attribute/document */
-    int isStyle;                 /* True if this is a style attribute */
     int origin;                  /* CSS_ORIGIN_* value */
     Tcl_Obj *pStyleId;           /* Second and later parts of stylesheet id */
     Tcl_Obj *pImportCmd;         /* Command to invoke to process @import */
     Tcl_Obj *pUrlCmd;            /* Command to invoke to translate url() */
-    Tcl_Obj *pErrorVar;          /* Name of error-log variable */
-    CssStyleSheet **ppStyle;     /* IN/OUT: Stylesheet to append to   */
+    int isErrorLog;              /* True to record syntax errors */
+    CssStyleSheet *pStyle;       /* Stylesheet to append to, or NULL */
 {
-    CssParse sParse;
-    int ii;
-
-    memset(&sParse, 0, sizeof(CssParse));
-    sParse.origin = origin;
-    sParse.pStyleId = pStyleId;
-    sParse.pImportCmd = pImportCmd;
-    sParse.pUrlCmd = pUrlCmd;
-    sParse.interp = (pTree ? pTree->interp : 0);
-    sParse.pTree = pTree;
-    if (pErrorVar) {
-        sParse.pErrorLog = Tcl_NewObj();
-        Tcl_IncrRefCount(sParse.pErrorLog);
-    }
-
-    if( n<0 ){
-        n = strlen(z);
+    memset(pParse, 0, sizeof(CssParse));
+    pParse->origin = origin;
+    pParse->pStyleId = pStyleId;
+    pParse->pImportCmd = pImportCmd;
+    pParse->pUrlCmd = pUrlCmd;
+    pParse->isErrorLog = isErrorLog;
+    if (pTree) {
+        pParse->interp = pTree->interp;
+        pParse->pTree = pTree;
+        pParse->isQuirks = (pTree->options.mode == HTML_MODE_QUIRKS);
+        pParse->pFontFamilies = &pTree->aFontFamilies;
     }
 
-    /* If *ppStyle is NULL, then create a new CssStyleSheet object. If it
+    /* If pStyle is NULL, then create a new CssStyleSheet object. If it
      * is not zero, then append the rules from the new stylesheet document
      * to the existing object.
      */
-    if (0==*ppStyle) {
-        sParse.pStyle = HtmlNew(CssStyleSheet);
+    if (!pStyle) {
+        pStyle = HtmlNew(CssStyleSheet);
         
         /* If pStyleId is not NULL, then initialise the hash-tables */
         if (pStyleId) {
-            Tcl_InitHashTable(&sParse.pStyle->aByTag, TCL_STRING_KEYS);
-            Tcl_InitHashTable(&sParse.pStyle->aByClass, TCL_STRING_KEYS);
-            Tcl_InitHashTable(&sParse.pStyle->aById, TCL_STRING_KEYS);
+            Tcl_InitHashTable(&pStyle->aByTag, TCL_STRING_KEYS);
+            Tcl_InitHashTable(&pStyle->aByClass, TCL_STRING_KEYS);
+            Tcl_InitHashTable(&pStyle->aById, TCL_STRING_KEYS);
+            Tcl_InitHashTable(&pStyle->aByAttr, TCL_STRING_KEYS);
+            Tcl_InitHashTable(&pStyle->aDepend, TCL_STRING_KEYS);
         }
-    } else {
-        sParse.pStyle = *ppStyle;
     }
+    pParse->pStyle = pStyle;
 
     /* If this is a stylesheet, not a style attribute, add the priority
      * entries for both regular and "!important" properties for this
@@ -2211,31 +2774,125 @@ pTree, n, z, isStyle, origin, pStyleId, pImportCmd, pUrlCmd, pErrorVar, ppStyle)
      * right or not...
      */
     if (pStyleId) {
-        sParse.pPriority1 = newCssPriority(sParse.pStyle, origin, pStyleId, 0);
-        sParse.pPriority2 = newCssPriority(sParse.pStyle, origin, pStyleId, 1);
+        pParse->pPriority1 = newCssPriority(pStyle, origin, pStyleId, 0);
+        pParse->pPriority2 = newCssPriority(pStyle, origin, pStyleId, 1);
     }
+}
+
+static void
+cssParseRun(pParse, isStyle, n, z)
+    CssParse *pParse;
+    int isStyle;                 /* True if this is a style attribute */
+    int n;                       /* Size of z in bytes */
+    CONST char *z;               /* Text of attribute/document */
+{
+    CssInternTable *pTable = internTable();
+    int isDetached = pTable->isDetached;
+    int ii;
 
+    pTable->isDetached = pParse->isDetached;
     if (isStyle) {
-        HtmlCssRunStyleParser(z, n, &sParse);
+        HtmlCssRunStyleParser(z, n, pParse);
     } else {
-        HtmlCssRunParser(z, n, &sParse);
+        HtmlCssRunParser(z, n, pParse);
     }
 
-    *ppStyle = sParse.pStyle;
+    /* Clean up anything left in *pParse by a syntax error. */
+    selectorFree(pParse->pSelector);
+    for (ii = 0; ii < pParse->nXtra; ii++) {
+        selectorFree(pParse->apXtraSelector[ii]);
+    }
+    HtmlFree(pParse->apXtraSelector);
+    propertySetFree(pParse->pPropertySet);
+    propertySetFree(pParse->pImportant);
+    pParse->pSelector = 0;
+    pParse->apXtraSelector = 0;
+    pParse->nXtra = 0;
+    pParse->pPropertySet = 0;
+    pParse->pImportant = 0;
+    pTable->isDetached = isDetached;
+}
 
-    /* Clean up anything left in sParse */
-    selectorFree(sParse.pSelector);
-    for (ii = 0; ii < sParse.nXtra; ii++) {
-        selectorFree(sParse.apXtraSelector[ii]);
+static void
+cssParseFinish(pParse, pErrorVar)
+    CssParse *pParse;
+    Tcl_Obj *pErrorVar;          /* Name of error-log variable, or NULL */
+{
+    if (pParse->isUrlCacheInit) {
+        urlCacheDelete(&pParse->aUrlCache);
+        Tcl_DeleteHashTable(&pParse->aUrlCache);
+        pParse->isUrlCacheInit = 0;
     }
-    propertySetFree(sParse.pPropertySet);
-    propertySetFree(sParse.pImportant);
 
     if (pErrorVar) {
-        Tcl_ObjSetVar2(pTree->interp, pErrorVar, 0, sParse.pErrorLog, 0);
-        Tcl_DecrRefCount(sParse.pErrorLog);
+        Tcl_Obj *pErrorLog = Tcl_NewObj();
+        int ii;
+        Tcl_IncrRefCount(pErrorLog);
+        for (ii = 0; ii < pParse->nError; ii++) {
+            Tcl_Obj *pInt = Tcl_NewIntObj(pParse->aError[ii]);
+            Tcl_ListObjAppendElement(0, pErrorLog, pInt);
+        }
+        Tcl_ObjSetVar2(pParse->interp, pErrorVar, 0, pErrorLog, 0);
+        Tcl_DecrRefCount(pErrorLog);
+    }
+    HtmlFree(pParse->aError);
+    pParse->aError = 0;
+    pParse->nError = 0;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * cssParse --
+ *
+ *     This routine does the work of parsing stylesheets or style
+ *     attributes on behalf of HtmlCssParse() and HtmlCssInlineParse()
+ *     respectively. 
+ * 
+ *     The first two argument identify the length of, and the text to be
+ *     parsed.
+ *
+ *     The third argument is true if z points to the text of a style
+ *     attribute, i.e: "color:red ; margin:0.4em". If false, then z points
+ *     to a complete stylesheet document, i.e. "H1 {text-size: 1.2em}". 
+ *     The stylesheet produced when parsing a style is the same as 
+ *     "* {<style text>}".
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int 
+cssParse(
+pTree, n, z, isStyle, origin, pStyleId, pImportCmd, pUrlCmd, pErrorVar, ppStyle)
+    HtmlTree *pTree;
+    int n;                       /* Size of z in bytes */
+    CONST char *z;               /* Text of attribute/document */
+    int isStyle;                 /* True if this is a style attribute */
+    int origin;                  /* CSS_ORIGIN_* value */
+    Tcl_Obj *pStyleId;           /* Second and later parts of stylesheet id */
+    Tcl_Obj *pImportCmd;         /* Command to invoke to process @import */
+    Tcl_Obj *pUrlCmd;            /* Command to invoke to translate url() */
+    Tcl_Obj *pErrorVar;          /* Name of error-log variable */
+    CssStyleSheet **ppStyle;     /* IN/OUT: Stylesheet to append to   */
+{
+    CssParse sParse;
+
+    if( n<0 ){
+        n = strlen(z);
     }
 
+    cssParseInit(&sParse, 
+        pTree, origin, pStyleId, pImportCmd, pUrlCmd, (pErrorVar!=0), *ppStyle
+    );
+    cssParseRun(&sParse, isStyle, n, z);
+    *ppStyle = sParse.pStyle;
+    cssParseFinish(&sParse, pErrorVar);
+
     return 0;
 }
 
@@ -2249,12 +2906,22 @@ HtmlCssSelectorParse(pTree, n, z, ppStyle)
     return cssParse(pTree, n, z, 0, 0, 0, 0, 0, 0, ppStyle);
 }
 
+static void ruleFree(CssRule *);
+static int ruleCompare(CssRule *, CssRule *);
+
+/*
+ * Return true if rule pRule should currently be applied to the document. 
+ * This is always true unless the rule is part of an @media block with a
+ * condition that does not match.
+ */
+#define ruleIsActive(pRule) (!(pRule)->pMedia || (pRule)->pMedia->isMatch)
+
 /*
  *---------------------------------------------------------------------------
  *
- * HtmlStyleParse --
+ * mediaListFree --
  *
- *     Compile a stylesheet document from text and add it to the widget.
+ *     Free each CssMedia structure in the linked list pMedia.
  *
  * Results:
  *     None.
@@ -2264,151 +2931,157 @@ HtmlCssSelectorParse(pTree, n, z, ppStyle)
  *
  *---------------------------------------------------------------------------
  */
-int 
-HtmlStyleParse(pTree, pStyleText, pId, pImportCmd, pUrlCmd, pErrorVar)
-    HtmlTree *pTree;
-    Tcl_Obj *pStyleText;
-    Tcl_Obj *pId;
-    Tcl_Obj *pImportCmd;
-    Tcl_Obj *pUrlCmd;
-    Tcl_Obj *pErrorVar;
+static void
+mediaListFree(pMedia)
+    CssMedia *pMedia;
 {
-    int origin = 0;
-    Tcl_Obj *pStyleId = 0;
-    CONST char *zId;
-    CONST char *zStyleText;
-    int nStyleText;
-
-    /* Parse up the stylesheet id. It must begin with one of the strings
-     * "agent", "user" or "author". After that it may contain any text.
-     */
-    zId = Tcl_GetString(pId);
-    if (0==strncmp("agent", zId, 5)) {
-        origin = CSS_ORIGIN_AGENT;
-        pStyleId = Tcl_NewStringObj(&zId[5], -1);
-    }
-    else if (0==strncmp("user", zId, 4)) {
-        origin = CSS_ORIGIN_USER;
-        pStyleId = Tcl_NewStringObj(&zId[4], -1);
-    }
-    else if (0==strncmp("author", zId, 5)) {
-        origin = CSS_ORIGIN_AUTHOR;
-        pStyleId = Tcl_NewStringObj(&zId[6], -1);
-    }
-    if (!pStyleId) {
-        Tcl_AppendResult(pTree->interp, "Bad style-sheet-id: ", zId, NULL);
-        return TCL_ERROR;
+    while (pMedia) {
+        CssMedia *pNext = pMedia->pNext;
+        HtmlFree(pMedia);
+        pMedia = pNext;
     }
-    Tcl_IncrRefCount(pStyleId);
-
-    /* If there is already a stylesheet in pTree->pStyle, then this call will
-     * parse the stylesheet text in pStyleText and append rules to the
-     * existing stylesheet. If pTree->pStyle is NULL, then a new stylesheet is
-     * created. Within Tkhtml, each document only ever has a single stylesheet
-     * object, possibly created by combining text from multiple stylesheet
-     * documents.
-     */
-    zStyleText = Tcl_GetStringFromObj(pStyleText, &nStyleText);
-    cssParse(
-        pTree,
-        nStyleText, zStyleText,            /* Stylesheet text */
-        0,                                 /* This is not a style attribute */
-        origin,                            /* Origin - CSS_ORIGIN_XXX */
-        pStyleId,                          /* Rest of -id option */
-        pImportCmd,                        /* How to handle @import */
-        pUrlCmd,                           /* How to handle url() */
-        pErrorVar,                         /* Variable to store errors in */
-        &pTree->pStyle                     /* CssStylesheet to update/create */
-    );
-
-    Tcl_DecrRefCount(pStyleId);
-    return TCL_OK;
 }
 
-/*--------------------------------------------------------------------------
+/*
+ *---------------------------------------------------------------------------
  *
- * HtmlCssInlineParse --
+ * priorityIsMatch --
  *
- *     Parse the style attribute value pointed to by z, length n bytes. See
- *     comments above cssParse() for more detail.
+ *     Return true if the CssPriority object pPriority belongs to the 
+ *     stylesheet identified by origin and zIdTail. The important flag
+ *     is not considered.
  *
  * Results:
- *
- *     Returns a CssStyleSheet pointer, written to *ppStyle.
+ *     Boolean.
  *
  * Side effects:
+ *     None.
  *
- *--------------------------------------------------------------------------
+ *---------------------------------------------------------------------------
  */
-int 
-HtmlCssInlineParse(
-    HtmlTree *pTree,
-    int n,
-    const char *z,
-    CssPropertySet **ppPropertySet
-){
-    CssStyleSheet *pStyle = 0;
-    assert(ppPropertySet && !(*ppPropertySet));
-    cssParse(pTree, n, z, 1, 0, 0, 0, 0, 0, &pStyle);
-
-    if (pStyle) {
-        if (pStyle->pUniversalRules) {
-            assert(!pStyle->pUniversalRules->pNext);
-            *ppPropertySet = pStyle->pUniversalRules->pPropertySet;
-            pStyle->pUniversalRules->pPropertySet = 0;
-        }
-        assert(!pStyle->pPriority);
-        HtmlCssStyleSheetFree(pStyle);
-    }
-    return 0;
+static int
+priorityIsMatch(pPriority, origin, zIdTail)
+    CssPriority *pPriority;
+    int origin;
+    const char *zIdTail;
+{
+    return (
+        pPriority->origin == origin && 
+        0 == strcmp(Tcl_GetString(pPriority->pIdTail), zIdTail)
+    );
 }
 
 /*
  *---------------------------------------------------------------------------
  *
- * ruleFree --
+ * removeRulesList --
+ * removeRulesHash --
  *
- *     Free the CssRule object pRule.
+ *     Unlink all rules that belong to the stylesheet identified by origin
+ *     and zIdTail from a rules list (or from each list in a hash table of
+ *     rules lists). The unlinked rules are prepended to the list at
+ *     *ppRemoved. The relative order of the remaining rules is not
+ *     modified.
+ *
+ *     Hash table entries that are left with an empty rules list are
+ *     deleted.
  *
  * Results:
  *     None.
  *
  * Side effects:
- *     None.
+ *     Modifies the list *ppList or the lists in hash table pHash.
  *
  *---------------------------------------------------------------------------
  */
-static void 
-ruleFree(pRule)
-    CssRule *pRule;
+static void
+removeRulesList(ppList, origin, zIdTail, ppRemoved)
+    CssRule **ppList;
+    int origin;
+    const char *zIdTail;
+    CssRule **ppRemoved;
 {
-    if (pRule) {
-        if (pRule->freeSelector) {
-            selectorFree(pRule->pSelector);
+    CssRule **pp = ppList;
+    while (*pp) {
+        CssRule *pRule = *pp;
+        if (priorityIsMatch(pRule->pPriority, origin, zIdTail)) {
+            *pp = pRule->pNext;
+            pRule->pNext = *ppRemoved;
+            *ppRemoved = pRule;
+        } else {
+            pp = &pRule->pNext;
         }
-        if (pRule->freePropertySets) {
-            propertySetFree(pRule->pPropertySet);
+    }
+}
+static void
+removeRulesHash(pHash, origin, zIdTail, ppRemoved)
+    Tcl_HashTable *pHash;
+    int origin;
+    const char *zIdTail;
+    CssRule **ppRemoved;
+{
+    Tcl_HashSearch search;
+    Tcl_HashEntry *pEntry;
+  
+    for (
+        pEntry = Tcl_FirstHashEntry(pHash, &search); 
+        pEntry; 
+        pEntry = Tcl_NextHashEntry(&search)
+    ) {
+        CssRule *pList = (CssRule *)Tcl_GetHashValue(pEntry);
+        removeRulesList(&pList, origin, zIdTail, ppRemoved);
+        if (pList) {
+            Tcl_SetHashValue(pEntry, pList);
+        } else {
+            Tcl_DeleteHashEntry(pEntry);
         }
-        HtmlFree(pRule);
     }
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * collectRulesList --
+ * collectRulesHash --
+ *
+ *     Append a pointer to each rule in a rules list (or in each list in
+ *     a hash table of rules lists) to the growable array 
+ *     (*papRule, *pnRule, *pnAlloc).
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May reallocate *papRule.
+ *
+ *---------------------------------------------------------------------------
+ */
 static void
-freeRulesList(ppList)
-    CssRule **ppList;
+collectRulesList(pList, papRule, pnRule, pnAlloc)
+    CssRule *pList;
+    CssRule ***papRule;
+    int *pnRule;
+    int *pnAlloc;
 {
-    CssRule *pRule = *ppList;
-    while (pRule) { 
-        CssRule *pNext = pRule->pNext;
-        ruleFree(pRule);
-        pRule = pNext;
+    CssRule *pRule;
+    for (pRule = pList; pRule; pRule = pRule->pNext) {
+        if (*pnRule == *pnAlloc) {
+            int nByte;
+            *pnAlloc = (*pnAlloc + 16) * 2;
+            nByte = *pnAlloc * sizeof(CssRule *);
+            *papRule = (CssRule **)HtmlRealloc(
+                "CssRule*[]", (char *)*papRule, nByte
+            );
+        }
+        (*papRule)[(*pnRule)++] = pRule;
     }
-    *ppList = 0;
 }
-
 static void
-freeRulesHash(pHash)
+collectRulesHash(pHash, papRule, pnRule, pnAlloc)
     Tcl_HashTable *pHash;
+    CssRule ***papRule;
+    int *pnRule;
+    int *pnAlloc;
 {
     Tcl_HashSearch search;
     Tcl_HashEntry *pEntry;
@@ -2418,41 +3091,1308 @@ freeRulesHash(pHash)
         pEntry; 
         pEntry = Tcl_NextHashEntry(&search)
     ) {
-        CssRule *pRule = (CssRule *)Tcl_GetHashValue(pEntry);
-        freeRulesList(&pRule);
+        CssRule *pList = (CssRule *)Tcl_GetHashValue(pEntry);
+        collectRulesList(pList, papRule, pnRule, pnAlloc);
     }
-    Tcl_DeleteHashTable(pHash);
 }
 
 /*
  *---------------------------------------------------------------------------
  *
- * HtmlCssStyleSheetFree --
+ * styleSheetCollect --
  *
- *     Delete the internal representation of the stylesheet configuration.
+ *     Append a pointer to each rule in stylesheet pStyle to the array
+ *     (*papRule, *pnRule). *papRule should initially be NULL.
  *
  * Results:
  *     None.
  *
  * Side effects:
- *     None.
+ *     Allocates *papRule. The caller should free it using HtmlFree().
  *
  *---------------------------------------------------------------------------
  */
-void 
-HtmlCssStyleSheetFree(pStyle)
+static void
+styleSheetCollect(pStyle, papRule, pnRule)
     CssStyleSheet *pStyle;
+    CssRule ***papRule;
+    int *pnRule;
 {
-    if (pStyle) {
-        CssPriority *pPriority;
+    int nAlloc = 0;
+    collectRulesList(pStyle->pUniversalRules, papRule, pnRule, &nAlloc);
+    collectRulesList(pStyle->pAfterRules, papRule, pnRule, &nAlloc);
+    collectRulesList(pStyle->pBeforeRules, papRule, pnRule, &nAlloc);
+    collectRulesHash(&pStyle->aByTag, papRule, pnRule, &nAlloc);
+    collectRulesHash(&pStyle->aByClass, papRule, pnRule, &nAlloc);
+    collectRulesHash(&pStyle->aById, papRule, pnRule, &nAlloc);
+    collectRulesHash(&pStyle->aByAttr, papRule, pnRule, &nAlloc);
+}
 
-        /* Free the universal rules list */
-        freeRulesList(&pStyle->pUniversalRules); 
-        freeRulesList(&pStyle->pAfterRules); 
-        freeRulesList(&pStyle->pBeforeRules); 
-        freeRulesHash(&pStyle->aByTag); 
+/*
+ * Context object used by HtmlStyleParse(), HtmlCssMediaUpdate() and 
+ * replaceInvalidateCb() to find the nodes affected when a stylesheet is 
+ * replaced, or when rules are enabled or disabled by an @media condition.
+ */
+typedef struct CssReplace CssReplace;
+struct CssReplace {
+    CssRule *pRemoved;        /* Linked list of rules being removed */
+    CssRule **apAdded;        /* Array of rules just added (or toggled) */
+    int nAdded;               /* Size of apAdded[] */
+    int nRestyle;             /* Number of nodes scheduled for restyle */
+};
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * replaceInvalidateCb --
+ *
+ *     An HtmlWalkTree() callback invoked for each node in the document
+ *     after the rules belonging to a stylesheet have been replaced, or
+ *     after rules have been enabled or disabled by a change in the result
+ *     of an @media condition. If any of the removed or added (or toggled)
+ *     rules may match the node, or if the node has a dynamic condition 
+ *     that refers to a removed selector, the node is scheduled for 
+ *     restyle.
+ *
+ *     Selectors are tested as if all dynamic conditions (:hover etc.)
+ *     were true, so that nodes that only match a rule while the 
+ *     pointer is over them are also caught.
+ *
+ * Results:
+ *     HTML_WALK_DESCEND.
+ *
+ * Side effects:
+ *     May call HtmlCallbackRestyle().
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+replaceInvalidateCb(pTree, pNode, clientData)
+    HtmlTree *pTree;
+    HtmlNode *pNode;
+    ClientData clientData;
+{
+    CssReplace *p = (CssReplace *)clientData;
+    HtmlElementNode *pElem = HtmlNodeAsElement(pNode);
+
+    if (pElem) {
+        int isAffected = 0;
+        CssRule *pRule;
+        int ii;
+
+        /* Any dynamic conditions attached to this node that refer to
+         * the selectors being removed are invalid. Discard all of the
+         * dynamic conditions for this node; they are recalculated when 
+         * the node is restyled.
+         */
+        for (pRule = p->pRemoved; pRule && !isAffected; pRule = pRule->pNext){
+            if (HtmlCssDynamicUsesSelector(pElem, pRule->pSelector)) {
+                isAffected = 1;
+            }
+        }
+
+        for (pRule = p->pRemoved; pRule && !isAffected; pRule = pRule->pNext){
+            isAffected = HtmlCssSelectorTest(pRule->pSelector, pNode, 1);
+        }
+        for (ii = 0; ii < p->nAdded && !isAffected; ii++) {
+            isAffected = HtmlCssSelectorTest(p->apAdded[ii]->pSelector,pNode,1);
+        }
+
+        if (isAffected) {
+            HtmlCssFreeDynamics(pTree, pElem);
+            HtmlCallbackRestyle(pTree, pNode);
+            p->nRestyle++;
+        }
+    }
+
+    return HTML_WALK_DESCEND;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * styleSheetUnlink --
+ *
+ *     Remove all rules and priority list entries that belong to the
+ *     stylesheet identified by origin and zIdTail from stylesheet pStyle.
+ *     The removed rules are returned as a linked list (using the
+ *     CssRule.pNext pointers) and the removed priorities and @media 
+ *     conditions are written to *ppPriority and *ppMedia. None are freed
+ *     by this function, as the caller
+ *     needs to test the removed selectors against the document tree
+ *     before they are deleted. See styleSheetReplaced().
+ *
+ * Results:
+ *     Linked list of removed rules.
+ *
+ * Side effects:
+ *     Modifies the rules lists and hash tables of pStyle.
+ *
+ *---------------------------------------------------------------------------
+ */
+static CssRule *
+styleSheetUnlink(pStyle, origin, zIdTail, ppPriority, ppMedia)
+    CssStyleSheet *pStyle;
+    int origin;
+    const char *zIdTail;
+    CssPriority **ppPriority;
+    CssMedia **ppMedia;
+{
+    CssRule *pRemoved = 0;
+    CssPriority **pp;
+    CssMedia **ppM;
+
+    removeRulesList(&pStyle->pUniversalRules, origin, zIdTail, &pRemoved);
+    removeRulesList(&pStyle->pAfterRules, origin, zIdTail, &pRemoved);
+    removeRulesList(&pStyle->pBeforeRules, origin, zIdTail, &pRemoved);
+    removeRulesHash(&pStyle->aByTag, origin, zIdTail, &pRemoved);
+    removeRulesHash(&pStyle->aByClass, origin, zIdTail, &pRemoved);
+    removeRulesHash(&pStyle->aById, origin, zIdTail, &pRemoved);
+    removeRulesHash(&pStyle->aByAttr, origin, zIdTail, &pRemoved);
+
+    /* Because the relative priority of two stylesheets depends only on
+     * their origin and id values, the CssPriority.iPriority values of
+     * the remaining entries do not need to be updated.
+     */
+    pp = &pStyle->pPriority;
+    while (*pp) {
+        CssPriority *pPriority = *pp;
+        if (priorityIsMatch(pPriority, origin, zIdTail)) {
+            *pp = pPriority->pNext;
+            pPriority->pNext = *ppPriority;
+            *ppPriority = pPriority;
+        } else {
+            pp = &pPriority->pNext;
+        }
+    }
+
+    ppM = &pStyle->pMedia;
+    while (*ppM) {
+        CssMedia *pMedia = *ppM;
+        if (priorityIsMatch(pMedia->pPriority, origin, zIdTail)) {
+            *ppM = pMedia->pNext;
+            pMedia->pNext = *ppMedia;
+            *ppMedia = pMedia;
+        } else {
+            ppM = &pMedia->pNext;
+        }
+    }
+
+    return pRemoved;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * styleSheetReplaced --
+ *
+ *     This is called after the rules belonging to a stylesheet have been
+ *     removed by styleSheetUnlink() and the replacement stylesheet text
+ *     (if any) parsed into the detached stylesheet pNew. Each node in the
+ *     document that may be matched by a removed rule or a rule in pNew is
+ *     scheduled for restyle. Then the removed rules, priority list 
+ *     entries and @media conditions are freed.
+ *
+ *     This function should be called before pNew is merged into the
+ *     widget stylesheet.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Frees the rules in list pRemoved, priorities in list pPriority and
+ *     media conditions in list pMedia.
+ *     May call HtmlCallbackRestyle().
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+styleSheetReplaced(pTree, pNew, pRemoved, pPriority, pMedia)
+    HtmlTree *pTree;
+    CssStyleSheet *pNew;
+    CssRule *pRemoved;
+    CssPriority *pPriority;
+    CssMedia *pMedia;
+{
+    CssReplace sReplace;
+
+    memset(&sReplace, 0, sizeof(CssReplace));
+    sReplace.pRemoved = pRemoved;
+
+    if (pNew) {
+        styleSheetCollect(pNew, &sReplace.apAdded, &sReplace.nAdded);
+    }
+
+    if (pTree->pRoot && (sReplace.pRemoved || sReplace.nAdded > 0)) {
+        HtmlWalkTree(pTree, 0, replaceInvalidateCb, (ClientData)&sReplace);
+    }
+    LOG {
+        HtmlLog(pTree, "STYLEENGINE", 
+            "Replaced stylesheet: %d rules added, %d nodes restyled",
+            sReplace.nAdded, sReplace.nRestyle
+        );
+    }
+
+    /* Rules that share a selector or property set were all parsed from
+     * the same stylesheet text, so they are always removed together. 
+     * This means it is safe to free them in any order.
+     */
+    while (pRemoved) {
+        CssRule *pNext = pRemoved->pNext;
+        ruleFree(pRemoved);
+        pRemoved = pNext;
+    }
+    while (pPriority) {
+        CssPriority *pNext = pPriority->pNext;
+        Tcl_DecrRefCount(pPriority->pIdTail);
+        HtmlFree(pPriority);
+        pPriority = pNext;
+    }
+    mediaListFree(pMedia);
+    HtmlFree(sReplace.apAdded);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * mergeRulesList --
+ * mergeRulesHash --
+ *
+ *     Merge the rules in list pNew (or in each list in hash table pNew)
+ *     into the list *ppList (or into the corresponding list in hash table
+ *     pHash). Both lists are sorted in order of decreasing priority (see
+ *     ruleCompare()), and so is the merged list. As in insertRule(), if
+ *     two rules have the same priority the rule from pNew is placed first.
+ *
+ *     mergeRulesHash() leaves the entries in hash table pNew pointing to
+ *     rules that are now part of the lists in pHash. The caller should
+ *     delete the table without freeing the rules.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Modifies the list *ppList, or the lists in hash table pHash.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+mergeRulesList(ppList, pNew)
+    CssRule **ppList;
+    CssRule *pNew;
+{
+    CssRule **pp = ppList;
+    while (pNew) {
+        if (!*pp || ruleCompare(*pp, pNew) <= 0) {
+            CssRule *pNext = pNew->pNext;
+            pNew->pNext = *pp;
+            *pp = pNew;
+            pNew = pNext;
+        }
+        pp = &(*pp)->pNext;
+    }
+}
+static void
+mergeRulesHash(pHash, pNew)
+    Tcl_HashTable *pHash;
+    Tcl_HashTable *pNew;
+{
+    Tcl_HashSearch search;
+    Tcl_HashEntry *pEntry;
+  
+    for (
+        pEntry = Tcl_FirstHashEntry(pNew, &search); 
+        pEntry; 
+        pEntry = Tcl_NextHashEntry(&search)
+    ) {
+        int isNew;
+        CssRule *pList = 0;
+        const char *zKey = Tcl_GetHashKey(pNew, pEntry);
+        Tcl_HashEntry *pTarget = Tcl_CreateHashEntry(pHash, zKey, &isNew);
+        if (!isNew) {
+            pList = (CssRule *)Tcl_GetHashValue(pTarget);
+        }
+        mergeRulesList(&pList, (CssRule *)Tcl_GetHashValue(pEntry));
+        Tcl_SetHashValue(pTarget, pList);
+    }
+}
+
+/*
+ * Merge the CSS_DEPEND_XXX masks in hash table pNew into pHash.
+ */
+static void
+mergeDependHash(pHash, pNew)
+    Tcl_HashTable *pHash;
+    Tcl_HashTable *pNew;
+{
+    Tcl_HashSearch search;
+    Tcl_HashEntry *pEntry;
+
+    for (
+        pEntry = Tcl_FirstHashEntry(pNew, &search); 
+        pEntry; 
+        pEntry = Tcl_NextHashEntry(&search)
+    ) {
+        int isNew;
+        int mask = (int)(size_t)Tcl_GetHashValue(pEntry);
+        const char *zKey = Tcl_GetHashKey(pNew, pEntry);
+        Tcl_HashEntry *pTarget = Tcl_CreateHashEntry(pHash, zKey, &isNew);
+        if (!isNew) {
+            mask |= (int)(size_t)Tcl_GetHashValue(pTarget);
+        }
+        Tcl_SetHashValue(pTarget, (ClientData)(size_t)mask);
+    }
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * styleSheetMerge --
+ *
+ *     Merge the detached stylesheet pNew, created by a call to cssParse()
+ *     with a non-NULL pStyleId argument, into the stylesheet *ppStyle.
+ *     If *ppStyle is NULL, then pNew simply becomes the new stylesheet.
+ *
+ *     Parsing a stylesheet document into a detached CssStyleSheet object
+ *     does not depend on or modify the stylesheet currently used by the
+ *     widget. Only this function, which is linear in the number of rules
+ *     in the two stylesheets, modifies the widget configuration.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Frees pNew (the rules and priorities it contains are transfered
+ *     to *ppStyle).
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+styleSheetMerge(ppStyle, pNew)
+    CssStyleSheet **ppStyle;
+    CssStyleSheet *pNew;
+{
+    CssStyleSheet *pStyle = *ppStyle;
+    CssPriority **ppPriority;
+
+    if (!pNew) return;
+    if (!pStyle) {
+        *ppStyle = pNew;
+        return;
+    }
+
+    mergeRulesList(&pStyle->pUniversalRules, pNew->pUniversalRules);
+    mergeRulesList(&pStyle->pAfterRules, pNew->pAfterRules);
+    mergeRulesList(&pStyle->pBeforeRules, pNew->pBeforeRules);
+    mergeRulesHash(&pStyle->aByTag, &pNew->aByTag);
+    mergeRulesHash(&pStyle->aByClass, &pNew->aByClass);
+    mergeRulesHash(&pStyle->aById, &pNew->aById);
+    mergeRulesHash(&pStyle->aByAttr, &pNew->aByAttr);
+    mergeDependHash(&pStyle->aDepend, &pNew->aDepend);
+    Tcl_DeleteHashTable(&pNew->aByTag);
+    Tcl_DeleteHashTable(&pNew->aByClass);
+    Tcl_DeleteHashTable(&pNew->aById);
+    Tcl_DeleteHashTable(&pNew->aByAttr);
+    Tcl_DeleteHashTable(&pNew->aDepend);
+
+    for (ppPriority = &pStyle->pPriority; *ppPriority; ) {
+        ppPriority = &(*ppPriority)->pNext;
+    }
+    *ppPriority = pNew->pPriority;
+    pStyle->nSyntaxErr += pNew->nSyntaxErr;
+    pStyle->isCounters |= pNew->isCounters;
+
+    if (pNew->pMedia) {
+        CssMedia *pLast = pNew->pMedia;
+        while (pLast->pNext) pLast = pLast->pNext;
+        pLast->pNext = pStyle->pMedia;
+        pStyle->pMedia = pNew->pMedia;
+    }
+
+    HtmlFree(pNew);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * styleIdParse --
+ *
+ *     Parse up the stylesheet id pId. It must begin with one of the 
+ *     strings "agent", "user" or "author". After that it may contain any
+ *     text. 
+ *
+ * Results:
+ *     If successful, the CSS_ORIGIN_XXX value is written to *pOrigin and
+ *     a Tcl_Obj containing the rest of the id is returned. The caller
+ *     should eventually call Tcl_DecrRefCount() on it. If pId is not a
+ *     valid stylesheet id, an error is left in the interpreter and NULL
+ *     returned.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static Tcl_Obj *
+styleIdParse(pTree, pId, pOrigin)
+    HtmlTree *pTree;
+    Tcl_Obj *pId;
+    int *pOrigin;
+{
+    Tcl_Obj *pStyleId = 0;
+    CONST char *zId = Tcl_GetString(pId);
+
+    if (0==strncmp("agent", zId, 5)) {
+        *pOrigin = CSS_ORIGIN_AGENT;
+        pStyleId = Tcl_NewStringObj(&zId[5], -1);
+    }
+    else if (0==strncmp("user", zId, 4)) {
+        *pOrigin = CSS_ORIGIN_USER;
+        pStyleId = Tcl_NewStringObj(&zId[4], -1);
+    }
+    else if (0==strncmp("author", zId, 5)) {
+        *pOrigin = CSS_ORIGIN_AUTHOR;
+        pStyleId = Tcl_NewStringObj(&zId[6], -1);
+    }
+    if (!pStyleId) {
+        Tcl_AppendResult(pTree->interp, "Bad style-sheet-id: ", zId, NULL);
+        return 0;
+    }
+    Tcl_IncrRefCount(pStyleId);
+    return pStyleId;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlStyleParse --
+ *
+ *     Compile a stylesheet document from text and add it to the widget.
+ *
+ *     If the isReplace argument is true, then all rules previously added
+ *     to the widget with the same stylesheet id are removed first. In 
+ *     this case only those nodes that may be affected by the removed or
+ *     added rules are scheduled for restyle (the caller should not 
+ *     restyle the whole tree).
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+int 
+HtmlStyleParse(pTree, pStyleText, pId, pImportCmd, pUrlCmd, pErrorVar, isReplace)
+    HtmlTree *pTree;
+    Tcl_Obj *pStyleText;
+    Tcl_Obj *pId;
+    Tcl_Obj *pImportCmd;
+    Tcl_Obj *pUrlCmd;
+    Tcl_Obj *pErrorVar;
+    int isReplace;
+{
+    int origin = 0;
+    Tcl_Obj *pStyleId = 0;
+    CONST char *zStyleText;
+    int nStyleText;
+
+    CssStyleSheet *pNew = 0;            /* Detached stylesheet */
+    CssRule *pRemoved = 0;              /* Rules removed by isReplace */
+    CssPriority *pRemovedPriority = 0;  /* Priorities removed by isReplace */
+    CssMedia *pRemovedMedia = 0;        /* @media removed by isReplace */
+
+    pStyleId = styleIdParse(pTree, pId, &origin);
+    if (!pStyleId) {
+        return TCL_ERROR;
+    }
+
+    /* The stylesheet text in pStyleText is parsed into a new, detached,
+     * stylesheet object. This is then merged into pTree->pStyle. If
+     * pTree->pStyle is NULL, then the new stylesheet object is used 
+     * as is. Within Tkhtml, each document only ever has a single stylesheet
+     * object, possibly created by combining text from multiple stylesheet
+     * documents.
+     */
+    if (isReplace && pTree->pStyle) {
+        pRemoved = styleSheetUnlink(pTree->pStyle, 
+            origin, Tcl_GetString(pStyleId), &pRemovedPriority, &pRemovedMedia
+        );
+    }
+
+    /* When replacing a stylesheet with an empty document there is no need
+     * to run the parser, unless the widget does not have a CssStyleSheet
+     * object yet.
+     */
+    zStyleText = Tcl_GetStringFromObj(pStyleText, &nStyleText);
+    if (nStyleText > 0 || !pTree->pStyle) {
+        cssParse(
+            pTree,
+            nStyleText, zStyleText,        /* Stylesheet text */
+            0,                             /* This is not a style attribute */
+            origin,                        /* Origin - CSS_ORIGIN_XXX */
+            pStyleId,                      /* Rest of -id option */
+            pImportCmd,                    /* How to handle @import */
+            pUrlCmd,                       /* How to handle url() */
+            pErrorVar,                     /* Variable to store errors in */
+            &pNew                          /* Detached CssStylesheet */
+        );
+    } else if (pErrorVar) {
+        Tcl_ObjSetVar2(pTree->interp, pErrorVar, 0, Tcl_NewObj(), 0);
+    }
+
+    if (isReplace) {
+        styleSheetReplaced(
+            pTree, pNew, pRemoved, pRemovedPriority, pRemovedMedia
+        );
+    }
+    styleSheetMerge(&pTree->pStyle, pNew);
+
+    Tcl_DecrRefCount(pStyleId);
+    return TCL_OK;
+}
+
+static void selectorCompile(CssSelector *);
+static void ruleDependencies(CssStyleSheet *, CssRule *);
+static void ruleCompileProperties(CssRule *);
+static void importEval(CssParse *, CssImport *);
+
+/*
+ * Each stylesheet queued by HtmlStyleParseAsync() is represented by an
+ * instance of the following struct. The queue is stored in
+ * HtmlTree.pPendingStyle.
+ *
+ * The stylesheet text is copied to zText, so that it can be parsed by a
+ * worker thread (see pendingStyleStart()). The parse context, sParse, 
+ * is initialized by the Tk thread before the parse is started. Until it
+ * is finished (eState==PENDING_PARSED), sParse and zText are only used
+ * by the thread running the parse.
+ */
+struct CssPendingStyle {
+    char *zText;                /* Private copy of stylesheet text */
+    int nText;                  /* Size of zText in bytes */
+    CssParse sParse;            /* Detached parse context */
+    Tcl_Obj *pErrorVar;         /* Name of -errorvar variable, or NULL */
+    int isReplace;              /* True if -replace was specified */
+    int eState;                 /* One of the PENDING_XXX values */
+#if defined(TCL_THREADS) && !defined(HTML_DEBUG)
+    Tcl_ThreadId thread;        /* Thread running the parse */
+#endif
+    CssPendingStyle *pNext;     /* Next in HtmlTree.pPendingStyle queue */
+};
+#define PENDING_QUEUED  0       /* Parse has not been started */
+#define PENDING_RUNNING 1       /* Being parsed by a worker thread */
+#define PENDING_PARSED  2       /* Parse is finished */
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * pendingStyleThread --
+ * pendingStyleJoin --
+ * pendingStyleStart --
+ *
+ *     pendingStyleStart() starts a worker thread to parse each queued
+ *     stylesheet that is not already parsed, until the number of parses
+ *     running reaches the value of the -stylethreads option (or 1, if 
+ *     the option is set to a smaller value). pendingStyleJoin() waits for
+ *     the worker thread parsing stylesheet p, if any, to finish. 
+ *     pendingStyleThread() is the worker thread entry point.
+ *
+ *     If Tkhtml is not compiled for a threaded Tcl, or HTML_DEBUG is
+ *     defined (the debugging allocator is not thread-safe), or a thread
+ *     cannot be created, stylesheets are parsed by the Tk thread from 
+ *     within pendingStyleCb() instead.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     See above.
+ *
+ *---------------------------------------------------------------------------
+ */
+#if defined(TCL_THREADS) && !defined(HTML_DEBUG)
+static Tcl_ThreadCreateType
+pendingStyleThread(clientData)
+    ClientData clientData;
+{
+    CssPendingStyle *p = (CssPendingStyle *)clientData;
+    cssParseRun(&p->sParse, 0, p->nText, p->zText);
+    Tcl_ExitThread(0);
+    TCL_THREAD_CREATE_RETURN;
+}
+#endif
+
+static void
+pendingStyleJoin(p)
+    CssPendingStyle *p;
+{
+#if defined(TCL_THREADS) && !defined(HTML_DEBUG)
+    if (p->eState == PENDING_RUNNING) {
+        int rc;
+        Tcl_JoinThread(p->thread, &rc);
+        p->eState = PENDING_PARSED;
+    }
+#endif
+}
+
+static void
+pendingStyleStart(pTree)
+    HtmlTree *pTree;
+{
+#if defined(TCL_THREADS) && !defined(HTML_DEBUG)
+    int nThread = MAX(pTree->options.stylethreads, 1);
+    int nRunning = 0;
+    CssPendingStyle *p;
+
+    for (p = pTree->pPendingStyle; p; p = p->pNext) {
+        if (p->eState == PENDING_RUNNING) {
+            nRunning++;
+        }
+    }
+    for (p = pTree->pPendingStyle; p && nRunning < nThread; p = p->pNext) {
+        if (p->eState == PENDING_QUEUED) {
+            int rc = Tcl_CreateThread(&p->thread, pendingStyleThread, 
+                (ClientData)p, TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE
+            );
+            if (rc != TCL_OK) break;
+            p->eState = PENDING_RUNNING;
+            nRunning++;
+        }
+    }
+#endif
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * pendingStyleFree --
+ *
+ *     Free a queued stylesheet, and the detached stylesheet object built
+ *     by parsing it, if any. If a worker thread is still parsing the
+ *     stylesheet, wait for it to finish first.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+pendingStyleFree(p)
+    CssPendingStyle *p;
+{
+    CssParse *pParse = &p->sParse;
+    CssInternTable *pTable = internTable();
+    CssImport *pImport;
+
+    pendingStyleJoin(p);
+
+    /* The property values in the detached stylesheet are not interned. */
+    pTable->isDetached = 1;
+    HtmlCssStyleSheetFree(pParse->pStyle);
+    pTable->isDetached = 0;
+
+    while ((pImport = pParse->pImport)) {
+        pParse->pImport = pImport->pNext;
+        HtmlFree(pImport->pUrl);
+        HtmlFree(pImport->pMedia);
+        HtmlFree(pImport);
+    }
+    cssParseFinish(pParse, 0);
+
+    Tcl_DecrRefCount(pParse->pStyleId);
+    if (pParse->pImportCmd) Tcl_DecrRefCount(pParse->pImportCmd);
+    if (pParse->pUrlCmd)    Tcl_DecrRefCount(pParse->pUrlCmd);
+    if (p->pErrorVar)       Tcl_DecrRefCount(p->pErrorVar);
+    HtmlFree(p->zText);
+    HtmlFree(p);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * propertySetUrlCmd --
+ *
+ *     Translate each CSS_TYPE_URLCMD value in property set pSet, including
+ *     those that are members of CSS_TYPE_LIST values, using 
+ *     propertyUrlCmd(). The values in pSet are not interned.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May invoke the -urlcmd script.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+propertySetUrlCmd(pParse, pSet)
+    CssParse *pParse;
+    CssPropertySet *pSet;
+{
+    int ii;
+    for (ii = 0; ii < pSet->n; ii++) {
+        CssProperty *pProp = pSet->a[ii].pProp;
+        if (!pProp) continue;
+        if (pProp->eType == CSS_TYPE_URLCMD) {
+            pSet->a[ii].pProp = propertyUrlCmd(pParse, pProp);
+        } else if (pProp->eType == CSS_TYPE_LIST) {
+            CssProperty **apProp = (CssProperty **)pProp->v.p;
+            int jj;
+            for (jj = 0; apProp[jj]; jj++) {
+                if (apProp[jj]->eType == CSS_TYPE_URLCMD) {
+                    apProp[jj] = propertyUrlCmd(pParse, apProp[jj]);
+                }
+            }
+        }
+    }
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * pendingStyleMerge --
+ *
+ *     Finish the stylesheet p, which has been parsed into a detached 
+ *     stylesheet object, and merge it into the widget configuration. 
+ *     This does the parts of HtmlStyleParse() that a detached parse 
+ *     cannot:
+ *
+ *         1. The -importcmd script is invoked for each @import directive
+ *            and the -urlcmd script for each url() value, in the order
+ *            in which they appear in the stylesheet. Then the -errorvar
+ *            variable is set.
+ *
+ *         2. The property values are interned, and the selectors and 
+ *            properties of each rule compiled. @media conditions are
+ *            tested.
+ *
+ *         3. If the -replace switch was specified, the rules previously
+ *            added with the same stylesheet id are removed. The new
+ *            stylesheet is merged into pTree->pStyle.
+ *
+ *     The scripts invoked in step 1 may reset or destroy the widget. In
+ *     this case HtmlStyleCancelAsync() clears pTree->pActiveStyle, and
+ *     the stylesheet is discarded instead of merged. The caller must
+ *     ensure that the HtmlTree structure is not freed (see 
+ *     pendingStyleCb()).
+ *
+ * Results:
+ *     True if the stylesheet was merged, or false if it was discarded.
+ *
+ * Side effects:
+ *     See above.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+pendingStyleMerge(pTree, p)
+    HtmlTree *pTree;
+    CssPendingStyle *p;
+{
+    CssParse *pParse = &p->sParse;
+    CssStyleSheet *pNew = pParse->pStyle;
+    int nRule = pParse->iNextRule;
+    CssRule **apRule = 0;
+    CssImport *pImport;
+    CssMedia *pMedia;
+    int ii;
+
+    CssRule *pRemoved = 0;              /* Rules removed by isReplace */
+    CssPriority *pRemovedPriority = 0;  /* Priorities removed by isReplace */
+    CssMedia *pRemovedMedia = 0;        /* @media removed by isReplace */
+
+    assert(p->eState == PENDING_PARSED && pTree->pActiveStyle == p);
+    pParse->isDetached = 0;
+    pParse->pTree = pTree;
+    pParse->interp = pTree->interp;
+
+    /* Each rule was assigned the next value of pParse->iNextRule when it
+     * was created. Use this to arrange the rules in document order.
+     */
+    if (nRule > 0) {
+        CssRule **apAll = 0;
+        int nAll = 0;
+        styleSheetCollect(pNew, &apAll, &nAll);
+        assert(nAll == nRule);
+        apRule = (CssRule **)HtmlAlloc("temp", nRule * sizeof(CssRule *));
+        for (ii = 0; ii < nAll; ii++) {
+            assert(apAll[ii]->iRule < nRule);
+            apRule[apAll[ii]->iRule] = apAll[ii];
+        }
+        HtmlFree(apAll);
+    }
+
+    /* Step 1. A property set may be shared by more than one rule, but is
+     * only ever owned (CssRule.freePropertySets) by one of them. Stop
+     * invoking scripts as soon as one of them resets or destroys the
+     * widget. pendingStyleFree() frees anything left over.
+     */
+    while (pTree->pActiveStyle == p && (pImport = pParse->pImport)) {
+        pParse->pImport = pImport->pNext;
+        importEval(pParse, pImport);
+    }
+    for (ii = 0; pTree->pActiveStyle == p && ii < nRule; ii++) {
+        if (apRule[ii]->freePropertySets) {
+            propertySetUrlCmd(pParse, apRule[ii]->pPropertySet);
+        }
+    }
+    if (pTree->pActiveStyle == p) {
+        cssParseFinish(pParse, p->pErrorVar);
+    }
+    if (pTree->pActiveStyle != p) {
+        /* The widget was reset or destroyed by a script. */
+        HtmlFree(apRule);
+        return 0;
+    }
+
+    /* Step 2. */
+    for (ii = 0; ii < nRule; ii++) {
+        CssPropertySet *pSet = apRule[ii]->pPropertySet;
+        if (apRule[ii]->freePropertySets) {
+            int jj;
+            for (jj = 0; jj < pSet->n; jj++) {
+                pSet->a[jj].pProp = propertyIntern(pSet->a[jj].pProp);
+            }
+        }
+    }
+    for (ii = 0; ii < nRule; ii++) {
+        selectorCompile(apRule[ii]->pSelector);
+        ruleDependencies(pNew, apRule[ii]);
+        ruleCompileProperties(apRule[ii]);
+    }
+    for (pMedia = pNew->pMedia; pMedia; pMedia = pMedia->pNext) {
+        pMedia->isMatch = HtmlCssMediaTest(pTree, pMedia);
+    }
+    HtmlFree(apRule);
+
+    /* Step 3. */
+    if (p->isReplace && pTree->pStyle) {
+        pRemoved = styleSheetUnlink(pTree->pStyle, pParse->origin, 
+            Tcl_GetString(pParse->pStyleId), &pRemovedPriority, &pRemovedMedia
+        );
+    }
+    if (p->isReplace) {
+        styleSheetReplaced(
+            pTree, pNew, pRemoved, pRemovedPriority, pRemovedMedia
+        );
+    }
+    styleSheetMerge(&pTree->pStyle, pNew);
+    pParse->pStyle = 0;
+
+    return 1;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * pendingStyleCb --
+ *
+ *     Idle callback scheduled by HtmlStyleParseAsync(). Merge each queued
+ *     stylesheet into the widget stylesheet, in the order in which they
+ *     were queued (see pendingStyleMerge()), waiting for any that are 
+ *     still being parsed by worker threads. Then schedule a single 
+ *     restyle of the document (unless all of the queued stylesheets 
+ *     were added with the isReplace flag set, in which case only the 
+ *     affected nodes have already been scheduled for restyle).
+ *
+ *     Each stylesheet is removed from the queue before it is merged. A
+ *     script invoked while it is merged may queue more stylesheets, 
+ *     which are merged by the same call. If a script resets the widget,
+ *     the stylesheets queued before the reset are discarded. If a script
+ *     destroys the widget, this function returns as soon as the script 
+ *     does.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Modifies pTree->pStyle. Empties the queue at pTree->pPendingStyle.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+pendingStyleCb(clientData)
+    ClientData clientData;
+{
+    HtmlTree *pTree = (HtmlTree *)clientData;
+    CssPendingStyle *p;
+    int isRestyle = 0;
+
+    /* deleteWidget() uses Tcl_EventuallyFree() to free the HtmlTree
+     * structure, so it remains valid until Tcl_Release() is called. 
+     */
+    Tcl_Preserve((ClientData)pTree);
+
+    while (!pTree->isDeleted && (p = pTree->pPendingStyle)) {
+        /* If a script calls [update], this function may be reentered. */
+        CssPendingStyle *pOuter = pTree->pActiveStyle;
+
+        pTree->pPendingStyle = p->pNext;
+        pTree->pActiveStyle = p;
+
+        /* Make sure p is parsed, and that the worker threads are busy 
+         * with the stylesheets that follow it in the queue.
+         */
+        pendingStyleJoin(p);
+        pendingStyleStart(pTree);
+        if (p->eState == PENDING_QUEUED) {
+            cssParseRun(&p->sParse, 0, p->nText, p->zText);
+            p->eState = PENDING_PARSED;
+        }
+
+        if (pendingStyleMerge(pTree, p) && !p->isReplace) {
+            isRestyle = 1;
+        }
+        if (pTree->pActiveStyle == p) {
+            pTree->pActiveStyle = pOuter;
+        }
+        pendingStyleFree(p);
+    }
+
+    if (isRestyle && !pTree->isDeleted) {
+        HtmlCallbackRestyle(pTree, pTree->pRoot);
+    }
+    Tcl_Release((ClientData)pTree);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * pendingImportCb --
+ *
+ *     Idle callback scheduled by HtmlCssImport() when the -asyncimport
+ *     option is set. Evaluate each queued -importcmd script, in the
+ *     order in which the @import directives were encountered.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Clears pTree->pPendingImport. Whatever the -importcmd scripts do.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+pendingImportCb(clientData)
+    ClientData clientData;
+{
+    HtmlTree *pTree = (HtmlTree *)clientData;
+    Tcl_Interp *interp = pTree->interp;
+    Tcl_Obj *pQueue = pTree->pPendingImport;
+    Tcl_Obj **apScript;
+    int nScript;
+    int ii;
+
+    /* Detach the queue first. An -importcmd script may reset or destroy
+     * the widget, so pTree may not be used after the first script runs.
+     */
+    pTree->pPendingImport = 0;
+    Tcl_ListObjGetElements(0, pQueue, &nScript, &apScript);
+    for (ii = 0; ii < nScript; ii++) {
+        Tcl_EvalObjEx(interp, apScript[ii], TCL_EVAL_GLOBAL|TCL_EVAL_DIRECT);
+    }
+    Tcl_DecrRefCount(pQueue);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlStyleParseAsync --
+ *
+ *     Queue a stylesheet document to be added to the widget. The 
+ *     arguments are the same as for HtmlStyleParse(). 
+ *
+ *     The stylesheet is parsed into a detached stylesheet object by a
+ *     worker thread (see pendingStyleStart()), starting immediately. It
+ *     is then merged into the widget configuration from within an idle 
+ *     callback, along with any other stylesheets queued before the 
+ *     callback runs. Any -importcmd or -urlcmd scripts are invoked, and 
+ *     the -errorvar variable set, from within the idle callback.
+ *
+ * Results:
+ *     TCL_OK, or TCL_ERROR if pId is not a valid stylesheet id.
+ *
+ * Side effects:
+ *     May schedule an idle callback and start a worker thread.
+ *
+ *---------------------------------------------------------------------------
+ */
+int 
+HtmlStyleParseAsync(pTree, pStyleText, pId, pImportCmd, pUrlCmd, pErrorVar, isReplace)
+    HtmlTree *pTree;
+    Tcl_Obj *pStyleText;
+    Tcl_Obj *pId;
+    Tcl_Obj *pImportCmd;
+    Tcl_Obj *pUrlCmd;
+    Tcl_Obj *pErrorVar;
+    int isReplace;
+{
+    CssPendingStyle *pNew;
+    CssPendingStyle **pp;
+    int origin;
+    Tcl_Obj *pStyleId;
+    CONST char *zText;
+    int nText;
+
+    /* Check that the stylesheet id is valid before queueing anything. */
+    pStyleId = styleIdParse(pTree, pId, &origin);
+    if (!pStyleId) {
+        return TCL_ERROR;
+    }
+
+    zText = Tcl_GetStringFromObj(pStyleText, &nText);
+    pNew = HtmlNew(CssPendingStyle);
+    pNew->zText = (char *)HtmlAlloc("CssPendingStyle.zText", nText + 1);
+    memcpy(pNew->zText, zText, nText + 1);
+    pNew->nText = nText;
+    pNew->pErrorVar = pErrorVar;
+    pNew->isReplace = isReplace;
+    if (pImportCmd) Tcl_IncrRefCount(pImportCmd);
+    if (pUrlCmd)    Tcl_IncrRefCount(pUrlCmd);
+    if (pErrorVar)  Tcl_IncrRefCount(pErrorVar);
+
+    /* The reference to pStyleId returned by styleIdParse() is released 
+     * by pendingStyleFree(). 
+     */
+    cssParseInit(&pNew->sParse, 
+        pTree, origin, pStyleId, pImportCmd, pUrlCmd, (pErrorVar!=0), 0
+    );
+    pNew->sParse.isDetached = 1;
+    pNew->sParse.pTree = 0;
+    pNew->sParse.interp = 0;
+
+    if (!pTree->pPendingStyle) {
+        Tcl_DoWhenIdle(pendingStyleCb, (ClientData)pTree);
+    }
+    for (pp = &pTree->pPendingStyle; *pp; pp = &(*pp)->pNext);
+    *pp = pNew;
+    pendingStyleStart(pTree);
+
+    return TCL_OK;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlStyleCancelAsync --
+ *
+ *     Discard any stylesheets queued by HtmlStyleParseAsync() that have
+ *     not yet been merged, waiting for any worker threads parsing them
+ *     to finish. This is called when the widget is reset or destroyed.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May cancel an idle callback. Clears pTree->pActiveStyle.
+ *
+ *---------------------------------------------------------------------------
+ */
+void
+HtmlStyleCancelAsync(pTree)
+    HtmlTree *pTree;
+{
+    if (pTree->pPendingStyle) {
+        Tcl_CancelIdleCall(pendingStyleCb, (ClientData)pTree);
+        while (pTree->pPendingStyle) {
+            CssPendingStyle *p = pTree->pPendingStyle;
+            pTree->pPendingStyle = p->pNext;
+            pendingStyleFree(p);
+        }
+    }
+    pTree->pActiveStyle = 0;
+    if (pTree->pPendingImport) {
+        Tcl_CancelIdleCall(pendingImportCb, (ClientData)pTree);
+        Tcl_DecrRefCount(pTree->pPendingImport);
+        pTree->pPendingImport = 0;
+    }
+}
+
+/*
+ * Parsed style attributes are interned in the HtmlTree.aInlineStyle 
+ * hash table, keyed by the text of the attribute. Each entry is an 
+ * instance of the following structure. The CssPropertySet pointer
+ * stored in HtmlElementNode.pStyle points to the "set" member.
+ */
+typedef struct CssInlineStyle CssInlineStyle;
+struct CssInlineStyle {
+    CssPropertySet set;           /* Parsed declarations. MUST BE FIRST. */
+    int nRef;                     /* Number of elements using this entry */
+    Tcl_HashEntry *pEntry;        /* Entry in HtmlTree.aInlineStyle */
+};
+
+/*--------------------------------------------------------------------------
+ *
+ * HtmlCssInlineParse --
+ *
+ *     Parse the style attribute value pointed to by z, length n bytes. See
+ *     comments above cssParse() for more detail.
+ *
+ *     If an identical style attribute has already been parsed and is
+ *     still in use by some element, the existing declarations are 
+ *     returned instead of parsing the text again.
+ *
+ * Results:
+ *
+ *     Returns a CssPropertySet pointer, written to *ppPropertySet. It
+ *     should be released using HtmlCssInlineFree().
+ *
+ * Side effects:
+ *
+ *--------------------------------------------------------------------------
+ */
+int 
+HtmlCssInlineParse(
+    HtmlTree *pTree,
+    int n,
+    const char *z,
+    CssPropertySet **ppPropertySet
+){
+    CssStyleSheet *pStyle = 0;
+    CssInlineStyle *pInline;
+    Tcl_HashEntry *pEntry;
+    Tcl_DString str;
+    int isNew;
+
+    assert(ppPropertySet && !(*ppPropertySet));
+
+    Tcl_DStringInit(&str);
+    if (n >= 0) {
+        z = Tcl_DStringAppend(&str, z, n);
+    }
+    pEntry = Tcl_CreateHashEntry(&pTree->aInlineStyle, z, &isNew);
+    if (!isNew) {
+        pInline = (CssInlineStyle *)Tcl_GetHashValue(pEntry);
+        pInline->nRef++;
+        *ppPropertySet = &pInline->set;
+        Tcl_DStringFree(&str);
+        return 0;
+    }
+
+    pInline = HtmlNew(CssInlineStyle);
+    pInline->nRef = 1;
+    pInline->pEntry = pEntry;
+    Tcl_SetHashValue(pEntry, pInline);
+
+    cssParse(pTree, -1, z, 1, 0, 0, 0, 0, 0, &pStyle);
+    if (pStyle) {
+        CssRule *pRule = pStyle->pUniversalRules;
+        if (pRule && pRule->pPropertySet) {
+            assert(!pRule->pNext);
+            pInline->set = *pRule->pPropertySet;
+            HtmlFree(pRule->pPropertySet);
+            pRule->pPropertySet = 0;
+        }
+        assert(!pStyle->pPriority);
+        if (pStyle->isCounters) {
+            pTree->isInlineCounters = 1;
+        }
+        HtmlCssStyleSheetFree(pStyle);
+    }
+
+    *ppPropertySet = &pInline->set;
+    Tcl_DStringFree(&str);
+    return 0;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * ruleFree --
+ *
+ *     Free the CssRule object pRule.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void 
+ruleFree(pRule)
+    CssRule *pRule;
+{
+    if (pRule) {
+        if (pRule->freeSelector) {
+            selectorFree(pRule->pSelector);
+        }
+        if (pRule->freePropertySets) {
+            propertySetFree(pRule->pPropertySet);
+        }
+        HtmlFree(pRule->aProperty);
+        HtmlFree(pRule);
+    }
+}
+
+static void
+freeRulesList(ppList)
+    CssRule **ppList;
+{
+    CssRule *pRule = *ppList;
+    while (pRule) { 
+        CssRule *pNext = pRule->pNext;
+        ruleFree(pRule);
+        pRule = pNext;
+    }
+    *ppList = 0;
+}
+
+static void
+freeRulesHash(pHash)
+    Tcl_HashTable *pHash;
+{
+    Tcl_HashSearch search;
+    Tcl_HashEntry *pEntry;
+  
+    for (
+        pEntry = Tcl_FirstHashEntry(pHash, &search); 
+        pEntry; 
+        pEntry = Tcl_NextHashEntry(&search)
+    ) {
+        CssRule *pRule = (CssRule *)Tcl_GetHashValue(pEntry);
+        freeRulesList(&pRule);
+    }
+    Tcl_DeleteHashTable(pHash);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCssStyleSheetFree --
+ *
+ *     Delete the internal representation of the stylesheet configuration.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+void 
+HtmlCssStyleSheetFree(pStyle)
+    CssStyleSheet *pStyle;
+{
+    if (pStyle) {
+        CssPriority *pPriority;
+
+        /* Free the universal rules list */
+        freeRulesList(&pStyle->pUniversalRules); 
+        freeRulesList(&pStyle->pAfterRules); 
+        freeRulesList(&pStyle->pBeforeRules); 
+        freeRulesHash(&pStyle->aByTag); 
         freeRulesHash(&pStyle->aByClass); 
         freeRulesHash(&pStyle->aById); 
+        freeRulesHash(&pStyle->aByAttr); 
+        Tcl_DeleteHashTable(&pStyle->aDepend);
 
         /* Free the priorities list */
         pPriority = pStyle->pPriority;
@@ -2463,10 +4403,20 @@ HtmlCssStyleSheetFree(pStyle)
             pPriority = pNext;
         }
 
+        mediaListFree(pStyle->pMedia);
         HtmlFree(pStyle);
     }
 }
 
+/*
+** Return true if the style-sheet uses the 'counter-reset' or 
+** 'counter-increment' properties, or the counter() or counters() 
+** functions in a 'content' property.
+*/
+int HtmlCssStyleSheetCounters(CssStyleSheet *pStyle){
+    return (pStyle && pStyle->isCounters);
+}
+
 /*
 ** Return the number of syntax errors that occured while parsing the
 ** style-sheet.
@@ -2704,35 +4654,522 @@ ruleCompare(CssRule *pLeft, CssRule *pRight) {
             }
         }
     }
-    return res;
+    return res;
+}
+
+static void
+insertRule(ppList, pRule) 
+    CssRule **ppList;
+    CssRule *pRule;
+{
+    if (!*ppList || ruleCompare(*ppList, pRule) <= 0) {
+        /* If the default list is currently empty, or the rule being
+         * added has higher priority than the first rule in the list,
+         * our rule becomes the new head of the list.
+         */
+        pRule->pNext = *ppList;
+        *ppList = pRule;
+    } else {
+        /* Otherwise insert the new rule into the list, ordered by
+         * priority. If there exists another rule with the same
+         * priority, then this rule is inserted into the list *before*
+         * it. This is because when rules are of equal priority, the
+         * latter specified wins.
+         */
+        CssRule *pR = *ppList;
+        while (pR->pNext && ruleCompare(pR->pNext, pRule)>0 ) {
+            pR = pR->pNext;
+        }
+        pRule->pNext = pR->pNext;
+        pR->pNext = pRule;
+    }
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * filterHash --
+ *
+ *     Compute the ancestor filter hash of the n byte name z. Names are
+ *     case-folded, as ids and class names are compared without regard to
+ *     case by HtmlCssSelectorTest(). Argument cType is one of 't', 'i'
+ *     or 'c', so that a tag, id and class of the same name do not share
+ *     a hash value.
+ *
+ * Results:
+ *     Hash value.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static unsigned int
+filterHash(cType, z, n)
+    int cType;
+    const char *z;
+    int n;
+{
+    unsigned int h = 2166136261U ^ (unsigned int)cType;
+    int ii;
+    for (ii = 0; ii < n && z[ii]; ii++) {
+        h = (h ^ (unsigned int)tolower((unsigned char)z[ii])) * 16777619U;
+    }
+    return h;
+}
+
+/* Each hash value sets two bits of a CssAncestorFilter.aBit[] array. */
+#define FILTER_BIT1(h) ((h) % CSS_FILTER_BITS)
+#define FILTER_BIT2(h) (((h) >> 16) % CSS_FILTER_BITS)
+#define FILTER_SET(a, i) ((a)[(i) / 8] |= (1 << ((i) % 8)))
+#define FILTER_GET(a, i) ((a)[(i) / 8] & (1 << ((i) % 8)))
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * ruleAncestorHashes --
+ *
+ *     Populate the CssRule.aAncestor[] array of pRule based on the tag,
+ *     id and class simple-selectors in pRule->pSelector that must match
+ *     an ancestor of the node the rule applies to. Simple selectors that
+ *     follow an adjacent-sibling combinator ("+") are skipped, as they
+ *     match a sibling of the node or one of its ancestors.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Sets pRule->nAncestor and pRule->aAncestor[].
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+ruleAncestorHashes(pRule)
+    CssRule *pRule;
+{
+    CssSelector *pS;
+    int isAncestor = 0;
+
+    pRule->nAncestor = 0;
+    for (
+        pS = pRule->pSelector; 
+        pS && pRule->nAncestor < CSS_RULE_MAX_ANCESTOR; 
+        pS = pS->pNext
+    ) {
+        int cType = 0;
+        switch (pS->eSelector) {
+            case CSS_SELECTORCHAIN_DESCENDANT:
+            case CSS_SELECTORCHAIN_CHILD:
+                isAncestor = 1;
+                break;
+            case CSS_SELECTORCHAIN_ADJACENT:
+                isAncestor = 0;
+                break;
+            case CSS_SELECTOR_TYPE:  cType = 't'; break;
+            case CSS_SELECTOR_ID:    cType = 'i'; break;
+            case CSS_SELECTOR_CLASS: cType = 'c'; break;
+        }
+        if (cType && isAncestor && pS->zValue) {
+            pRule->aAncestor[pRule->nAncestor++] = 
+                filterHash(cType, pS->zValue, strlen(pS->zValue));
+        }
+    }
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * ruleNoShare --
+ *
+ *     Determine the value of the CssRule.noShare flag for rule pRule.
+ *     Everything to the left of the first descendant or child combinator
+ *     in the selector is tested against ancestors, which are the same for
+ *     all siblings. Attribute selectors and attr() values are the same
+ *     for siblings with identical attributes. This leaves the structural
+ *     pseudo-classes and adjacent-sibling combinators in the rightmost
+ *     compound selector, dynamic pseudo-classes and tcl() values.
+ *
+ * Results:
+ *     True if the rule prevents style-sharing, otherwise false.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+ruleNoShare(pRule)
+    CssRule *pRule;
+{
+    CssSelector *pS;
+    CssPropertySet *pSet = pRule->pPropertySet;
+    int ii;
+
+    if (pRule->pSelector->isDynamic) {
+        return 1;
+    }
+    for (pS = pRule->pSelector; pS; pS = pS->pNext) {
+        int eSelector = pS->eSelector;
+        if (
+            eSelector == CSS_SELECTORCHAIN_DESCENDANT ||
+            eSelector == CSS_SELECTORCHAIN_CHILD
+        ) {
+            break;
+        }
+        if (
+            eSelector == CSS_SELECTORCHAIN_ADJACENT ||
+            eSelector == CSS_PSEUDOCLASS_FIRSTCHILD ||
+            eSelector == CSS_PSEUDOCLASS_LASTCHILD
+        ) {
+            return 1;
+        }
+    }
+
+    for (ii = 0; ii < pSet->n; ii++) {
+        CssProperty *pProp = pSet->a[ii].pProp;
+        if (pProp && pProp->eType == CSS_TYPE_TCL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The CssStyleSheet.aDepend table maps from the names of attributes, and
+ * from class names and ids prefixed with "." and "#", to a mask of the
+ * CSS_DEPEND_XXX positions in which they are used by the rules of the
+ * stylesheet. Keys are folded to lower-case, as class and id selectors
+ * are matched without regard to case. Rules with tcl() values add an
+ * entry keyed by the subject tag prefixed with "<", or "*" if the rule
+ * does not specify a tag, as the script may read any attribute.
+ *
+ * Function dependKey() builds the key for string z (of length n bytes,
+ * or nul-terminated if n is negative) with prefix character c (or no
+ * prefix if c is 0) in pKey. The caller must free pKey using
+ * Tcl_DStringFree().
+ */
+static const char *
+dependKey(pKey, c, z, n)
+    Tcl_DString *pKey;
+    char c;
+    const char *z;
+    int n;
+{
+    Tcl_DStringInit(pKey);
+    if (c) {
+        Tcl_DStringAppend(pKey, &c, 1);
+    }
+    Tcl_DStringAppend(pKey, z, n);
+    Tcl_UtfToLower(Tcl_DStringValue(pKey));
+    return Tcl_DStringValue(pKey);
+}
+static void
+dependAdd(pStyle, c, z, n, mask)
+    CssStyleSheet *pStyle;
+    char c;
+    const char *z;
+    int n;
+    int mask;
+{
+    Tcl_DString key;
+    Tcl_HashEntry *pEntry;
+    int isNew;
+
+    pEntry = Tcl_CreateHashEntry(
+        &pStyle->aDepend, dependKey(&key, c, z, n), &isNew
+    );
+    if (!isNew) {
+        mask |= (int)(size_t)Tcl_GetHashValue(pEntry);
+    }
+    Tcl_SetHashValue(pEntry, (ClientData)(size_t)mask);
+    Tcl_DStringFree(&key);
+}
+static int
+dependMask(pStyle, c, z, n)
+    CssStyleSheet *pStyle;
+    char c;
+    const char *z;
+    int n;
+{
+    Tcl_DString key;
+    Tcl_HashEntry *pEntry;
+
+    pEntry = Tcl_FindHashEntry(&pStyle->aDepend, dependKey(&key, c, z, n));
+    Tcl_DStringFree(&key);
+    return (pEntry ? (int)(size_t)Tcl_GetHashValue(pEntry) : 0);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * ruleDependencies --
+ *
+ *     Add the class names, ids and attribute names used by the selector
+ *     and the attr() and tcl() values of rule pRule to the 
+ *     CssStyleSheet.aDepend table of stylesheet pStyle. Simple selectors
+ *     in the rightmost compound selector are recorded as 
+ *     CSS_DEPEND_SUBJECT. Those to the left of a descendant or child 
+ *     combinator as CSS_DEPEND_ANCESTOR, and those to the left of an 
+ *     adjacent-sibling combinator as CSS_DEPEND_SIBLING (or both).
+ *
+ *     An attr() value reads the attribute of the node being styled,
+ *     unless an ancestor tag is specified as the third argument (see
+ *     html.css). A tcl() value may read anything.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Adds to or modifies entries of pStyle->aDepend. Entries are never
+ *     removed, not even if the rule is later removed from the stylesheet.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+ruleDependencies(pStyle, pRule)
+    CssStyleSheet *pStyle;
+    CssRule *pRule;
+{
+    CssPropertySet *pSet = pRule->pPropertySet;
+    CssSelector *pS;
+    const char *zTag = 0;
+    int mask = CSS_DEPEND_SUBJECT;
+    int isTcl = 0;
+    int ii;
+
+    for (pS = pRule->pSelector; pS; pS = pS->pNext) {
+        switch (pS->eSelector) {
+            case CSS_SELECTORCHAIN_DESCENDANT:
+            case CSS_SELECTORCHAIN_CHILD:
+                mask = (mask & CSS_DEPEND_SIBLING) | CSS_DEPEND_ANCESTOR;
+                break;
+            case CSS_SELECTORCHAIN_ADJACENT:
+                mask = (mask & CSS_DEPEND_ANCESTOR) | CSS_DEPEND_SIBLING;
+                break;
+
+            case CSS_SELECTOR_TYPE:
+                if (mask == CSS_DEPEND_SUBJECT) zTag = pS->zValue;
+                break;
+            case CSS_SELECTOR_CLASS:
+                dependAdd(pStyle, '.', pS->zValue, -1, mask);
+                break;
+            case CSS_SELECTOR_ID:
+                dependAdd(pStyle, '#', pS->zValue, -1, mask);
+                break;
+            case CSS_SELECTOR_ATTR:
+            case CSS_SELECTOR_ATTRVALUE:
+            case CSS_SELECTOR_ATTRLISTVALUE:
+            case CSS_SELECTOR_ATTRHYPHEN:
+                dependAdd(pStyle, 0, pS->zAttr, -1, mask);
+                break;
+        }
+    }
+
+    for (ii = 0; ii < pSet->n; ii++) {
+        CssProperty *pProp = pSet->a[ii].pProp;
+        if (!pProp) continue;
+
+        switch (pProp->eType) {
+            case CSS_TYPE_ATTR: {
+                const char *zAttr = pProp->v.zVal;
+                const char *zEnd = &zAttr[strlen(zAttr)];
+                const char *z;
+                int nAttr;
+                int n;
+
+                mask = CSS_DEPEND_SUBJECT;
+                zAttr = HtmlCssGetNextListItem(zAttr, zEnd - zAttr, &nAttr);
+                if (!zAttr) break;
+                z = &zAttr[nAttr];
+                z = HtmlCssGetNextListItem(z, zEnd - z, &n);
+                if (z) {
+                    z = &z[n];
+                    z = HtmlCssGetNextListItem(z, zEnd - z, &n);
+                    if (z) mask = CSS_DEPEND_ANCESTOR;
+                }
+                dependAdd(pStyle, 0, zAttr, nAttr, mask);
+                break;
+            }
+
+            case CSS_TYPE_LIST: {
+                CssProperty **apProp = (CssProperty **)pProp->v.p;
+                int jj;
+                for (jj = 0; apProp[jj]; jj++) {
+                    if (apProp[jj]->eType == CSS_TYPE_ATTR) {
+                        dependAdd(pStyle, 0, apProp[jj]->v.zVal, -1, 
+                            CSS_DEPEND_SUBJECT
+                        );
+                    }
+                    if (apProp[jj]->eType == CSS_TYPE_TCL) {
+                        isTcl = 1;
+                    }
+                }
+                break;
+            }
+
+            case CSS_TYPE_TCL:
+                isTcl = 1;
+                break;
+        }
+    }
+
+    if (isTcl) {
+        if (zTag) {
+            dependAdd(pStyle, '<', zTag, -1, CSS_DEPEND_SUBJECT);
+        } else {
+            dependAdd(pStyle, 0, "*", -1, CSS_DEPEND_SUBJECT);
+        }
+    }
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * propertySetIsScripted --
+ *
+ *     Return true if any of the values in property set pSet is an attr() 
+ *     or tcl() value, or a list containing one. The computed values of
+ *     a node styled using such a property set may depend on the node's
+ *     attributes.
+ *
+ * Results:
+ *     Boolean.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+propertySetIsScripted(pSet)
+    CssPropertySet *pSet;
+{
+    int ii;
+    for (ii = 0; pSet && ii < pSet->n; ii++) {
+        CssProperty *pProp = pSet->a[ii].pProp;
+        if (!pProp) continue;
+        if (pProp->eType == CSS_TYPE_ATTR || pProp->eType == CSS_TYPE_TCL) {
+            return 1;
+        }
+        if (pProp->eType == CSS_TYPE_LIST) {
+            CssProperty **apProp = (CssProperty **)pProp->v.p;
+            int jj;
+            for (jj = 0; apProp[jj]; jj++) {
+                int eType = apProp[jj]->eType;
+                if (eType == CSS_TYPE_ATTR || eType == CSS_TYPE_TCL) return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * ruleCompileProperties --
+ *
+ *     Compile the property set of rule pRule into the pRule->aProperty
+ *     array (see the comments above struct CssRuleProperty in cssInt.h).
+ *     The entries are stored in the order used by 
+ *     propertySetToPropertyValues(), last declaration first.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Allocates pRule->aProperty, which is freed by ruleFree().
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+ruleCompileProperties(pRule)
+    CssRule *pRule;
+{
+    CssPropertySet *pSet = pRule->pPropertySet;
+    int ii;
+
+    assert(!pRule->aProperty);
+    pRule->aProperty = (CssRuleProperty *)HtmlAlloc(
+        "CssRule.aProperty", pSet->n * sizeof(CssRuleProperty)
+    );
+    for (ii = pSet->n - 1; ii >= 0; ii--) {
+        int eProp = pSet->a[ii].eProp;
+        CssProperty *pProp = pSet->a[ii].pProp;
+        CssRuleProperty *p;
+
+        if (eProp > CSS_PROPERTY_MAX_PROPERTY) continue;
+        p = &pRule->aProperty[pRule->nProperty++];
+        p->eProp = eProp;
+        p->pProp = pProp;
+        p->iOffset = -1;
+        p->eValue = 0;
+
+        /* A NULL value is added for each property a shorthand does not
+         * specify (i.e. "list-style: square"). It is not compiled, but
+         * still marks the property as done when the rule is applied.
+         */
+        if (pProp) {
+            p->iOffset = HtmlComputedValuesCompile(eProp, pProp);
+            p->eValue = pProp->eType;
+        }
+    }
 }
 
+/*--------------------------------------------------------------------------
+ *
+ * selectorCompile --
+ *
+ *     Compile the selector chain pSelector into an array of CssMatchOp
+ *     structures and store it in pSelector->aOp. Type selectors for tags
+ *     known to the HTML tokenizer are compiled to a comparison of the
+ *     HtmlNode.eTag value. Class selectors are compiled to a search of
+ *     the HtmlElementNode.azClass array for the interned class name. If
+ *     the selector is already compiled, this function is a no-op.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Allocates pSelector->aOp, which is freed by selectorFree().
+ *
+ *--------------------------------------------------------------------------
+ */
 static void
-insertRule(ppList, pRule) 
-    CssRule **ppList;
-    CssRule *pRule;
+selectorCompile(pSelector)
+    CssSelector *pSelector;
 {
-    if (!*ppList || ruleCompare(*ppList, pRule) <= 0) {
-        /* If the default list is currently empty, or the rule being
-         * added has higher priority than the first rule in the list,
-         * our rule becomes the new head of the list.
-         */
-        pRule->pNext = *ppList;
-        *ppList = pRule;
-    } else {
-        /* Otherwise insert the new rule into the list, ordered by
-         * priority. If there exists another rule with the same
-         * priority, then this rule is inserted into the list *before*
-         * it. This is because when rules are of equal priority, the
-         * latter specified wins.
-         */
-        CssRule *pR = *ppList;
-        while (pR->pNext && ruleCompare(pR->pNext, pRule)>0 ) {
-            pR = pR->pNext;
+    CssSelector *pS;
+    CssMatchOp *aOp;
+    int nOp = 0;
+
+    if (pSelector->aOp) return;
+
+    for (pS = pSelector; pS; pS = pS->pNext) nOp++;
+    aOp = (CssMatchOp *)HtmlAlloc("CssMatchOp", (nOp+1) * sizeof(CssMatchOp));
+    memset(aOp, 0, (nOp + 1) * sizeof(CssMatchOp));
+    pSelector->nDescendant = 0;
+
+    for (nOp = 0, pS = pSelector; pS; nOp++, pS = pS->pNext) {
+        CssMatchOp *pOp = &aOp[nOp];
+        pOp->eOp = pS->eSelector;
+        pOp->zAttr = pS->zAttr;
+        pOp->zValue = pS->zValue;
+        pOp->nValue = pS->zValue ? strlen(pS->zValue) : 0;
+        if (pS->eSelector == CSS_SELECTOR_TYPE) {
+            HtmlTokenMap *pMap = HtmlHashLookup(0, pS->zValue);
+            if (pMap) {
+                pOp->eTag = pMap->type;
+            }
+        }
+        if (pS->eSelector == CSS_SELECTOR_CLASS) {
+            pOp->zAtom = classAtom(pOp->zValue, pOp->nValue);
+        }
+        if (pS->eSelector == CSS_SELECTORCHAIN_DESCENDANT) {
+            pSelector->nDescendant++;
         }
-        pRule->pNext = pR->pNext;
-        pR->pNext = pRule;
     }
+
+    pSelector->aOp = aOp;
 }
 
 /*
@@ -2772,6 +5209,7 @@ cssSelectorPropertySetPair(pParse, pSelector, pPropertySet, freeWhat)
     CssRule *pRule = HtmlNew(CssRule);
 
     assert(pPropertySet && pPropertySet->n > 0);
+    pRule->pMedia = pParse->pMedia;
 
     if (freeWhat & FREE_PROPERTYSET) {
         pRule->freePropertySets = 1;
@@ -2840,26 +5278,50 @@ cssSelectorPropertySetPair(pParse, pSelector, pPropertySet, freeWhat)
     }
     pRule->iRule = pParse->iNextRule++;
 
-    /* Insert the rule into it's list. */
+    /* Insert the rule into it's list. The list is chosen based on the
+     * simple selectors in the rightmost compound selector (i.e. up to the
+     * first combinator). Rules ending in a :before or :after pseudo-element
+     * go in the pBeforeRules or pAfterRules lists. Otherwise, in order of
+     * preference, the rule is stored in the aById, aByClass or aByTag
+     * table, or in the aByAttr table keyed by an attribute name or by one
+     * of the strings ":link", ":visited", ":first-child" or ":last-child".
+     * Rules with no such simple selector go in the pUniversalRules list.
+     */
     if (pParse->pStyleId) {
-        pS = pSelector;
-
-        while (pS->pNext && (
-                pS->eSelector == CSS_SELECTOR_ATTR ||
-                pS->eSelector == CSS_SELECTOR_ATTRVALUE ||
-                pS->eSelector == CSS_SELECTOR_ATTRLISTVALUE ||
-                pS->eSelector == CSS_SELECTOR_ATTRHYPHEN ||
-                pS->eSelector == CSS_PSEUDOCLASS_ACTIVE ||
-                pS->eSelector == CSS_PSEUDOCLASS_HOVER ||
-                pS->eSelector == CSS_PSEUDOCLASS_FOCUS ||
-                pS->eSelector == CSS_PSEUDOCLASS_LINK ||
-                pS->eSelector == CSS_PSEUDOCLASS_VISITED
-            )
-        ) {
-            pS = pS->pNext;
+        CssSelector *pKey = 0;
+        int iKey = 0;
+
+        for (pS = pSelector; pS; pS = pS->pNext) {
+            int iPref = 0;
+            switch (pS->eSelector) {
+                case CSS_PSEUDOELEMENT_AFTER:
+                case CSS_PSEUDOELEMENT_BEFORE:     iPref = 6; break;
+                case CSS_SELECTOR_ID:              iPref = 5; break;
+                case CSS_SELECTOR_CLASS:           iPref = 4; break;
+                case CSS_SELECTOR_TYPE:            iPref = 3; break;
+                case CSS_SELECTOR_ATTR:
+                case CSS_SELECTOR_ATTRVALUE:
+                case CSS_SELECTOR_ATTRLISTVALUE:
+                case CSS_SELECTOR_ATTRHYPHEN:      iPref = 2; break;
+                case CSS_PSEUDOCLASS_LINK:
+                case CSS_PSEUDOCLASS_VISITED:
+                case CSS_PSEUDOCLASS_FIRSTCHILD:
+                case CSS_PSEUDOCLASS_LASTCHILD:    iPref = 1; break;
+            }
+            if (
+                pS->eSelector == CSS_SELECTORCHAIN_DESCENDANT ||
+                pS->eSelector == CSS_SELECTORCHAIN_CHILD ||
+                pS->eSelector == CSS_SELECTORCHAIN_ADJACENT
+            ) {
+                break;
+            }
+            if (iPref > iKey) {
+                pKey = pS;
+                iKey = iPref;
+            }
         }
 
-        switch (pS->eSelector) {
+        switch (pKey ? pKey->eSelector : 0) {
 
             case CSS_PSEUDOELEMENT_AFTER:
                 insertRule(&pStyle->pAfterRules, pRule);
@@ -2871,20 +5333,54 @@ cssSelectorPropertySetPair(pParse, pSelector, pPropertySet, freeWhat)
     
             case CSS_SELECTOR_ID:
             case CSS_SELECTOR_CLASS:
-            case CSS_SELECTOR_TYPE: {
+            case CSS_SELECTOR_TYPE:
+            case CSS_SELECTOR_ATTR:
+            case CSS_SELECTOR_ATTRVALUE:
+            case CSS_SELECTOR_ATTRLISTVALUE:
+            case CSS_SELECTOR_ATTRHYPHEN:
+            case CSS_PSEUDOCLASS_LINK:
+            case CSS_PSEUDOCLASS_VISITED:
+            case CSS_PSEUDOCLASS_FIRSTCHILD:
+            case CSS_PSEUDOCLASS_LASTCHILD: {
                 int newentry;
-                Tcl_HashTable *pTab;
+                Tcl_HashTable *pTab = &pStyle->aByAttr;
                 Tcl_HashEntry *p;
                 CssRule *pList = 0;
-
-                pTab = &pStyle->aByTag;
-                switch (pS->eSelector) {
-                    case CSS_SELECTOR_ID:    pTab = &pStyle->aById; break;
-                    case CSS_SELECTOR_CLASS: pTab = &pStyle->aByClass; break;
-                    case CSS_SELECTOR_TYPE:  pTab = &pStyle->aByTag; break;
+                const char *zKey = pKey->zAttr;
+                Tcl_DString key;
+
+                Tcl_DStringInit(&key);
+                switch (pKey->eSelector) {
+                    case CSS_SELECTOR_ID:    
+                        pTab = &pStyle->aById; 
+                        zKey = pKey->zValue;
+                        break;
+                    case CSS_SELECTOR_CLASS: {
+                        /* The aByClass table is keyed by the lower-case
+                         * class name, the same as the interned class 
+                         * names in HtmlElementNode.azClass.
+                         */
+                        char *z;
+                        Tcl_DStringAppend(&key, pKey->zValue, -1);
+                        for (z = Tcl_DStringValue(&key); *z; z++) {
+                            *z = tolower((unsigned char)*z);
+                        }
+                        pTab = &pStyle->aByClass; 
+                        zKey = Tcl_DStringValue(&key);
+                        break;
+                    }
+                    case CSS_SELECTOR_TYPE:  
+                        pTab = &pStyle->aByTag; 
+                        zKey = pKey->zValue;
+                        break;
+                    case CSS_PSEUDOCLASS_LINK:       zKey = ":link"; break;
+                    case CSS_PSEUDOCLASS_VISITED:    zKey = ":visited"; break;
+                    case CSS_PSEUDOCLASS_FIRSTCHILD: zKey = ":first-child"; break;
+                    case CSS_PSEUDOCLASS_LASTCHILD:  zKey = ":last-child"; break;
                 }
 
-                p = Tcl_CreateHashEntry(pTab, pS->zValue, &newentry);
+                p = Tcl_CreateHashEntry(pTab, zKey, &newentry);
+                Tcl_DStringFree(&key);
                 if (!newentry) { 
                     pList = (CssRule *)Tcl_GetHashValue(p); 
                 }
@@ -2903,6 +5399,20 @@ cssSelectorPropertySetPair(pParse, pSelector, pPropertySet, freeWhat)
 
     pRule->pSelector = pSelector;
     pRule->pPropertySet = pPropertySet;
+    ruleAncestorHashes(pRule);
+    pRule->noShare = ruleNoShare(pRule);
+
+    /* Compiling the selector and properties requires interned class names
+     * and values. For a detached parse this is done later on by
+     * pendingStyleMerge().
+     */
+    if (!pParse->isDetached) {
+        selectorCompile(pSelector);
+        if (pParse->pStyleId) {
+            ruleDependencies(pStyle, pRule);
+            ruleCompileProperties(pRule);
+        }
+    }
 }
 
 /*--------------------------------------------------------------------------
@@ -2996,6 +5506,38 @@ void HtmlCssRule(pParse, success)
     }
 }
 
+/*--------------------------------------------------------------------------
+ *
+ * listTest --
+ *
+ *     Return true if the white-space separated list zList contains the
+ *     nValue byte string zValue (compared case-insensitively).
+ *
+ * Results:
+ *     See above.
+ *
+ * Side effects:
+ *     None.
+ *
+ *--------------------------------------------------------------------------
+ */
+static int
+listTest(zList, zValue, nValue)
+    const char *zList;
+    const char *zValue;
+    int nValue;
+{
+    const char *z = zList;
+    int n;
+    while ((z = HtmlCssGetNextListItem(z, strlen(z), &n))) {
+        if (n == nValue && 0 == strnicmp(z, zValue, n)) {
+            return 1;
+        }
+        z += n;
+    }
+    return 0;
+}
+
 /*--------------------------------------------------------------------------
  *
  * attrTest --
@@ -3034,18 +5576,8 @@ static int attrTest(eType, zString, zAttr)
 	/* Treat the attribute value (if it exists) as a space seperated list.
          * Return true if zString exists in the list.
          */
-        case CSS_SELECTOR_ATTRLISTVALUE: {
-            const char *pAttr = zAttr;
-            int nAttr;
-            int nString = strlen(zString);
-            while ((pAttr=HtmlCssGetNextListItem(pAttr, strlen(pAttr), &nAttr))) {
-                if (nString==nAttr && 0==strnicmp(pAttr, zString, nAttr)) {
-                    return 1;
-                }
-                pAttr += nAttr;
-            }
-            return 0;
-        }
+        case CSS_SELECTOR_ATTRLISTVALUE:
+            return listTest(zAttr, zString, strlen(zString));
 
         /* True if the attribute exists and matches zString up to the
          * first '-' character in the attribute value.
@@ -3069,6 +5601,19 @@ static int attrTest(eType, zString, zAttr)
  *
  *     Test if a selector matches a document node.
  *
+ *     The compiled form of the selector (see selectorCompile()) is 
+ *     processed from left to right (i.e. from the rightmost simple-selector
+ *     in the selector text to the leftmost). Each time a descendant 
+ *     combinator is encountered, the current ancestor node is saved in
+ *     aBacktrack[]. If a subsequent simple-selector fails to match, the
+ *     most recently saved ancestor is replaced by its parent and matching
+ *     restarts from the operation following the descendant combinator.
+ *     When there are no more ancestors to try, that entry is discarded
+ *     and the previous one is advanced instead.
+ *
+ *     If pnBacktrack is not NULL, *pnBacktrack is incremented each time
+ *     a descendant combinator is retried with the next ancestor.
+ *
  * Results:
  *     Non-zero is returned if the Selector does match the node.
  *
@@ -3077,50 +5622,70 @@ static int attrTest(eType, zString, zAttr)
  *
  *--------------------------------------------------------------------------
  */
-#define N_TYPE(x)        HtmlNodeTagName(x)
-#define N_ATTR(x,y)      HtmlNodeAttr(x,y)
 #define N_PARENT(x)      HtmlNodeParent(x)
-#define N_NUMCHILDREN(x) HtmlNodeNumChildren(x)
 #define N_CHILD(x,y)     HtmlNodeChild(x,y)
-int 
-HtmlCssSelectorTest(pSelector, pNode, dynamic_true)
+static int 
+selectorTest(pSelector, pNode, dynamic_true, pnBacktrack)
     CssSelector *pSelector;
     HtmlNode *pNode;
     int dynamic_true;
+    int *pnBacktrack;
 {
-    CssSelector *p = pSelector;
+    /* Saved state for each descendant combinator currently in progress */
+    struct Backtrack {
+        int iOp;              /* Operation following the combinator */
+        HtmlNode *x;          /* Ancestor node currently being tried */
+    } aStatic[8], *aBacktrack = aStatic;
+    int nBacktrack = 0;
+
+    CssMatchOp *aOp = pSelector->aOp;
+    int iOp = 0;
     HtmlNode *x = pNode;
+    int rc = -1;
 
-    HtmlElementNode *pElem = HtmlNodeAsElement(pNode);
-    assert(pElem);
+    assert(HtmlNodeAsElement(pNode));
+    assert(aOp);
+
+    if (pSelector->nDescendant > 8) {
+        int nByte = pSelector->nDescendant * sizeof(struct Backtrack);
+        aBacktrack = (struct Backtrack *)HtmlAlloc("Backtrack", nByte);
+    }
+
+    while (rc < 0) {
+        CssMatchOp *pOp = &aOp[iOp];
+        HtmlElementNode *pElem = HtmlNodeAsElement(x);
+        int isMatch = 1;
 
-    while( p && x ){
-        pElem = HtmlNodeAsElement(x);
+        switch (pOp->eOp) {
+            case 0:
+                rc = 1;
+                break;
 
-        switch( p->eSelector ){
             case CSS_SELECTOR_UNIVERSAL:
+            case CSS_PSEUDOELEMENT_BEFORE:
+            case CSS_PSEUDOELEMENT_AFTER:
                 break;
 
             case CSS_SELECTOR_TYPE:
-                assert(x->zTag || HtmlNodeIsText(x));
-                if( HtmlNodeIsText(x) || strcmp(x->zTag, p->zValue) ) return 0;
+                if (pOp->eTag) {
+                    isMatch = (x->eTag == pOp->eTag);
+                } else {
+                    isMatch = (pElem && 0 == strcmp(x->zTag, pOp->zValue));
+                }
                 break;
 
             case CSS_SELECTOR_CLASS: {
-                const char *zClass = p->zValue;
-                const char *zAttr = N_ATTR(x, "class");
-                if( !attrTest(CSS_SELECTOR_ATTRLISTVALUE, zClass, zAttr) ){
-                    return 0;
+                int ii;
+                isMatch = 0;
+                for (ii = 0; pElem && ii < pElem->nClass && !isMatch; ii++) {
+                    isMatch = (pElem->azClass[ii] == pOp->zAtom);
                 }
                 break;
             }
 
             case CSS_SELECTOR_ID: {
-                const char *zId = p->zValue;
-                const char *zAttr = N_ATTR(x, "id");
-                if( !attrTest(CSS_SELECTOR_ATTRVALUE, zId, zAttr) ){
-                    return 0;
-                }
+                const char *zAttr = HtmlNodeAttr(x, "id");
+                isMatch = (zAttr && 0 == stricmp(zAttr, pOp->zValue));
                 break;
             }
 
@@ -3128,25 +5693,27 @@ HtmlCssSelectorTest(pSelector, pNode, dynamic_true)
             case CSS_SELECTOR_ATTRVALUE:
             case CSS_SELECTOR_ATTRLISTVALUE:
             case CSS_SELECTOR_ATTRHYPHEN:
-                if( !attrTest(p->eSelector, p->zValue, N_ATTR(x,p->zAttr)) ){
-                    return 0;
-                }
+                isMatch = attrTest(
+                    pOp->eOp, pOp->zValue, HtmlNodeAttr(x, pOp->zAttr)
+                );
                 break;
 
-            case CSS_SELECTORCHAIN_DESCENDANT: {
-                HtmlNode *pParent = N_PARENT(x);
-                CssSelector *pNext = p->pNext;
-                while (pParent) {
-                    if (HtmlCssSelectorTest(pNext, pParent, dynamic_true)) {
-                        return 1;
-                    }
-                    pParent = N_PARENT(pParent);
+            case CSS_SELECTORCHAIN_DESCENDANT:
+                x = N_PARENT(x);
+                if (x) {
+                    aBacktrack[nBacktrack].iOp = iOp + 1;
+                    aBacktrack[nBacktrack].x = x;
+                    nBacktrack++;
+                } else {
+                    isMatch = 0;
                 }
-                return 0;
-            }
+                break;
+
             case CSS_SELECTORCHAIN_CHILD:
                 x = N_PARENT(x);
+                isMatch = (x ? 1 : 0);
                 break;
+
             case CSS_SELECTORCHAIN_ADJACENT: {
                 HtmlNode *pParent = N_PARENT(x);
                 int i;
@@ -3156,92 +5723,228 @@ HtmlCssSelectorTest(pSelector, pNode, dynamic_true)
                     ((HtmlElementNode *)pParent)->pBefore == x ||
                     ((HtmlElementNode *)pParent)->pAfter == x 
                 ) {
-                    return 0;
+                    isMatch = 0;
+                    break;
                 }
 
                 /* Search for the nearest left-hand sibling that is not
-                 * white-space. If no such sibling exists, set x==0 (this
-                 * will cause the selector-match to fail). If the sibling
-                 * does exist, set x to point at it.
+                 * white-space. If no such sibling exists, the match fails.
+                 * If the sibling does exist, set x to point at it.
                  */
                 for (i = 0; N_CHILD(pParent, i) != x; i++);
-                i--;
                 do {
-                    x = N_CHILD(pParent, i);
                     i--;
-                } while (i >= 0 && HtmlNodeIsWhitespace(x));
-                if (i < 0) return 0;
-
-                break;
-            }
-
-            case CSS_PSEUDOCLASS_FIRSTCHILD: {
-                /* :first-child selector matches if x is the left-most child
-                 * of it's parent, not including white-space nodes. */
-                HtmlNode *pParent = N_PARENT(x);
-                int i;
-                if (!pParent) return 0;
-                for (i = 0; i < N_NUMCHILDREN(pParent); i++) {
-                    HtmlNode *pChild = N_CHILD(pParent, i);
-                    if (pChild == x) break;
-                    if (!HtmlNodeIsWhitespace(pChild)) return 0;
-                }
-                assert(i < N_NUMCHILDREN(pParent));
-                break;
-            }
-            case CSS_PSEUDOCLASS_LASTCHILD: {
-                /* :last-child selector matches if x is the right-most child
-                 * of it's parent, not including white-space nodes. */
-                HtmlNode *pParent = N_PARENT(x);
-                int i;
-                if (!pParent) return 0;
-                for (i = N_NUMCHILDREN(pParent) - 1; i >= 0; i--) {
-                    HtmlNode *pChild = N_CHILD(pParent, i);
-                    if (pChild == x) break;
-                    if (!HtmlNodeIsWhitespace(pChild)) return 0;
+                } while (i >= 0 && HtmlNodeIsWhitespace(N_CHILD(pParent, i)));
+                if (i < 0) {
+                    isMatch = 0;
+                } else {
+                    x = N_CHILD(pParent, i);
                 }
-                assert(i >= 0);
                 break;
             }
-                
-            case CSS_PSEUDOCLASS_LANG:
-                return 0;
-
-
-            case CSS_PSEUDOELEMENT_FIRSTLINE:
-            case CSS_PSEUDOELEMENT_FIRSTLETTER:
-                return 0;
 
-            case CSS_PSEUDOELEMENT_BEFORE:
-            case CSS_PSEUDOELEMENT_AFTER:
+            case CSS_PSEUDOCLASS_FIRSTCHILD:
+                isMatch = HtmlNodeIsEdgeChild(x, 0);
+                break;
+            case CSS_PSEUDOCLASS_LASTCHILD:
+                isMatch = HtmlNodeIsEdgeChild(x, 1);
                 break;
 
             case CSS_PSEUDOCLASS_ACTIVE:
-                if (dynamic_true || (pElem->flags & HTML_DYNAMIC_ACTIVE)) break;
-                return 0;
+                isMatch = pElem && 
+                    (dynamic_true || (pElem->flags & HTML_DYNAMIC_ACTIVE));
+                break;
             case CSS_PSEUDOCLASS_HOVER:
-                if (dynamic_true || (pElem->flags & HTML_DYNAMIC_HOVER)) break;
-                return 0;
+                isMatch = pElem && 
+                    (dynamic_true || (pElem->flags & HTML_DYNAMIC_HOVER));
+                break;
             case CSS_PSEUDOCLASS_FOCUS:
-                if (dynamic_true || (pElem->flags & HTML_DYNAMIC_FOCUS)) break;
-                return 0;
+                isMatch = pElem && 
+                    (dynamic_true || (pElem->flags & HTML_DYNAMIC_FOCUS));
+                break;
             case CSS_PSEUDOCLASS_LINK:
-                if (pElem->flags & HTML_DYNAMIC_LINK) break;
-                return 0;
+                isMatch = pElem && (pElem->flags & HTML_DYNAMIC_LINK);
+                break;
             case CSS_PSEUDOCLASS_VISITED:
-                if (pElem->flags & HTML_DYNAMIC_VISITED) break;
-                return 0;
+                isMatch = pElem && (pElem->flags & HTML_DYNAMIC_VISITED);
+                break;
 
+            case CSS_PSEUDOCLASS_LANG:
+            case CSS_PSEUDOELEMENT_FIRSTLINE:
+            case CSS_PSEUDOELEMENT_FIRSTLETTER:
             case CSS_SELECTOR_NEVERMATCH:
-                return 0;
+                isMatch = 0;
+                break;
 
             default:
                 assert(!"Impossible");
+                isMatch = 0;
+        }
+
+        if (rc >= 0) break;
+        if (isMatch) {
+            iOp++;
+            continue;
+        }
+
+        /* The match failed. Retry the most recent descendant combinator 
+         * with the next ancestor up the tree. If there are no more 
+         * ancestors to try, fall back to the previous descendant 
+         * combinator. If there are no descendant combinators left to
+         * retry, the selector does not match.
+         */
+        while (nBacktrack > 0) {
+            struct Backtrack *pB = &aBacktrack[nBacktrack - 1];
+            pB->x = N_PARENT(pB->x);
+            if (pB->x) {
+                x = pB->x;
+                iOp = pB->iOp;
+                if (pnBacktrack) (*pnBacktrack)++;
+                break;
+            }
+            nBacktrack--;
+        }
+        if (nBacktrack == 0) {
+            rc = 0;
+        }
+    }
+
+    if (aBacktrack != aStatic) {
+        HtmlFree(aBacktrack);
+    }
+    return rc;
+}
+
+int 
+HtmlCssSelectorTest(pSelector, pNode, dynamic_true)
+    CssSelector *pSelector;
+    HtmlNode *pNode;
+    int dynamic_true;
+{
+    return selectorTest(pSelector, pNode, dynamic_true, 0);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * ruleTest --
+ *
+ *     Test if the selector of rule pRule matches pNode, as for 
+ *     HtmlCssSelectorTest(). If the HtmlTree.isStyleProfile flag is set,
+ *     the test, any match, the number of backtracking steps and the time
+ *     taken are also added to the statistics stored in pRule.
+ *
+ * Results:
+ *     Non-zero is returned if the selector matches the node.
+ *
+ * Side effects:
+ *     May update the statistics stored in pRule.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+ruleTest(pTree, pRule, pNode, dynamic_true)
+    HtmlTree *pTree;
+    CssRule *pRule;
+    HtmlNode *pNode;
+    int dynamic_true;
+{
+    Tcl_Time t1;
+    Tcl_Time t2;
+    int isMatch;
+
+    if (!pTree->isStyleProfile) {
+        return selectorTest(pRule->pSelector, pNode, dynamic_true, 0);
+    }
+
+    Tcl_GetTime(&t1);
+    isMatch = selectorTest(
+        pRule->pSelector, pNode, dynamic_true, &pRule->nBacktrack
+    );
+    Tcl_GetTime(&t2);
+    pRule->iTime += (Tcl_WideInt)(t2.sec - t1.sec) * 1000000;
+    pRule->iTime += (t2.usec - t1.usec);
+    pRule->nTest++;
+    if (isMatch && !dynamic_true) {
+        pRule->nMatch++;
+    }
+    return isMatch;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCssAttributeDepends --
+ *
+ *     This is called before the value of attribute zAttr of node pNode
+ *     is changed from zOld to zNew by a script (either of zOld or zNew
+ *     may be NULL). Determine the positions in which the change may 
+ *     affect the selectors or values of the rules in the document 
+ *     stylesheets. For the "class" attribute, only the class names added
+ *     or removed by the change are considered. A change to the "style"
+ *     attribute always affects the node itself, as does any change if
+ *     the node's own "style" attribute uses attr() or tcl() values.
+ *
+ * Results:
+ *     Mask of CSS_DEPEND_XXX values, or 0 if the change cannot affect
+ *     the style of any node.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+int
+HtmlCssAttributeDepends(pTree, pNode, zAttr, zOld, zNew)
+    HtmlTree *pTree;
+    HtmlNode *pNode;
+    const char *zAttr;
+    const char *zOld;
+    const char *zNew;
+{
+    CssStyleSheet *pStyle = pTree->pStyle;
+    int mask = 0;
+
+    if (zOld && zNew && 0 == strcmp(zOld, zNew)) return 0;
+
+    if (HtmlNodeIsText(pNode)) return 0;
+    if (
+        0 == stricmp(zAttr, "style") ||
+        propertySetIsScripted(((HtmlElementNode *)pNode)->pStyle)
+    ) {
+        mask |= CSS_DEPEND_SUBJECT;
+    }
+    if (!pStyle) return mask;
+
+    mask |= dependMask(pStyle, 0, zAttr, -1);
+    mask |= dependMask(pStyle, 0, "*", -1);
+    mask |= dependMask(pStyle, '<', pNode->zTag, -1);
+
+    if (0 == stricmp(zAttr, "class")) {
+        const char *azList[2];
+        int i;
+        azList[0] = zOld;
+        azList[1] = zNew;
+        for (i = 0; i < 2; i++) {
+            const char *zOther = azList[1 - i];
+            const char *z = azList[i];
+            int n;
+            if (!z) continue;
+            while ((z = HtmlCssGetNextListItem(z, strlen(z), &n))) {
+                if (!zOther || !listTest(zOther, z, n)) {
+                    mask |= dependMask(pStyle, '.', z, n);
+                }
+                z += n;
+            }
         }
-        p = p->pNext;
     }
 
-    return (x && !p)?1:0;
+    if (0 == stricmp(zAttr, "id")) {
+        if (zOld) mask |= dependMask(pStyle, '#', zOld, -1);
+        if (zNew) mask |= dependMask(pStyle, '#', zNew, -1);
+    }
+
+    return mask;
 }
 
 /*
@@ -3249,9 +5952,15 @@ HtmlCssSelectorTest(pSelector, pNode, dynamic_true)
  *
  * HtmlCssInlineFree --
  *
+ *     Release a reference to a property set returned by 
+ *     HtmlCssInlineParse(). 
+ *
  * Results:
+ *     None.
  *
  * Side effects:
+ *     If this was the last reference, the declarations are freed and
+ *     removed from the HtmlTree.aInlineStyle table.
  *
  *---------------------------------------------------------------------------
  */
@@ -3259,7 +5968,20 @@ void
 HtmlCssInlineFree(pPropertySet)
     CssPropertySet *pPropertySet;
 {
-    propertySetFree(pPropertySet);
+    CssInlineStyle *pInline = (CssInlineStyle *)pPropertySet;
+    if (pInline) {
+        assert(pInline->nRef > 0);
+        pInline->nRef--;
+        if (pInline->nRef == 0) {
+            int ii;
+            Tcl_DeleteHashEntry(pInline->pEntry);
+            for (ii = 0; ii < pInline->set.n; ii++) {
+                propertyRelease(pInline->set.a[ii].pProp);
+            }
+            HtmlFree(pInline->set.a);
+            HtmlFree(pInline);
+        }
+    }
 }
 
 /*
@@ -3300,6 +6022,12 @@ propertySetToPropertyValues(p, aPropDone, pSet)
  *
  * ruleToPropertyValues --
  *
+ *     Add the declarations of rule pRule that do not correspond to a
+ *     set entry of aPropDone[] to the values being accumulated in p, 
+ *     and set the aPropDone[] entries for those that are valid. The
+ *     compiled form of the declarations (see ruleCompileProperties()) is
+ *     used if it is available and the widget is not logging. 
+ *
  * Results:
  *     None.
  *
@@ -3314,7 +6042,30 @@ ruleToPropertyValues(p, aPropDone, pRule)
     int *aPropDone;
     CssRule *pRule;
 {
-    propertySetToPropertyValues(p, aPropDone, pRule->pPropertySet);
+    CssRuleProperty *aProperty = pRule->aProperty;
+    int ii;
+
+    if (!aProperty || p->pTree->options.logcmd) {
+        propertySetToPropertyValues(p, aPropDone, pRule->pPropertySet);
+        return;
+    }
+
+    for (ii = 0; ii < pRule->nProperty; ii++) {
+        CssRuleProperty *pProperty = &aProperty[ii];
+        int eProp = pProperty->eProp;
+        if (aPropDone[eProp]) continue;
+        if (pProperty->iOffset >= 0) {
+            HtmlComputedValuesSetCompiled(
+                p, pProperty->iOffset, pProperty->eValue
+            );
+            aPropDone[eProp] = 1;
+        } else if (
+            !pProperty->pProp || 
+            0 == HtmlComputedValuesSet(p, eProp, pProperty->pProp)
+        ) {
+            aPropDone[eProp] = 1;
+        }
+    }
 }
 
 /*
@@ -3391,7 +6142,13 @@ applyRule(pTree, pNode, pRule, aPropDone, pzIfMatch, pCreator)
      * true if the selector matches, or false otherwise. 
      */
     CssSelector *pSelector = pRule->pSelector;
-    int isMatch = HtmlCssSelectorTest(pSelector, pNode, 0);
+    int isMatch;
+
+    /* Rules in an @media block that does not currently apply are 
+     * never matched.
+     */
+    if (!ruleIsActive(pRule)) return 0;
+    isMatch = ruleTest(pTree, pRule, pNode, 0);
 
     /* There is a match. Log some output for debugging. */
     LOG {
@@ -3427,32 +6184,126 @@ applyRule(pTree, pNode, pRule, aPropDone, pzIfMatch, pCreator)
 
 /*--------------------------------------------------------------------------
  *
+ * ruleHeapCompare --
+ * ruleHeapSift --
+ * ruleHeapInit --
  * nextRule --
  *
+ *     These functions are used by HtmlCssStyleSheetApply() to visit the
+ *     rules in a set of rules lists in priority order. Each list is sorted
+ *     in order of decreasing priority (see ruleCompare()). The array of 
+ *     list heads, apRule[], is maintained as a binary heap, so that the
+ *     head of the list at apRule[0] is always the highest priority rule
+ *     not yet visited:
+ *
+ *         ruleHeapCompare(apRule[(i-1)/2], aiList[(i-1)/2],
+ *                         apRule[i], aiList[i]) >= 0
+ *
+ *     aiList[i] is the index that the list now at apRule[i] had in the
+ *     array originally passed to ruleHeapInit(). If ruleCompare() finds
+ *     two list heads equal, the list with the lower index is visited
+ *     first. This is the order the linear scan the heap replaced used.
+ *
+ *     ruleHeapInit() removes any empty lists from the array and arranges
+ *     the remainder into a heap. It returns the number of lists in the
+ *     heap. Each call to nextRule() then removes and returns the highest
+ *     priority rule, or NULL once all lists are exhausted. This costs
+ *     O(log N) comparisons per rule, where N is the number of lists, 
+ *     instead of the O(N) of a linear scan. Elements that belong to many
+ *     classes have many lists.
+ *
  * Results:
+ *     See above.
  *
  * Side effects:
+ *     Modifies apRule[], aiList[] and *pn.
  *
  *--------------------------------------------------------------------------
  */
-static CssRule *
-nextRule(apRule, n)
+static int
+ruleHeapCompare(pA, iA, pB, iB)
+    CssRule *pA;
+    int iA;
+    CssRule *pB;
+    int iB;
+{
+    int res = ruleCompare(pA, pB);
+    if (res == 0) {
+        res = iB - iA;
+    }
+    return res;
+}
+
+static void
+ruleHeapSift(apRule, aiList, n, i)
     CssRule **apRule;
+    int *aiList;
     int n;
-{
-    CssRule **ppRule = 0;
-    CssRule *pRet = 0;
     int i;
+{
+    CssRule *pRule = apRule[i];
+    int iList = aiList[i];
+    while (1) {
+        int iChild = i * 2 + 1;
+        if (iChild >= n) break;
+        if (
+            iChild + 1 < n &&
+            ruleHeapCompare(apRule[iChild + 1], aiList[iChild + 1],
+                apRule[iChild], aiList[iChild]) > 0
+        ) {
+            iChild++;
+        }
+        if (ruleHeapCompare(pRule, iList, apRule[iChild], aiList[iChild]) >= 0) {
+            break;
+        }
+        apRule[i] = apRule[iChild];
+        aiList[i] = aiList[iChild];
+        i = iChild;
+    }
+    apRule[i] = pRule;
+    aiList[i] = iList;
+}
 
+static int
+ruleHeapInit(apRule, aiList, n)
+    CssRule **apRule;
+    int *aiList;
+    int n;
+{
+    int nHeap = 0;
+    int i;
     for (i = 0; i < n; i++) {
-        if (apRule[i] && (ppRule == 0 || ruleCompare(apRule[i], *ppRule) > 0)) {
-            ppRule = &apRule[i];
+        if (apRule[i]) {
+            aiList[nHeap] = i;
+            apRule[nHeap++] = apRule[i];
         }
     }
+    for (i = nHeap / 2 - 1; i >= 0; i--) {
+        ruleHeapSift(apRule, aiList, nHeap, i);
+    }
+    return nHeap;
+}
+
+static CssRule *
+nextRule(apRule, aiList, pn)
+    CssRule **apRule;
+    int *aiList;
+    int *pn;
+{
+    CssRule *pRet = 0;
 
-    if (ppRule) {
-        pRet = *ppRule;
-        *ppRule = (*ppRule)->pNext;
+    if (*pn > 0) {
+        pRet = apRule[0];
+        if (pRet->pNext) {
+            apRule[0] = pRet->pNext;
+        } else {
+            (*pn)--;
+            apRule[0] = apRule[*pn];
+            aiList[0] = aiList[*pn];
+        }
+        if (*pn > 0) {
+            ruleHeapSift(apRule, aiList, *pn, 0);
+        }
     }
 
     return pRet;
@@ -3460,60 +6311,125 @@ nextRule(apRule, n)
 
 /*--------------------------------------------------------------------------
  *
- * HtmlCssStyleSheetApply --
- *
- *     It is assumed that pNode->pStyle contains the stylesheet parsed from
- *     any HTML style attribute attached to the node.  Once this function
- *     returns, the HtmlNode.pPropertyValues variable points to the
- *     structure containing the computed values applied to the node.
+ * HtmlCssFilterAdd --
  *
- *     NOTE: There are two hard-coded limits in this function:
- *         1) No element may be a member of more than 126 classes.  
- *         2) No class name may be longer than 128 bytes (includes null term).
+ *     Add the tag, id and class names of element pNode to the ancestor
+ *     filter pFilter. This is called by the style engine before styling
+ *     the children of pNode.
  *
  * Results:
- *
  *     None.
  *
  * Side effects:
+ *     Sets bits in pFilter->aBit[].
  *
  *--------------------------------------------------------------------------
  */
-void 
-HtmlCssStyleSheetApply(pTree, pNode)
-    HtmlTree *pTree; 
-    HtmlNode *pNode; 
+void
+HtmlCssFilterAdd(pFilter, pNode)
+    CssAncestorFilter *pFilter;
+    HtmlNode *pNode;
 {
+    unsigned char *aBit = pFilter->aBit;
+    HtmlElementNode *pElem;
+    const char *zAttr;
+    unsigned int h;
+    int ii;
 
-    /* The two hard coded constants mentioned above */
-    #define MAX_CLASSES    126
-    #define MAX_CLASS_NAME 128
-
-    CssStyleSheet *pStyle = pTree->pStyle;    /* Stylesheet config */
-    CssRule *pRule;                           /* Iterator variable */
+    h = filterHash('t', pNode->zTag, strlen(pNode->zTag));
+    FILTER_SET(aBit, FILTER_BIT1(h));
+    FILTER_SET(aBit, FILTER_BIT2(h));
 
-    /* Boolean: set after considering the inline-style information */
-    int isStyleDone = 0;
+    zAttr = HtmlNodeAttr(pNode, "id");
+    if (zAttr) {
+        h = filterHash('i', zAttr, strlen(zAttr));
+        FILTER_SET(aBit, FILTER_BIT1(h));
+        FILTER_SET(aBit, FILTER_BIT2(h));
+    }
 
-    HtmlComputedValuesCreator sCreator;
+    pElem = HtmlNodeAsElement(pNode);
+    for (ii = 0; pElem && ii < pElem->nClass; ii++) {
+        const char *zClass = pElem->azClass[ii];
+        h = filterHash('c', zClass, strlen(zClass));
+        FILTER_SET(aBit, FILTER_BIT1(h));
+        FILTER_SET(aBit, FILTER_BIT2(h));
+    }
+}
 
-    /* The array aPropDone is large enough to contain an entry for each
-     * property recognized by the CSS parser (approx 110, includes many that
-     * Tkhtml does not use). After a property value is successfully written
-     * into sCreator, the matching aPropDone entry is set to true.
-     */
-    int aPropDone[CSS_PROPERTY_MAX_PROPERTY + 1];
+/*
+ *---------------------------------------------------------------------------
+ *
+ * filterReject --
+ *
+ *     Check if the ancestor hashes of rule pRule are all present in
+ *     filter pFilter. If not, the rule cannot match the node being styled.
+ *
+ * Results:
+ *     True if the rule may be skipped, otherwise false.
+ *
+ * Side effects:
+ *     Updates the pFilter->nTest and pFilter->nReject statistics.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+filterReject(pFilter, pRule)
+    CssAncestorFilter *pFilter;
+    CssRule *pRule;
+{
+    int ii;
+    for (ii = 0; ii < pRule->nAncestor; ii++) {
+        unsigned int h = pRule->aAncestor[ii];
+        if (
+            !FILTER_GET(pFilter->aBit, FILTER_BIT1(h)) || 
+            !FILTER_GET(pFilter->aBit, FILTER_BIT2(h))
+        ) {
+            break;
+        }
+    }
+    pFilter->nTest++;
+    if (ii < pRule->nAncestor) {
+        pFilter->nReject++;
+        return 1;
+    }
+    return 0;
+}
 
+/*--------------------------------------------------------------------------
+ *
+ * nodeRuleLists --
+ *
+ *     Populate the apRule[] array with the rules lists from stylesheet
+ *     pStyle that may contain rules that match element pNode. apRule[] 
+ *     must have space for at least (MAX_CLASSES + MAX_ATTRIBUTES + 6)
+ *     entries.
+ *
+ *     NOTE: There are two hard-coded limits in this function:
+ *         1) No element may be a member of more than 126 classes.  
+ *         2) No element may have more than 64 attributes that are used
+ *            to select a list from the CssStyleSheet.aByAttr table.
+ *
+ * Results:
+ *     Number of entries written to apRule[].
+ *
+ * Side effects:
+ *     None.
+ *
+ *--------------------------------------------------------------------------
+ */
+/* The two hard coded constants mentioned above */
+#define MAX_CLASSES    126
+#define MAX_ATTRIBUTES 64
+static int
+nodeRuleLists(pStyle, pNode, apRule)
+    CssStyleSheet *pStyle;
+    HtmlNode *pNode;
+    CssRule **apRule;
+{
     Tcl_HashEntry *pEntry;
-    char const *zClassAttr;            /* Value of node "class" attribute */
     char const *zIdAttr;               /* Value of node "id" attribute */
-
-    CssRule *apRule[MAX_CLASSES + 2];  /* Array of applicable rules lists. */
     int npRule;
 
-    int nSelectorMatch = 0;
-    int nSelectorTest = 0;
-
     HtmlElementNode *pElem = HtmlNodeAsElement(pNode);
     assert(pElem);
 
@@ -3536,28 +6452,273 @@ HtmlCssStyleSheetApply(pTree, pNode)
         }
     }
 
-    /* Find a rules list for each class the element belongs to */
-    zClassAttr = HtmlNodeAttr(pNode, "class");
-    if (zClassAttr) {
-        int nClass;
-        char const *zClass = zClassAttr;
-        char zTerm[MAX_CLASS_NAME];
+    /* Find a rules list for each class the element belongs to. The
+     * aByClass table is keyed by the interned (lower-case) class name.
+     */
+    if (pStyle->aByClass.numEntries > 0) {
+        int ii;
+        for (ii = 0; ii < pElem->nClass && npRule < (MAX_CLASSES + 2); ii++) {
+            pEntry = Tcl_FindHashEntry(&pStyle->aByClass, pElem->azClass[ii]);
+            if (pEntry) {
+                apRule[npRule++] = (CssRule *)Tcl_GetHashValue(pEntry);
+            }
+        }
+    }
 
-        while (
-            npRule < (MAX_CLASSES + 2) &&
-            (zClass = HtmlCssGetNextListItem(zClass, strlen(zClass), &nClass))
-        ) {
-            strncpy(zTerm, zClass, MIN(MAX_CLASS_NAME, nClass));
-            zTerm[MIN(MAX_CLASS_NAME - 1, nClass)] = '\0';
-            zClass += nClass;
+    /* Find the rules lists for each attribute of the element, and for
+     * the :link, :visited, :first-child and :last-child pseudo-classes
+     * that apply to it.
+     */
+    if (pStyle->aByAttr.numEntries > 0) {
+        HtmlAttributes *pAttr = pElem->pAttributes;
+        int nMax = npRule + MAX_ATTRIBUTES;
+        int ii;
+        for (ii = 0; pAttr && ii < pAttr->nAttr && npRule < nMax; ii++) {
+            pEntry = Tcl_FindHashEntry(&pStyle->aByAttr, pAttr->a[ii].zName);
+            if (pEntry) {
+                apRule[npRule++] = (CssRule *)Tcl_GetHashValue(pEntry);
+            }
+        }
+
+        pEntry = 0;
+        if (pElem->flags & HTML_DYNAMIC_LINK) {
+            pEntry = Tcl_FindHashEntry(&pStyle->aByAttr, ":link");
+            if (pEntry) apRule[npRule++] = (CssRule *)Tcl_GetHashValue(pEntry);
+        }
+        if (pElem->flags & HTML_DYNAMIC_VISITED) {
+            pEntry = Tcl_FindHashEntry(&pStyle->aByAttr, ":visited");
+            if (pEntry) apRule[npRule++] = (CssRule *)Tcl_GetHashValue(pEntry);
+        }
+        pEntry = Tcl_FindHashEntry(&pStyle->aByAttr, ":first-child");
+        if (pEntry && HtmlNodeIsEdgeChild(pNode, 0)) {
+            apRule[npRule++] = (CssRule *)Tcl_GetHashValue(pEntry);
+        }
+        pEntry = Tcl_FindHashEntry(&pStyle->aByAttr, ":last-child");
+        if (pEntry && HtmlNodeIsEdgeChild(pNode, 1)) {
+            apRule[npRule++] = (CssRule *)Tcl_GetHashValue(pEntry);
+        }
+    }
+
+    return npRule;
+}
+
+/*--------------------------------------------------------------------------
+ *
+ * HtmlCssStyleSheetMatch --
+ *
+ *     Match the rules of the current stylesheet against element pNode and
+ *     append a record of the results to match list pMatch. The record is
+ *     used by a subsequent call to HtmlCssStyleSheetApply() for pNode.
+ *
+ *     This function only reads the document tree and the stylesheet. So
+ *     it may be called from a worker thread while the Tk thread waits
+ *     for the results.
+ *
+ *     If pFilter is not NULL, it must contain the names of all ancestors
+ *     of pNode (see HtmlCssFilterAdd()).
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Appends a record to pMatch.
+ *
+ *--------------------------------------------------------------------------
+ */
+void
+HtmlCssStyleSheetMatch(pTree, pNode, pFilter, pMatch)
+    HtmlTree *pTree; 
+    HtmlNode *pNode; 
+    CssAncestorFilter *pFilter;     /* Filter of pNode's ancestors, or NULL */
+    CssMatchList *pMatch;           /* List to append results to */
+{
+    CssRule *apRule[MAX_CLASSES + MAX_ATTRIBUTES + 6];
+    int aiList[MAX_CLASSES + MAX_ATTRIBUTES + 6];
+    int npRule;
+    CssRule *pRule;
+    CssMatchNode *pRecord;
+
+    if (pMatch->nNode == pMatch->nNodeAlloc) {
+        int nByte;
+        pMatch->nNodeAlloc = pMatch->nNodeAlloc * 2 + 64;
+        nByte = pMatch->nNodeAlloc * sizeof(CssMatchNode);
+        pMatch->aNode = (CssMatchNode *)HtmlRealloc(
+            "CssMatchList.aNode", pMatch->aNode, nByte
+        );
+    }
+    pRecord = &pMatch->aNode[pMatch->nNode++];
+    pRecord->pNode = pNode;
+    pRecord->iEntry = pMatch->nEntry;
+    pRecord->nTest = 0;
+    pRecord->isShareable = 1;
+
+    npRule = nodeRuleLists(pTree->pStyle, pNode, apRule);
+    npRule = ruleHeapInit(apRule, aiList, npRule);
+    for (
+        pRule = nextRule(apRule, aiList, &npRule); 
+        pRule; 
+        pRule = nextRule(apRule, aiList, &npRule)
+    ) {
+        CssSelector *pSelector = pRule->pSelector;
+        int eMatch = 0;
+
+        pRecord->nTest++;
+        if (pFilter && pRule->nAncestor > 0 && filterReject(pFilter, pRule)) {
+            continue;
+        }
+        if (pRule->noShare) {
+            pRecord->isShareable = 0;
+        }
+        if (!ruleIsActive(pRule)) continue;
+
+        if (HtmlCssSelectorTest(pSelector, pNode, 0)) {
+            eMatch |= CSS_MATCH_STATIC;
+        }
+        if (pSelector->isDynamic && HtmlCssSelectorTest(pSelector, pNode, 1)){
+            eMatch |= CSS_MATCH_DYNAMIC;
+        }
+        if (eMatch) {
+            CssMatchEntry *pEntry;
+            if (pMatch->nEntry == pMatch->nEntryAlloc) {
+                int nByte;
+                pMatch->nEntryAlloc = pMatch->nEntryAlloc * 2 + 256;
+                nByte = pMatch->nEntryAlloc * sizeof(CssMatchEntry);
+                pMatch->aEntry = (CssMatchEntry *)HtmlRealloc(
+                    "CssMatchList.aEntry", pMatch->aEntry, nByte
+                );
+            }
+            pEntry = &pMatch->aEntry[pMatch->nEntry++];
+            pEntry->pRule = pRule;
+            pEntry->eMatch = eMatch;
+        }
+    }
+    pRecord->nEntry = pMatch->nEntry - pRecord->iEntry;
+}
+
+/*--------------------------------------------------------------------------
+ *
+ * HtmlCssMatchListSkip --
+ *
+ *     If the next record in match list pMatch is for node pNode, skip 
+ *     over it. pMatch may be NULL.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May modify pMatch->iNode.
+ *
+ *--------------------------------------------------------------------------
+ */
+void
+HtmlCssMatchListSkip(pMatch, pNode)
+    CssMatchList *pMatch;
+    HtmlNode *pNode;
+{
+    if (
+        pMatch && pMatch->iNode < pMatch->nNode && 
+        pMatch->aNode[pMatch->iNode].pNode == pNode
+    ) {
+        pMatch->iNode++;
+    }
+}
+
+/*--------------------------------------------------------------------------
+ *
+ * HtmlCssMatchListClear --
+ *
+ *     Free the memory allocated by HtmlCssStyleSheetMatch() for match
+ *     list pMatch, and reset it to empty.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     None.
+ *
+ *--------------------------------------------------------------------------
+ */
+void
+HtmlCssMatchListClear(pMatch)
+    CssMatchList *pMatch;
+{
+    HtmlFree(pMatch->aNode);
+    HtmlFree(pMatch->aEntry);
+    memset(pMatch, 0, sizeof(CssMatchList));
+}
+
+/*--------------------------------------------------------------------------
+ *
+ * HtmlCssStyleSheetApply --
+ *
+ *     It is assumed that pNode->pStyle contains the stylesheet parsed from
+ *     any HTML style attribute attached to the node.  Once this function
+ *     returns, the HtmlNode.pPropertyValues variable points to the
+ *     structure containing the computed values applied to the node.
+ *
+ *     If pFilter is not NULL, it must contain the names of all ancestors
+ *     of pNode (see HtmlCssFilterAdd()). It is used to skip rules that
+ *     cannot possibly match pNode.
+ *
+ *     If pMatch is not NULL and the next record in it is for pNode, the
+ *     rules stored in the record by HtmlCssStyleSheetMatch() are applied
+ *     instead of matching the stylesheet against pNode.
+ *
+ * Results:
+ *
+ *     True if none of the rules considered had the CssRule.noShare flag
+ *     set. In this case the computed values may be reused for a sibling
+ *     with the same tag name and attributes.
+ *
+ * Side effects:
+ *
+ *--------------------------------------------------------------------------
+ */
+int 
+HtmlCssStyleSheetApply(pTree, pNode, pFilter, pMatch)
+    HtmlTree *pTree; 
+    HtmlNode *pNode; 
+    CssAncestorFilter *pFilter;     /* Filter of pNode's ancestors, or NULL */
+    CssMatchList *pMatch;           /* Rules matched in advance, or NULL */
+{
+    CssStyleSheet *pStyle = pTree->pStyle;    /* Stylesheet config */
+    CssRule *pRule;                           /* Iterator variable */
+
+    /* Boolean: set after considering the inline-style information */
+    int isStyleDone = 0;
+
+    HtmlComputedValuesCreator sCreator;
+
+    /* The array aPropDone is large enough to contain an entry for each
+     * property recognized by the CSS parser (approx 110, includes many that
+     * Tkhtml does not use). After a property value is successfully written
+     * into sCreator, the matching aPropDone entry is set to true.
+     */
+    int aPropDone[CSS_PROPERTY_MAX_PROPERTY + 1];
+
+    /* Array of applicable rules lists. */
+    CssRule *apRule[MAX_CLASSES + MAX_ATTRIBUTES + 6];
+    int aiList[MAX_CLASSES + MAX_ATTRIBUTES + 6];
+    int npRule = 0;
+
+    /* Record of the rules matched in advance, if any */
+    CssMatchNode *pRecord = 0;
+
+    int nSelectorMatch = 0;
+    int nSelectorTest = 0;
+    int isShareable = 1;
+
+    HtmlElementNode *pElem = HtmlNodeAsElement(pNode);
+    assert(pElem);
 
-            pEntry = Tcl_FindHashEntry(&pStyle->aByClass, zTerm);
-            if (pEntry) {
-                apRule[npRule++] = (CssRule *)Tcl_GetHashValue(pEntry);
-            }
-        }
+    if (
+        pMatch && pMatch->iNode < pMatch->nNode && 
+        pMatch->aNode[pMatch->iNode].pNode == pNode
+    ) {
+        pRecord = &pMatch->aNode[pMatch->iNode++];
+    } else {
+        npRule = nodeRuleLists(pStyle, pNode, apRule);
     }
-    
 
     /* Initialise aPropDone and sCreator */
     HtmlComputedValuesInit(pTree, pNode, 0, &sCreator);
@@ -3571,18 +6732,49 @@ HtmlCssStyleSheetApply(pTree, pNode)
      */
     overrideToPropertyValues(&sCreator, aPropDone, pElem->pOverride);
 
+    /* If the rules were matched in advance, apply the properties of those
+     * that matched. The "style" attribute is handled at the same point as
+     * in the loop below.
+     */
+    if (pRecord) {
+        int ii;
+        for (ii = 0; ii < pRecord->nEntry; ii++) {
+            CssMatchEntry *pEntry = &pMatch->aEntry[pRecord->iEntry + ii];
+            pRule = pEntry->pRule;
+            if (!isStyleDone && !pRule->pPriority->important) {
+                isStyleDone = 1;
+                if (pElem->pStyle) {
+                    propertySetToPropertyValues(
+                        &sCreator, aPropDone, pElem->pStyle
+                    );
+                }
+            }
+            if (pEntry->eMatch & CSS_MATCH_STATIC) {
+                ruleToPropertyValues(&sCreator, aPropDone, pRule);
+                nSelectorMatch++;
+            }
+            if (pEntry->eMatch & CSS_MATCH_DYNAMIC) {
+                HtmlCssAddDynamic(pTree, pElem, pRule->pSelector, 0);
+            }
+        }
+        nSelectorTest = pRecord->nTest;
+        isShareable = pRecord->isShareable;
+    }
+
     /* Loop through the list of CSS rules in the stylesheet. Rules that occur
      * earlier in the list have a higher priority than those that occur later.
      */
+    npRule = ruleHeapInit(apRule, aiList, npRule);
     for (
-        pRule = nextRule(apRule, npRule); 
+        pRule = nextRule(apRule, aiList, &npRule); 
         pRule; 
-        pRule = nextRule(apRule, npRule)
+        pRule = nextRule(apRule, aiList, &npRule)
     ) {
         CssPriority *pPriority = pRule->pPriority;
         CssSelector *pSelector = pRule->pSelector;
 
         nSelectorTest++;
+        pRule->nCandidate += pTree->isStyleProfile;
 
         /* The contents of the "style" attribute, if one exists, are handled
          * after the important rules but before anything else. This is because:
@@ -3600,15 +6792,25 @@ HtmlCssStyleSheetApply(pTree, pNode)
             }
         }
 
+        /* Skip rules that require an ancestor pNode does not have. */
+        if (pFilter && pRule->nAncestor > 0 && filterReject(pFilter, pRule)) {
+            pRule->nReject += pTree->isStyleProfile;
+            continue;
+        }
+        if (pRule->noShare) {
+            isShareable = 0;
+        }
+
         /* If the selector is a match for our node, apply the rule properties */
         nSelectorMatch += 
                 applyRule(pTree, pNode, pRule, aPropDone, 0, &sCreator);
 
         if (
             pSelector->isDynamic &&
-            HtmlCssSelectorTest(pSelector, pNode, 1)
+            ruleIsActive(pRule) &&
+            ruleTest(pTree, pRule, pNode, 1)
         ) {
-            HtmlCssAddDynamic(pElem, pSelector, 0);
+            HtmlCssAddDynamic(pTree, pElem, pSelector, 0);
         }
     }
 
@@ -3627,6 +6829,7 @@ HtmlCssStyleSheetApply(pTree, pNode)
      * HtmlComputedValues structure.
      */
     pElem->pPropertyValues = HtmlComputedValuesFinish(&sCreator);
+    return isShareable;
 }
 
 /*--------------------------------------------------------------------------
@@ -3659,15 +6862,21 @@ generateContentText(pTree, zContent)
  *
  * generatedContent --
  *
+ *     Compute the :before or :after content of element pNode. If *ppNode
+ *     already holds a generated node with the same 'content' text, it is
+ *     kept and its computed values updated in place. Otherwise any existing
+ *     node is freed and, if there is generated content, a new one created.
+ *
  * Results:
  *
- *     None.
+ *     True if *ppNode was created, freed or modified, or false if the
+ *     generated content is unchanged.
  *
  * Side effects:
  *
  *--------------------------------------------------------------------------
  */
-static void 
+static int 
 generatedContent(pTree, pNode, pCssRule, ppNode)
     HtmlTree *pTree;
     HtmlNode *pNode;
@@ -3688,14 +6897,38 @@ generatedContent(pTree, pNode, pCssRule, ppNode)
     sCreator.pzContent = &zContent;
     for (pRule = pCssRule; pRule; pRule = pRule->pNext) {
         char **pz = (have ? 0 : (&zContent));
-        int isMatch = applyRule(pTree, pNode, pRule, aPropDone, pz, &sCreator);
+        int isMatch;
+        pRule->nCandidate += pTree->isStyleProfile;
+        isMatch = applyRule(pTree, pNode, pRule, aPropDone, pz, &sCreator);
         if (isMatch) have = 1;
     }
     if (have) {
         pValues = HtmlComputedValuesFinish(&sCreator);
     } else {
         assert(zContent == 0);
-        return;
+        if (*ppNode) {
+            HtmlNodeFreeGenerated(pTree, ppNode);
+            return 1;
+        }
+        return 0;
+    }
+
+    /* If the 'content' text is unchanged, keep the existing node. */
+    if (*ppNode) {
+        HtmlElementNode *pElem = (HtmlElementNode *)(*ppNode);
+        const char *zOld = pElem->zGenerated;
+        if (zOld ? (zContent && !strcmp(zOld, zContent)) : !zContent) {
+            HtmlFree(zContent);
+            if (pElem->pPropertyValues == pValues) {
+                HtmlComputedValuesRelease(pTree, pValues);
+                return 0;
+            }
+            HtmlComputedValuesRelease(pTree, pElem->pPropertyValues);
+            pElem->pPropertyValues = pValues;
+            HtmlLayoutInvalidateCache(pTree, *ppNode);
+            return 1;
+        }
+        HtmlNodeFreeGenerated(pTree, ppNode);
     }
 
     *ppNode = (HtmlNode *)HtmlNew(HtmlElementNode);
@@ -3703,29 +6936,34 @@ generatedContent(pTree, pNode, pCssRule, ppNode)
 
     if (zContent) {
         /* If a value was specified for the 'content' property, create
-         * a text node also.
+         * a text node also. The string is kept for comparison the next
+         * time the parent element is restyled.
          */
         HtmlTextNode *pTextNode = generateContentText(pTree, zContent);
         int idx = HtmlNodeAddTextChild(*ppNode, pTextNode);
         HtmlNodeChild(*ppNode, idx)->iNode = HTML_NODE_GENERATED;
-        HtmlFree(zContent);
+        ((HtmlElementNode *)(*ppNode))->zGenerated = zContent;
     }
+    return 1;
 }
 
 /*--------------------------------------------------------------------------
  *
- * HtmlCssStyleSheetGenerated --
+ * HtmlCssStyleGenerateContent --
  *
- *     Retrieve the value of a specified property from a CssProperties
- *     object, or NULL if the property is not defined.
+ *     Update the generated :before (if isBefore is true) or :after 
+ *     content of element pElem. An existing generated node is reused
+ *     if its 'content' text has not changed.
  *
  * Results:
  *
+ *     True if the generated content changed in any way.
+ *
  * Side effects:
  *
  *--------------------------------------------------------------------------
  */
-void HtmlCssStyleGenerateContent(pTree, pElem, isBefore)
+int HtmlCssStyleGenerateContent(pTree, pElem, isBefore)
     HtmlTree *pTree;
     HtmlElementNode *pElem;
     int isBefore;
@@ -3733,10 +6971,11 @@ void HtmlCssStyleGenerateContent(pTree, pElem, isBefore)
     CssStyleSheet *pStyle = pTree->pStyle;    /* Stylesheet config */
     HtmlNode *pNode = (HtmlNode *)pElem;
     if (isBefore) {
-        generatedContent(pTree, pNode, pStyle->pBeforeRules, &pElem->pBefore);
-    } else {
-        generatedContent(pTree, pNode, pStyle->pAfterRules, &pElem->pAfter);
+        return generatedContent(
+            pTree, pNode, pStyle->pBeforeRules, &pElem->pBefore
+        );
     }
+    return generatedContent(pTree, pNode, pStyle->pAfterRules, &pElem->pAfter);
 }
 
 /*--------------------------------------------------------------------------
@@ -3810,53 +7049,314 @@ void HtmlCssSelectorComma(pParse)
 /*
  *---------------------------------------------------------------------------
  *
- * HtmlCssImport --
+ * importEval --
  *
- *     The parser calls this function when an @import directive is encountered.
- *     The pToken argument contains the specified URL.
+ *     Process the @import directive pImport. If the media condition 
+ *     matches, the URL is translated by the -urlcmd script (if required)
+ *     and passed to the -importcmd script. The script is invoked 
+ *     immediately, or queued to be invoked from an idle callback if the 
+ *     -asyncimport option is set.
  *
  * Results:
  *     None.
  *
  * Side effects:
- *     May invoke the -importcmd script.
+ *     Frees pImport. May invoke the -urlcmd and -importcmd scripts.
  *
  *---------------------------------------------------------------------------
  */
-void HtmlCssImport(pParse, pToken)
+static void
+importEval(pParse, pImport)
     CssParse *pParse;
-    CssToken *pToken;
+    CssImport *pImport;
 {
-    Tcl_Obj *pEval = pParse->pImportCmd;
-
-    /* Do nothing if the isIgnore or isBody flags are set */
-    if (pParse->isBody) return;
+    HtmlTree *pTree = pParse->pTree;
+    CssProperty *p = pImport->pUrl;
+    CssMedia *pMedia = pImport->pMedia;
 
-    if (pEval) {
+    assert(!pParse->isDetached);
+    if (p && (!pMedia || HtmlCssMediaTest(pTree, pMedia))) {
         Tcl_Interp *interp = pParse->interp;
-        CssProperty *p = tokenToProperty(pParse, pToken);
-        CONST char *zUrl = p->v.zVal;
+        Tcl_Obj *pEval;
+        CONST char *zUrl;
+
+        if (p->eType == CSS_TYPE_URLCMD) {
+            p = propertyUrlCmd(pParse, p);
+        }
+        zUrl = p->v.zVal;
 
         switch (p->eType) {
             case CSS_TYPE_URL:
                 break;
             case CSS_TYPE_RAW:
             case CSS_TYPE_STRING:
-                if (pParse && pParse->pUrlCmd) {
+                if (pParse->pUrlCmd) {
                     doUrlCmd(pParse, zUrl, strlen(zUrl));
                     zUrl = Tcl_GetStringResult(pParse->interp);
                 }
                 break;
             default:
-                return;
+                zUrl = 0;
+                break;
+        }
+
+        if (zUrl) {
+            pEval = Tcl_DuplicateObj(pParse->pImportCmd);
+            Tcl_IncrRefCount(pEval);
+            Tcl_ListObjAppendElement(interp, pEval, Tcl_NewStringObj(zUrl,-1));
+            if (pTree && pTree->options.asyncimport) {
+                /* Queue the script to be evaluated once the current parse
+                 * (and any others already scheduled) is finished. 
+                 */
+                if (!pTree->pPendingImport) {
+                    pTree->pPendingImport = Tcl_NewObj();
+                    Tcl_IncrRefCount(pTree->pPendingImport);
+                    Tcl_DoWhenIdle(pendingImportCb, (ClientData)pTree);
+                }
+                Tcl_ListObjAppendElement(0, pTree->pPendingImport, pEval);
+            } else {
+                Tcl_EvalObjEx(interp, pEval, TCL_EVAL_GLOBAL|TCL_EVAL_DIRECT);
+            }
+            Tcl_DecrRefCount(pEval);
+        }
+    }
+
+    HtmlFree(p);
+    HtmlFree(pMedia);
+    HtmlFree(pImport);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCssImport --
+ *
+ *     The parser calls this function when an @import directive is 
+ *     encountered. The pToken argument contains the specified URL. 
+ *     Argument pMedia is the media condition, or NULL if the directive
+ *     does not specify one. This function takes ownership of it.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May invoke the -importcmd script (see importEval()). Or, if this 
+ *     is a detached parse, append the directive to pParse->pImport.
+ *
+ *---------------------------------------------------------------------------
+ */
+void HtmlCssImport(pParse, pToken, pMedia)
+    CssParse *pParse;
+    CssToken *pToken;
+    CssMedia *pMedia;
+{
+    CssImport *pImport;
+
+    /* Do nothing if the isBody flag is set, or there is no -importcmd */
+    if (pParse->isBody || !pParse->pImportCmd) {
+        HtmlFree(pMedia);
+        return;
+    }
+
+    /* Unless this is a detached parse, test the media condition now. The
+     * URL is not passed to the -urlcmd script if it does not match.
+     */
+    if (pMedia && !pParse->isDetached) {
+        int isMatch = HtmlCssMediaTest(pParse->pTree, pMedia);
+        HtmlFree(pMedia);
+        pMedia = 0;
+        if (!isMatch) return;
+    }
+
+    pImport = HtmlNew(CssImport);
+    pImport->pUrl = tokenToProperty(pParse, pToken);
+    pImport->pMedia = pMedia;
+
+    if (pParse->isDetached) {
+        CssImport **pp;
+        for (pp = &pParse->pImport; *pp; pp = &(*pp)->pNext);
+        *pp = pImport;
+    } else {
+        importEval(pParse, pImport);
+    }
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCssMediaTest --
+ *
+ *     Test if the media condition pMedia matches the current state of 
+ *     widget pTree. The media type is compared against the -mediatype
+ *     option, and any width or height features against the size of the
+ *     viewport (determined in the same way as the layout engine does).
+ *     pTree may be NULL, in which case the media type is "screen" and
+ *     the viewport size is zero.
+ *
+ * Results:
+ *     True if the condition matches, otherwise false.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+int 
+HtmlCssMediaTest(pTree, pMedia)
+    HtmlTree *pTree;
+    CssMedia *pMedia;
+{
+    const char *zMediaType = "screen";
+    int iWidth = 0;
+    int iHeight = 0;
+    int ii;
+
+    if (pTree && pTree->options.mediatype) {
+        zMediaType = Tcl_GetString(pTree->options.mediatype);
+    }
+    if (pTree && pTree->tkwin) {
+        iWidth = Tk_Width(pTree->tkwin);
+        if (iWidth < 5 || pTree->options.forcewidth) {
+            iWidth = pTree->options.width;
+        }
+        iHeight = Tk_Height(pTree->tkwin);
+        if (iHeight < 5) {
+            iHeight = pTree->options.height;
+        }
+    }
+
+    for (ii = 0; ii < pMedia->nQuery; ii++) {
+        CssMediaQuery *p = &pMedia->aQuery[ii];
+        int isMatch = 1;
+        if (p->isNever) continue;
+
+        if (p->zType[0] && stricmp(p->zType, "all")) {
+            isMatch = (0 == stricmp(p->zType, zMediaType));
+        }
+        if (
+            (p->iMinWidth >= 0 && iWidth < p->iMinWidth) ||
+            (p->iMaxWidth >= 0 && iWidth > p->iMaxWidth) ||
+            (p->iMinHeight >= 0 && iHeight < p->iMinHeight) ||
+            (p->iMaxHeight >= 0 && iHeight > p->iMaxHeight)
+        ) {
+            isMatch = 0;
+        }
+        if (p->isNot) isMatch = !isMatch;
+        if (isMatch) return 1;
+    }
+    return 0;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCssMedia --
+ *
+ *     The parser calls this function when it enters an @media block. 
+ *     Argument pMedia is the media condition. This function takes
+ *     ownership of it.
+ *
+ *     If a stylesheet is being parsed, the condition is attached to the
+ *     stylesheet and to each rule created before the end of the block.
+ *     This way the rules do not have to be reparsed when the condition
+ *     starts or stops matching (see HtmlCssMediaUpdate()).
+ *
+ * Results:
+ *     Zero if the parser should skip the contents of the block, or 
+ *     non-zero otherwise.
+ *
+ * Side effects:
+ *     Sets pParse->pMedia.
+ *
+ *---------------------------------------------------------------------------
+ */
+int 
+HtmlCssMedia(pParse, pMedia)
+    CssParse *pParse;
+    CssMedia *pMedia;
+{
+    /* The condition is tested by pendingStyleMerge() if this is a
+     * detached parse. 
+     */
+    if (!pParse->isDetached) {
+        pMedia->isMatch = HtmlCssMediaTest(pParse->pTree, pMedia);
+    }
+    if (!pParse->pStyleId) {
+        int isMatch = pMedia->isMatch;
+        HtmlFree(pMedia);
+        return isMatch;
+    }
+
+    pMedia->pPriority = pParse->pPriority1;
+    pMedia->pNext = pParse->pStyle->pMedia;
+    pParse->pStyle->pMedia = pMedia;
+    pParse->pMedia = pMedia;
+    return 1;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCssMediaUpdate --
+ *
+ *     Reevaluate each @media condition in the widget stylesheet. This is 
+ *     called when the size of the viewport or the -mediatype option may
+ *     have changed. For each condition that starts or stops matching,
+ *     the nodes that may be matched by rules in the corresponding @media
+ *     blocks are scheduled for restyle.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May call HtmlCallbackRestyle().
+ *
+ *---------------------------------------------------------------------------
+ */
+void
+HtmlCssMediaUpdate(pTree)
+    HtmlTree *pTree;
+{
+    CssStyleSheet *pStyle = pTree->pStyle;
+    CssMedia *pMedia;
+    int nChanged = 0;
+
+    if (!pStyle) return;
+
+    for (pMedia = pStyle->pMedia; pMedia; pMedia = pMedia->pNext) {
+        int isMatch = HtmlCssMediaTest(pTree, pMedia);
+        pMedia->isChanged = (isMatch != pMedia->isMatch);
+        pMedia->isMatch = isMatch;
+        nChanged += pMedia->isChanged;
+    }
+
+    if (nChanged > 0) {
+        CssReplace sReplace;
+        int nRule = 0;
+        int ii;
+
+        /* Set sReplace.apAdded[] to the list of rules that have just
+         * been enabled or disabled.
+         */
+        memset(&sReplace, 0, sizeof(CssReplace));
+        styleSheetCollect(pStyle, &sReplace.apAdded, &nRule);
+        for (ii = 0; ii < nRule; ii++) {
+            CssRule *pRule = sReplace.apAdded[ii];
+            if (pRule->pMedia && pRule->pMedia->isChanged) {
+                sReplace.apAdded[sReplace.nAdded++] = pRule;
+            }
         }
 
-        pEval = Tcl_DuplicateObj(pEval);
-        Tcl_IncrRefCount(pEval);
-        Tcl_ListObjAppendElement(interp, pEval, Tcl_NewStringObj(zUrl, -1));
-        Tcl_EvalObjEx(interp, pEval, TCL_EVAL_GLOBAL|TCL_EVAL_DIRECT);
-        Tcl_DecrRefCount(pEval);
-        HtmlFree(p);
+        if (pTree->pRoot && sReplace.nAdded > 0) {
+            HtmlWalkTree(pTree, 0, replaceInvalidateCb, (ClientData)&sReplace);
+        }
+        LOG {
+            HtmlLog(pTree, "STYLEENGINE", 
+                "Media conditions changed: %d/%d rules toggled, "
+                "%d nodes restyled", sReplace.nAdded, nRule, sReplace.nRestyle
+            );
+        }
+        HtmlFree(sReplace.apAdded);
     }
 }
 
@@ -4018,6 +7518,7 @@ HtmlCssStyleReport(clientData, interp, objc, objv)
     int nByTag = 0;
     int nByClass = 0;
     int nById = 0;
+    int nByAttr = 0;
     int nAfter = 0;
     int nBefore = 0;
 
@@ -4032,6 +7533,7 @@ HtmlCssStyleReport(clientData, interp, objc, objv)
     Tcl_Obj *pByTag;
     Tcl_Obj *pByClass;
     Tcl_Obj *pById;
+    Tcl_Obj *pByAttr;
 
     Tcl_Obj *pReport;
 
@@ -4110,6 +7612,22 @@ HtmlCssStyleReport(clientData, interp, objc, objv)
     }
     Tcl_AppendStringsToObj(pById, "</table>", NULL);
 
+    pByAttr = Tcl_NewObj();
+    Tcl_IncrRefCount(pByAttr);
+    Tcl_AppendStringsToObj(pByAttr, 
+        "<h1>By Attribute and Pseudo-class Rules</h1>",
+        "<table border=1>", NULL
+    );
+    for (
+        pEntry = Tcl_FirstHashEntry(&pStyle->aByAttr, &search);
+        pEntry;
+        pEntry = Tcl_NextHashEntry(&search)
+    ) {
+        pRule = (CssRule *)Tcl_GetHashValue(pEntry);
+        rulelistReport(pRule, pByAttr, &nByAttr);
+    }
+    Tcl_AppendStringsToObj(pByAttr, "</table>", NULL);
+
     pReport = Tcl_NewObj();
     Tcl_IncrRefCount(pReport);
 
@@ -4128,6 +7646,9 @@ HtmlCssStyleReport(clientData, interp, objc, objv)
     Tcl_AppendStringsToObj(pReport, "<li>By id rules lists: ", NULL);
     Tcl_AppendObjToObj(pReport, Tcl_NewIntObj(nById));
 
+    Tcl_AppendStringsToObj(pReport, "<li>By attribute rules lists: ", NULL);
+    Tcl_AppendObjToObj(pReport, Tcl_NewIntObj(nByAttr));
+
     Tcl_AppendStringsToObj(pReport, "<li>:before rules lists: ", NULL);
     Tcl_AppendObjToObj(pReport, Tcl_NewIntObj(nBefore));
 
@@ -4139,6 +7660,7 @@ HtmlCssStyleReport(clientData, interp, objc, objv)
     Tcl_AppendObjToObj(pReport, pByTag);
     Tcl_AppendObjToObj(pReport, pByClass);
     Tcl_AppendObjToObj(pReport, pById);
+    Tcl_AppendObjToObj(pReport, pByAttr);
     Tcl_AppendObjToObj(pReport, pBefore);
     Tcl_AppendObjToObj(pReport, pAfter);
 
@@ -4148,6 +7670,7 @@ HtmlCssStyleReport(clientData, interp, objc, objv)
     Tcl_DecrRefCount(pByTag);
     Tcl_DecrRefCount(pByClass);
     Tcl_DecrRefCount(pById);
+    Tcl_DecrRefCount(pByAttr);
       
     return TCL_OK;
 }
@@ -4203,7 +7726,7 @@ HtmlCssStyleConfigDump(clientData, interp, objc, objv)
 #define MAX_RULES 8096
     HtmlTree *pTree = (HtmlTree *)clientData;
     CssStyleSheet *pStyle = pTree->pStyle;
-    Tcl_HashTable *apTable[3];
+    Tcl_HashTable *apTable[4];
 
     CssRule *pRule;
     CssRule *apRule[MAX_RULES];
@@ -4220,7 +7743,8 @@ HtmlCssStyleConfigDump(clientData, interp, objc, objv)
     apTable[0] = &pStyle->aByTag;
     apTable[1] = &pStyle->aById;
     apTable[2] = &pStyle->aByClass;
-    for (jj = 0; jj < 3; jj++) {
+    apTable[3] = &pStyle->aByAttr;
+    for (jj = 0; jj < 4; jj++) {
         Tcl_HashEntry *pEntry;
         Tcl_HashSearch search;
         for (pEntry = Tcl_FirstHashEntry(apTable[jj], &search);
@@ -4289,6 +7813,195 @@ HtmlCssStyleConfigDump(clientData, interp, objc, objv)
     return TCL_OK;
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * profileCollect --
+ *
+ *     Append each rule in the linked list pList to the growable array
+ *     *papRule. *pnRule is the number of entries currently in the array
+ *     and *pnAlloc the number allocated.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May reallocate *papRule.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+profileCollect(pList, papRule, pnRule, pnAlloc)
+    CssRule *pList;
+    CssRule ***papRule;
+    int *pnRule;
+    int *pnAlloc;
+{
+    CssRule *pRule;
+    for (pRule = pList; pRule; pRule = pRule->pNext) {
+        if (*pnRule == *pnAlloc) {
+            int nByte;
+            *pnAlloc = *pnAlloc * 2 + 64;
+            nByte = *pnAlloc * sizeof(CssRule *);
+            *papRule = (CssRule **)HtmlRealloc("apRule", *papRule, nByte);
+        }
+        (*papRule)[(*pnRule)++] = pRule;
+    }
+}
+
+/*
+ * Comparison function for qsort() used by HtmlCssStyleProfile(). Sorts
+ * rules from most to least expensive. Rules that took the same time are
+ * ordered by the number of backtracking steps and then selector tests.
+ */
+static int 
+profileQsortCompare(const void *p1, const void *p2)
+{
+    CssRule *pRule1 = *(CssRule **)p1;
+    CssRule *pRule2 = *(CssRule **)p2;
+    if (pRule1->iTime != pRule2->iTime) {
+        return (pRule1->iTime > pRule2->iTime) ? -1 : 1;
+    }
+    if (pRule1->nBacktrack != pRule2->nBacktrack) {
+        return pRule2->nBacktrack - pRule1->nBacktrack;
+    }
+    return pRule2->nTest - pRule1->nTest;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCssStyleProfile --
+ *
+ *         widget _styleprofile on
+ *         widget _styleprofile off
+ *         widget _styleprofile report ?N?
+ *
+ *     This function contains the implementation of the Tcl widget command
+ *     "_styleprofile". The "on" sub-command zeroes the statistics stored
+ *     in each rule of the current stylesheet configuration and begins
+ *     collecting new ones. While collecting, the style engine counts for
+ *     each rule the number of times it is considered for an element,
+ *     rejected by the ancestor filter, tested and matched, the number of
+ *     descendant combinator retries and the time spent testing it. 
+ *
+ *     The "report" sub-command returns a list describing the N (default
+ *     10) most expensive rules. Each element is a key-value list:
+ *
+ *         {selector SELECTOR candidates N rejects N tests N 
+ *          matches N backtracks N usec N}
+ *
+ * Results:
+ *     Tcl result (i.e. TCL_OK, TCL_ERROR).
+ *
+ * Side effects:
+ *     May set or clear HtmlTree.isStyleProfile.
+ *
+ *---------------------------------------------------------------------------
+ */
+int
+HtmlCssStyleProfile(clientData, interp, objc, objv)
+    ClientData clientData;             /* The HTML widget data structure */
+    Tcl_Interp *interp;                /* Current interpreter. */
+    int objc;                          /* Number of arguments. */
+    Tcl_Obj *CONST objv[];             /* Argument strings. */
+{
+    HtmlTree *pTree = (HtmlTree *)clientData;
+    CssStyleSheet *pStyle = pTree->pStyle;
+    const char *azCmd[] = {"off", "on", "report", 0};
+    enum {PROFILE_OFF, PROFILE_ON, PROFILE_REPORT};
+    Tcl_HashTable *apTable[4];
+    CssRule **apRule = 0;
+    int nRule = 0;
+    int nAlloc = 0;
+    int nReport = 10;
+    int iCmd;
+    int ii;
+
+    if (objc != 3 && objc != 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "on|off|report ?N?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[2], azCmd, "option", 0, &iCmd)) {
+        return TCL_ERROR;
+    }
+    if (objc == 4) {
+        if (iCmd != PROFILE_REPORT) {
+            Tcl_WrongNumArgs(interp, 2, objv, "on|off|report ?N?");
+            return TCL_ERROR;
+        }
+        if (Tcl_GetIntFromObj(interp, objv[3], &nReport)) {
+            return TCL_ERROR;
+        }
+    }
+
+    if (iCmd == PROFILE_OFF) {
+        pTree->isStyleProfile = 0;
+        return TCL_OK;
+    }
+
+    if (pStyle) {
+        apTable[0] = &pStyle->aByTag;
+        apTable[1] = &pStyle->aById;
+        apTable[2] = &pStyle->aByClass;
+        apTable[3] = &pStyle->aByAttr;
+        profileCollect(pStyle->pUniversalRules, &apRule, &nRule, &nAlloc);
+        profileCollect(pStyle->pBeforeRules, &apRule, &nRule, &nAlloc);
+        profileCollect(pStyle->pAfterRules, &apRule, &nRule, &nAlloc);
+        for (ii = 0; ii < 4; ii++) {
+            Tcl_HashEntry *pEntry;
+            Tcl_HashSearch search;
+            for (pEntry = Tcl_FirstHashEntry(apTable[ii], &search);
+                 pEntry;
+                 pEntry = Tcl_NextHashEntry(&search)
+            ) {
+                CssRule *pList = (CssRule *)Tcl_GetHashValue(pEntry);
+                profileCollect(pList, &apRule, &nRule, &nAlloc);
+            }
+        }
+    }
+
+    if (iCmd == PROFILE_ON) {
+        for (ii = 0; ii < nRule; ii++) {
+            CssRule *pRule = apRule[ii];
+            pRule->nCandidate = 0;
+            pRule->nReject = 0;
+            pRule->nTest = 0;
+            pRule->nMatch = 0;
+            pRule->nBacktrack = 0;
+            pRule->iTime = 0;
+        }
+        pTree->isStyleProfile = 1;
+    } else {
+        Tcl_Obj *pRet = Tcl_NewObj();
+        qsort(apRule, nRule, sizeof(CssRule *), profileQsortCompare);
+        for (ii = 0; ii < nRule && ii < nReport; ii++) {
+            CssRule *pRule = apRule[ii];
+            Tcl_Obj *pList = Tcl_NewObj();
+            Tcl_Obj *pSelector = Tcl_NewObj();
+
+            HtmlCssSelectorToString(pRule->pSelector, pSelector);
+            Tcl_ListObjAppendElement(0, pList, Tcl_NewStringObj("selector",-1));
+            Tcl_ListObjAppendElement(0, pList, pSelector);
+#define PROFILE_APPEND(zKey, pValue) \
+    Tcl_ListObjAppendElement(0, pList, Tcl_NewStringObj(zKey, -1)); \
+    Tcl_ListObjAppendElement(0, pList, pValue);
+            PROFILE_APPEND("candidates", Tcl_NewIntObj(pRule->nCandidate));
+            PROFILE_APPEND("rejects",    Tcl_NewIntObj(pRule->nReject));
+            PROFILE_APPEND("tests",      Tcl_NewIntObj(pRule->nTest));
+            PROFILE_APPEND("matches",    Tcl_NewIntObj(pRule->nMatch));
+            PROFILE_APPEND("backtracks", Tcl_NewIntObj(pRule->nBacktrack));
+            PROFILE_APPEND("usec",       Tcl_NewWideIntObj(pRule->iTime));
+#undef PROFILE_APPEND
+            Tcl_ListObjAppendElement(0, pRet, pList);
+        }
+        Tcl_SetObjResult(interp, pRet);
+    }
+
+    HtmlFree(apRule);
+    return TCL_OK;
+}
+
 /*
  *---------------------------------------------------------------------------
  *
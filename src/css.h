@@ -66,6 +66,9 @@ typedef struct CssProperty CssProperty;
 typedef struct CssDynamic CssDynamic;
 
 typedef struct CssPropertySet CssPropertySet;
+typedef struct CssPendingStyle CssPendingStyle;
+typedef struct CssAncestorFilter CssAncestorFilter;
+typedef struct CssMatchList CssMatchList;
 
 /* Include html.h after we define our opaque types, because it includes
  * structures that contain pointers to them.
@@ -148,13 +151,39 @@ const char *HtmlCssGetNextCommaListItem(const char *z, int n, int *pN);
  * HtmlCssStyleSheetSyntaxErrs() returns the number of syntax errors
  * that occured while parsing the stylesheet or style attribute.
  *
+ * HtmlCssStyleSheetCounters() returns true if the stylesheet uses
+ * CSS counters in any way.
+ *
  * tkhtmlCssStyleSheetFree() frees the memory used to store a stylesheet
  * object internally.
  */
 int HtmlCssParse(Tcl_Obj *, int, Tcl_Obj *, Tcl_Obj *, CssStyleSheet **);
 int HtmlCssStyleSheetSyntaxErrs(CssStyleSheet *);
+int HtmlCssStyleSheetCounters(CssStyleSheet *);
 void HtmlCssStyleSheetFree(CssStyleSheet *);
 
+/*
+ * HtmlCssNodeClassesSet() interns the class names of an element, as
+ * used by the selector matching code, in HtmlElementNode.azClass. 
+ * HtmlCssNodeClassesFree() releases them. 
+ */
+void HtmlCssNodeClassesSet(HtmlElementNode *);
+void HtmlCssNodeClassesFree(HtmlElementNode *);
+
+/*
+ * HtmlCssAttributeDepends() is called before the value of attribute
+ * zAttr of a node is changed from zOld to zNew (either may be NULL). It
+ * returns a mask of the CSS_DEPEND_XXX values below, according to the
+ * positions in which the attribute is used by the document stylesheets.
+ * Zero means the change cannot affect the style of any node.
+ */
+int HtmlCssAttributeDepends(
+    HtmlTree *, HtmlNode *, const char *, const char *, const char *
+);
+#define CSS_DEPEND_SUBJECT  0x01   /* Used in rightmost compound or value */
+#define CSS_DEPEND_ANCESTOR 0x02   /* Used left of a descendant/child */
+#define CSS_DEPEND_SIBLING  0x04   /* Used left of an adjacent combinator */
+
 /* Values to pass as the second argument ("origin") of HtmlCssParse() */
 #define CSS_ORIGIN_AGENT  1
 #define CSS_ORIGIN_USER   2
@@ -163,9 +192,10 @@ void HtmlCssStyleSheetFree(CssStyleSheet *);
 /*
  * Function to apply a stylesheet to a document node.
  */
-void HtmlCssStyleSheetApply(HtmlTree *, HtmlNode *);
+int HtmlCssStyleSheetApply(
+    HtmlTree *, HtmlNode *, CssAncestorFilter *, CssMatchList *);
 void HtmlCssStyleSheetGenerated(HtmlTree *, HtmlElementNode *);
-void HtmlCssStyleGenerateContent(HtmlTree *, HtmlElementNode *, int);
+int HtmlCssStyleGenerateContent(HtmlTree *, HtmlElementNode *, int);
 
 /*
  * Functions to interface with inline style information (in HTML, 
@@ -175,14 +205,61 @@ int  HtmlCssInlineParse(HtmlTree *, int, CONST char *, CssPropertySet **);
 void HtmlCssInlineFree(CssPropertySet *);
 int HtmlCssInlineQuery(Tcl_Interp *, CssPropertySet *, Tcl_Obj *);
 
+/*
+ * An ancestor filter is a Bloom filter holding the tag, id and class names
+ * of each ancestor of the node currently being styled. It is built by
+ * styleApply() in htmlstyle.c, which calls HtmlCssFilterAdd() for each
+ * element before descending into its children. HtmlCssStyleSheetApply()
+ * uses it to skip rules that require an ancestor that cannot be present
+ * without calling HtmlCssSelectorTest().
+ *
+ * Only the aBit[] array need be saved and restored as the tree is walked.
+ * The nTest and nReject counters are statistics for the STYLEENGINE log.
+ */
+#define CSS_FILTER_BITS 1024
+struct CssAncestorFilter {
+    unsigned char aBit[CSS_FILTER_BITS / 8];
+    int nTest;                 /* Number of rules checked against aBit[] */
+    int nReject;               /* Number of rules rejected */
+};
+void HtmlCssFilterAdd(CssAncestorFilter *, HtmlNode *);
+
+/*
+ * A match list stores the results of matching the stylesheet rules against
+ * a sequence of elements ahead of time, so that the matching may be done
+ * by a worker thread (see htmlstyle.c). HtmlCssStyleSheetMatch() appends
+ * a record for a single element to the list. It does not modify any 
+ * structure other than the list itself and the ancestor filter. When 
+ * HtmlCssStyleSheetApply() is passed a match list, and the next record in
+ * the list is for the element being styled, the record is used instead 
+ * of matching the rules again. HtmlCssMatchListSkip() skips the record
+ * for an element that is styled without calling HtmlCssStyleSheetApply().
+ */
+typedef struct CssMatchNode CssMatchNode;
+typedef struct CssMatchEntry CssMatchEntry;
+struct CssMatchList {
+    CssMatchNode *aNode;       /* One record for each element */
+    int nNode;
+    int nNodeAlloc;
+    int iNode;                 /* Index of next record to use */
+    CssMatchEntry *aEntry;     /* Matching rules for all elements */
+    int nEntry;
+    int nEntryAlloc;
+};
+void HtmlCssStyleSheetMatch(
+    HtmlTree *, HtmlNode *, CssAncestorFilter *, CssMatchList *);
+void HtmlCssMatchListSkip(CssMatchList *, HtmlNode *);
+void HtmlCssMatchListClear(CssMatchList *);
+
 /*
   CssProperty *HtmlCssPropertiesGet(CssProperties *, int, int*, int*);
 */
 
 Tcl_ObjCmdProc HtmlCssStyleReport;
+Tcl_ObjCmdProc HtmlCssStyleProfile;
 
 void HtmlCssCheckDynamic(HtmlTree *);
-void HtmlCssFreeDynamics(HtmlElementNode *);
+void HtmlCssFreeDynamics(HtmlTree *, HtmlElementNode *);
 int  HtmlCssTclNodeDynamics(Tcl_Interp *, HtmlNode *);
 
 /* The interface to the csssearch.c module. This module is responsible
@@ -191,6 +268,8 @@ int  HtmlCssTclNodeDynamics(Tcl_Interp *, HtmlNode *);
 int HtmlCssSearchInit(HtmlTree *);
 int HtmlCssSearchShutdown(HtmlTree *);
 int HtmlCssSearchInvalidateCache(HtmlTree *);
+void HtmlCssSearchNodeChanged(HtmlTree *, HtmlNode *);
+void HtmlCssSearchNodeDeleted(HtmlTree *, HtmlNode *);
 Tcl_ObjCmdProc HtmlCssSearch;
 
 #if 0
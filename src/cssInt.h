@@ -43,11 +43,17 @@
 #include <tcl.h>
 
 typedef struct CssSelector CssSelector;
+typedef struct CssMatchOp CssMatchOp;
+typedef struct CssRuleProperty CssRuleProperty;
 typedef struct CssRule CssRule;
 typedef struct CssParse CssParse;
+typedef struct CssImport CssImport;
 typedef struct CssToken CssToken;
 typedef struct CssPriority CssPriority;
 typedef struct CssProperties CssProperties;
+typedef struct CssInternedProperty CssInternedProperty;
+typedef struct CssMedia CssMedia;
+typedef struct CssMediaQuery CssMediaQuery;
 
 typedef unsigned char u8;
 typedef unsigned int u32;
@@ -135,10 +141,42 @@ struct CssSelector {
     char *zAttr;      /* The attribute queried, if any. */
     char *zValue;     /* The value tested for, if any. */
     CssSelector *pNext;  /* Next simple-selector in chain */
+
+    /* Compiled form of the chain. Only set on the first element. */
+    CssMatchOp *aOp;  /* Array of match operations */
+    int nDescendant;  /* Number of descendant combinators in chain */
+};
+
+/*
+ * When a rule is added to a stylesheet, the selector is compiled into an
+ * array of the following structures, in the same order as the linked
+ * list of CssSelector structures and terminated by an entry with 
+ * CssMatchOp.eOp set to 0. HtmlCssSelectorTest() interprets the array
+ * instead of the list. The zAttr and zValue strings are owned by the
+ * corresponding CssSelector.
+ *
+ * For a CSS_SELECTOR_TYPE operation that matches a tag known to the 
+ * tokenizer, eTag is set to the tag type and compared with HtmlNode.eTag
+ * instead of comparing tag names. For a CSS_SELECTOR_CLASS operation,
+ * zAtom is the interned class name, compared by pointer with the entries
+ * of HtmlElementNode.azClass. The operation holds a reference to it.
+ */
+struct CssMatchOp {
+    u8 eOp;               /* Copy of CssSelector.eSelector */
+    u8 eTag;              /* Tag type for CSS_SELECTOR_TYPE, or 0 */
+    int nValue;           /* Length of zValue in bytes */
+    const char *zAttr;    /* The attribute queried, if any */
+    const char *zValue;   /* The value tested for, if any */
+    const char *zAtom;    /* Interned class name for CSS_SELECTOR_CLASS */
 };
 
 /*
 ** A collection of CSS2 properties and values.
+**
+** Each CssPropertySetItem.pProp value is an interned property (see
+** struct CssInternedProperty below). Property values are immutable once
+** they have been added to a property set, as they may be shared with
+** other property sets.
 */
 struct CssPropertySet {
     int n;
@@ -148,11 +186,43 @@ struct CssPropertySet {
     } *a;
 };
 
+/*
+** Identical property values that appear in stylesheets or style
+** attributes (i.e. "0", "none", "bold") are stored once in a per-thread
+** hash table and shared between all property sets that use them. Each
+** interned value is the "prop" member of an instance of the following
+** struct. The string value for string types is stored immediately after
+** the struct, and the array of interned members for CSS_TYPE_LIST values
+** likewise.
+*/
+struct CssInternedProperty {
+    int nRef;                 /* Number of property sets using this value */
+    Tcl_HashEntry *pEntry;    /* Entry in the intern table */
+    CssProperty prop;         /* The property value */
+};
+
 struct CssProperties {
     int nRule;
     CssRule **apRule;
 };
 
+/*
+ * The CssRule.aAncestor[] array contains hashes of up to 
+ * CSS_RULE_MAX_ANCESTOR tag, id and class names that an ancestor of any
+ * node matched by the rule must have. For the selector "div.menu ul > a",
+ * these are "div", ".menu" and "ul". A rule whose hashes are not all
+ * present in the CssAncestorFilter for a node cannot match that node.
+ */
+#define CSS_RULE_MAX_ANCESTOR 4
+
+/*
+ * The CssRule.noShare flag is set for rules that may match one element
+ * but not a sibling with the same tag name and attributes. For example
+ * rules that test the position of the element among its siblings or a 
+ * dynamic pseudo-class, or that use tcl() property values. See 
+ * styleShare() in htmlstyle.c.
+ */
+
 struct CssRule {
     CssPriority *pPriority;  /* Pointer to the priority of source stylesheet */
     int specificity;         /* Specificity of the selector */
@@ -161,9 +231,94 @@ struct CssRule {
     int freePropertySets;          /* True to delete pPropertySet */
     int freeSelector;              /* True to delete pSelector */
     CssPropertySet *pPropertySet;  /* Property values for the rule. */
+    CssMedia *pMedia;              /* @media condition, or NULL */
+    int noShare;                   /* True to disable style-sharing */
+    int nProperty;                 /* Number of entries in aProperty[] */
+    CssRuleProperty *aProperty;    /* Compiled form of pPropertySet */
+    int nAncestor;                 /* Number of entries in aAncestor[] */
+    unsigned int aAncestor[CSS_RULE_MAX_ANCESTOR]; /* Ancestor name hashes */
+
+    /* Statistics collected while HtmlTree.isStyleProfile is set. See
+     * HtmlCssStyleProfile().
+     */
+    int nCandidate;                /* Times considered for an element */
+    int nReject;                   /* Times rejected by the ancestor filter */
+    int nTest;                     /* Times the selector was tested */
+    int nMatch;                    /* Times the selector matched */
+    int nBacktrack;                /* Descendant combinator retries */
+    Tcl_WideInt iTime;             /* Microseconds spent testing selector */
+
     CssRule *pNext;                /* Next rule in this list. */
 };
 
+/*
+ * When a rule is added to a stylesheet, the declarations in its property
+ * set are compiled into an array of the following structures, in the
+ * order in which they are applied. Declarations for properties that 
+ * Tkhtml does not support are omitted. If iOffset is not negative, the
+ * declaration is applied by storing eValue in the byte at that offset of
+ * the HtmlComputedValues structure (see HtmlComputedValuesCompile()).
+ * Otherwise it is applied by passing pProp to HtmlComputedValuesSet().
+ */
+struct CssRuleProperty {
+    int eProp;                /* CSS_PROPERTY_XXX value */
+    int iOffset;              /* Offset of enumerated field, or -1 */
+    int eValue;               /* Enumerated value, if iOffset >= 0 */
+    CssProperty *pProp;       /* Value, owned by CssRule.pPropertySet */
+};
+
+/*
+ * Each record in a CssMatchList (see css.h) is an instance of CssMatchNode.
+ * The CssMatchNode.nEntry entries beginning at CssMatchList.aEntry[iEntry]
+ * are the rules matched against the element, in priority order. Only rules
+ * that match the element, or that may match depending on the state of 
+ * dynamic flags, are stored.
+ */
+struct CssMatchNode {
+    HtmlNode *pNode;          /* Element the rules were matched against */
+    int iEntry;               /* Index of first entry in aEntry[] */
+    int nEntry;               /* Number of entries */
+    int nTest;                /* Number of rules tested (for logging) */
+    int isShareable;          /* Value for HtmlCssStyleSheetApply() to return */
+};
+struct CssMatchEntry {
+    CssRule *pRule;
+    int eMatch;               /* Combination of CSS_MATCH_XXX flags */
+};
+#define CSS_MATCH_STATIC  0x01    /* Selector matches. Apply the properties */
+#define CSS_MATCH_DYNAMIC 0x02    /* Attach a dynamic condition to the node */
+
+/*
+ * Rules that appear inside an @media block are stored along with all 
+ * other rules, but have the CssRule.pMedia pointer set to an instance of
+ * the following structure. A rule is only applied to the document while
+ * the CssMedia.isMatch flag of its media condition is true. The flag is
+ * recalculated by HtmlCssMediaUpdate() whenever the widget viewport size
+ * or -mediatype option changes.
+ *
+ * A media condition is a list of one or more queries (i.e. "screen and
+ * (min-width: 600px)"). It matches if any of its queries match. Each
+ * CssMedia object is owned by the CssStyleSheet.pMedia list of the 
+ * stylesheet the rules were parsed into.
+ */
+struct CssMediaQuery {
+    int isNot;                /* True if the query begins with "not" */
+    int isNever;              /* True if the query can never match */
+    char zType[16];           /* Media type, or "" if none specified */
+    int iMinWidth;            /* Minimum viewport width in pixels, or -1 */
+    int iMaxWidth;            /* Maximum viewport width in pixels, or -1 */
+    int iMinHeight;           /* Minimum viewport height in pixels, or -1 */
+    int iMaxHeight;           /* Maximum viewport height in pixels, or -1 */
+};
+struct CssMedia {
+    CssPriority *pPriority;   /* Priority of the stylesheet it belongs to */
+    int isMatch;              /* True if the condition currently matches */
+    int isChanged;            /* Used by HtmlCssMediaUpdate() */
+    CssMedia *pNext;          /* Next in CssStyleSheet.pMedia list */
+    int nQuery;               /* Size of aQuery[] */
+    CssMediaQuery aQuery[1];  /* Array of queries (allocated to nQuery) */
+};
+
 /*
  * A linked list of the following structures is stored in
  * CssStyleSheet.pPriority.
@@ -215,6 +370,12 @@ struct CssStyleSheet {
     Tcl_HashTable aByTag;      /* Rule lists by tag (string keys) */
     Tcl_HashTable aByClass;    /* Rule lists by class (string keys) */
     Tcl_HashTable aById;       /* Rule lists by id (string keys) */
+    Tcl_HashTable aByAttr;     /* By attribute name or pseudo-class */
+    Tcl_HashTable aDepend;     /* CSS_DEPEND_XXX masks by attr/class/id */
+
+    CssMedia *pMedia;          /* List of @media conditions used by rules */
+
+    int isCounters;            /* True if counters or counter() are used */
 };
 
 /*
@@ -243,6 +404,11 @@ struct CssParse {
      */
     int isIgnore;                   /* True to ignore new elements */
 
+    /* While parsing the body of an @media {} block, this is set to the
+     * media condition. It is attached to each rule created. 
+     */
+    CssMedia *pMedia;               /* Current @media condition, or NULL */
+
     /* In the body of a stylesheet @import directives must be ignored. */
     int isBody;                     /* True once we are in the body */
 
@@ -250,9 +416,40 @@ struct CssParse {
     Tcl_Obj *pStyleId;
     Tcl_Obj *pImportCmd;            /* Script to invoke for @import */
     Tcl_Obj *pUrlCmd;               /* Script to invoke for url() */
-    Tcl_Obj *pErrorLog;             /* In non-zero, store syntax errors here */
+    Tcl_HashTable aUrlCache;        /* Memoized -urlcmd translations */
+    int isUrlCacheInit;             /* True once aUrlCache is initialized */
+
+    /* If isErrorLog is true, the byte offset and length of each syntax
+     * error are appended to the aError[] array. 
+     */
+    int isErrorLog;                 /* True to record syntax errors */
+    int *aError;                    /* Offset and length of each error */
+    int nError;                     /* Number of entries in aError[] */
+
+    int isQuirks;                   /* True to parse in quirks mode */
+    Tcl_HashTable *pFontFamilies;   /* HtmlTree.aFontFamilies */
+
+    /* A detached parse may be run by a thread other than the one that 
+     * owns the widget (see HtmlStyleParseAsync()). In this case pTree 
+     * and interp are NULL. No scripts are invoked, url() values that
+     * must be passed to the -urlcmd script are left untranslated, and 
+     * @import directives are stored in the pImport list.
+     */
+    int isDetached;                 /* True for a detached parse */
+    CssImport *pImport;             /* @import directives, in order */
+
     Tcl_Interp *interp;             /* Interpreter to invoke pImportCmd */
-    HtmlTree *pTree;                /* Tree used to determine if quirks mode */
+    HtmlTree *pTree;                /* Widget the stylesheet is parsed for */
+};
+
+/*
+ * An @import directive encountered by a detached parse. The -importcmd 
+ * script is invoked for each once the parse is finished.
+ */
+struct CssImport {
+    CssProperty *pUrl;              /* URL as returned by tokenToProperty() */
+    CssMedia *pMedia;               /* Media condition, or NULL */
+    CssImport *pNext;               /* Next directive in CssParse.pImport */
 };
 
 /*
@@ -263,12 +460,15 @@ void HtmlCssDeclaration(CssParse *, CssToken *, CssToken *, int);
 void HtmlCssSelector(CssParse *, int, CssToken *, CssToken *);
 void HtmlCssRule(CssParse *, int);
 void HtmlCssSelectorComma(CssParse *pParse);
-void HtmlCssImport(CssParse *pParse, CssToken *);
+void HtmlCssImport(CssParse *pParse, CssToken *, CssMedia *);
+int HtmlCssMedia(CssParse *pParse, CssMedia *);
+int HtmlCssMediaTest(HtmlTree *, CssMedia *);
 
 /* Test if a selector matches a node */
 int HtmlCssSelectorTest(CssSelector *, HtmlNode *, int);
 
-void HtmlCssAddDynamic(HtmlElementNode *, CssSelector *, int);
+void HtmlCssAddDynamic(HtmlTree *, HtmlElementNode *, CssSelector *, int);
+int HtmlCssDynamicUsesSelector(HtmlElementNode *, CssSelector *);
 
 /* Append the string representation of the supplied selector to the object. */
 void HtmlCssSelectorToString(CssSelector *, Tcl_Obj *);
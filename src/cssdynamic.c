@@ -14,21 +14,75 @@ static const char rcsid[] = "$Id: cssdynamic.c,v 1.12 2007/06/10 07:53:03 daniel
  *
  *     A "dynamic selector", according to Tkhtml, is any selector that
  *     includes an :active, :focus, or :hover pseudo class.
+ *
+ *     When a node is styled, each dynamic selector that could match the
+ *     node (if the dynamic flags of the node or it's ancestors and
+ *     siblings were set appropriately) is attached to the node as a
+ *     "dynamic condition" (a CssDynamic structure). Each node with
+ *     one or more conditions is also added to the HtmlTree.aDynamic[]
+ *     index for each HTML_DYNAMIC_XXX flag that the conditions depend on.
+ *
+ *     When the dynamic flags of a node are modified, only conditions that
+ *     depend on one of the modified flags and are attached to nodes in the
+ *     sub-tree rooted at the modified node or at one of it's right-hand 
+ *     siblings are rechecked. If that region of the tree contains fewer
+ *     nodes than the indexes for the modified flags, the region is walked
+ *     directly. Otherwise the indexes are scanned and each entry outside
+ *     the region is skipped.
  */
 
 struct CssDynamic {
     int isSet;                /* True when the condition is set */
+    int mask;                 /* HTML_DYNAMIC_XXX flags used by pSelector */
     CssSelector *pSelector;   /* The selector for this condition */
     CssDynamic *pNext;
 };
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * selectorDynamicMask --
+ *
+ *     Return the mask of HTML_DYNAMIC_XXX flags that the result of 
+ *     testing selector pSelector may depend on.
+ *
+ * Results:
+ *     Mask of HTML_DYNAMIC_XXX flags.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+selectorDynamicMask(pSelector)
+    CssSelector *pSelector;
+{
+    int mask = 0;
+    CssSelector *p;
+    for (p = pSelector; p; p = p->pNext) {
+        switch (p->eSelector) {
+            case CSS_PSEUDOCLASS_HOVER:   mask |= HTML_DYNAMIC_HOVER; break;
+            case CSS_PSEUDOCLASS_FOCUS:   mask |= HTML_DYNAMIC_FOCUS; break;
+            case CSS_PSEUDOCLASS_ACTIVE:  mask |= HTML_DYNAMIC_ACTIVE; break;
+            case CSS_PSEUDOCLASS_LINK:    mask |= HTML_DYNAMIC_LINK; break;
+            case CSS_PSEUDOCLASS_VISITED: mask |= HTML_DYNAMIC_VISITED; break;
+        }
+    }
+    return mask;
+}
+
 void
-HtmlCssAddDynamic(pElem, pSelector, isSet)
+HtmlCssAddDynamic(pTree, pElem, pSelector, isSet)
+    HtmlTree *pTree;
     HtmlElementNode *pElem;
     CssSelector *pSelector;
     int isSet;
 {
     CssDynamic *pNew;
+    int isNew;
+    int ii;
+
     for (pNew = pElem->pDynamic; pNew ; pNew = pNew->pNext) {
         if (pNew->pSelector == pSelector) return;
     }
@@ -36,16 +90,41 @@ HtmlCssAddDynamic(pElem, pSelector, isSet)
 
     pNew = HtmlNew(CssDynamic);
     pNew->isSet = (isSet ? 1 : 0);
+    pNew->mask = selectorDynamicMask(pSelector);
     pNew->pSelector = pSelector;
     pNew->pNext = pElem->pDynamic;
     pElem->pDynamic = pNew;
+
+    /* Add the node to the HtmlTree.aDynamic[] index of each flag used. */
+    for (ii = 0; ii < HTML_DYNAMIC_NINDEX; ii++) {
+        if (pNew->mask & (1 << ii)) {
+            Tcl_CreateHashEntry(&pTree->aDynamic[ii], (char *)pElem, &isNew);
+        }
+    }
 }
 
 void
-HtmlCssFreeDynamics(pElem)
+HtmlCssFreeDynamics(pTree, pElem)
+    HtmlTree *pTree;
     HtmlElementNode *pElem;
 {
-    CssDynamic *p = pElem->pDynamic;
+    CssDynamic *p;
+    int mask = 0;
+    int ii;
+
+    for (p = pElem->pDynamic; p; p = p->pNext) {
+        mask |= p->mask;
+    }
+    for (ii = 0; ii < HTML_DYNAMIC_NINDEX; ii++) {
+        if (mask & (1 << ii)) {
+            Tcl_HashEntry *pEntry;
+            pEntry = Tcl_FindHashEntry(&pTree->aDynamic[ii], (char *)pElem);
+            assert(pEntry);
+            Tcl_DeleteHashEntry(pEntry);
+        }
+    }
+
+    p = pElem->pDynamic;
     while (p) {
         CssDynamic *pTmp = p;
         p = p->pNext;
@@ -54,44 +133,285 @@ HtmlCssFreeDynamics(pElem)
     pElem->pDynamic = 0;
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCssDynamicUsesSelector --
+ *
+ *     Return true if any of the dynamic conditions attached to pElem
+ *     refer to selector pSelector.
+ *
+ * Results:
+ *     Boolean.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+int
+HtmlCssDynamicUsesSelector(pElem, pSelector)
+    HtmlElementNode *pElem;
+    CssSelector *pSelector;
+{
+    CssDynamic *p;
+    for (p = pElem->pDynamic; p; p = p->pNext) {
+        if (p->pSelector == pSelector) return 1;
+    }
+    return 0;
+}
 
-static int 
-checkDynamicCb(pTree, pNode, clientData)
-    HtmlTree *pTree;
+/*
+ *---------------------------------------------------------------------------
+ *
+ * dynamicIsAffected --
+ *
+ *     Return true if node pNode is part of the sub-tree rooted at
+ *     pChanged, or of a sub-tree rooted at one of the right-hand siblings
+ *     of pChanged. These are the nodes for which the result of testing
+ *     a selector may depend on the dynamic flags of pChanged.
+ *
+ *     Argument iChanged must be the index of pChanged in the child list
+ *     of it's parent (if any).
+ *
+ * Results:
+ *     Boolean.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+dynamicIsAffected(pNode, pChanged, iChanged)
     HtmlNode *pNode;
-    ClientData clientData;
+    HtmlNode *pChanged;
+    int iChanged;
 {
-    if (!HtmlNodeIsText(pNode)) {
-        HtmlElementNode *pElem = (HtmlElementNode *)pNode;
-        CssDynamic *p;
-        for (p = pElem->pDynamic; p; p = p->pNext) {
-            int res = HtmlCssSelectorTest(p->pSelector, pNode, 0) ? 1 : 0; 
-            if (res != p->isSet) {
-                HtmlCallbackRestyle(pTree, pNode);
+    HtmlNode *pParent = HtmlNodeParent(pChanged);
+    HtmlNode *p;
+    for (p = pNode; p; p = HtmlNodeParent(p)) {
+        if (p == pChanged) return 1;
+        if (pParent && HtmlNodeParent(p) == pParent) {
+            int nChild = HtmlNodeNumChildren(pParent);
+            int i;
+            for (i = iChanged + 1; i < nChild; i++) {
+                if (HtmlNodeChild(pParent, i) == p) return 1;
             }
-            p->isSet = res;
+            return 0;
         }
     }
-    return HTML_WALK_DESCEND;
+    return 0;
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * dynamicCheckNode --
+ *
+ *     Recheck each dynamic condition attached to pElem that depends on
+ *     one or more of the HTML_DYNAMIC_XXX flags in mask flags. If any
+ *     condition has changed, schedule pElem for restyling.
+ *
+ * Results:
+ *     Number of conditions tested.
+ *
+ * Side effects:
+ *     May call HtmlCallbackRestyleNode().
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+dynamicCheckNode(pTree, pElem, flags)
+    HtmlTree *pTree;
+    HtmlElementNode *pElem;
+    int flags;
+{
+    HtmlNode *pNode = (HtmlNode *)pElem;
+    CssDynamic *p;
+    int nTest = 0;
+
+    for (p = pElem->pDynamic; p; p = p->pNext) {
+        int res;
+        if (!(p->mask & flags)) continue;
+        res = HtmlCssSelectorTest(p->pSelector, pNode, 0) ? 1 : 0;
+        if (res != p->isSet) {
+            HtmlCallbackRestyleNode(pTree, pNode);
+        }
+        p->isSet = res;
+        nTest++;
+    }
+    return nTest;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * dynamicCountNodes --
+ *
+ *     Count the nodes in the sub-tree rooted at pNode. Counting stops
+ *     as soon as the total exceeds nMax.
+ *
+ * Results:
+ *     Number of nodes counted.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+dynamicCountNodes(pNode, nMax)
+    HtmlNode *pNode;
+    int nMax;
+{
+    int nChild = HtmlNodeNumChildren(pNode);
+    int n = 1;
+    int i;
+    for (i = 0; i < nChild && n <= nMax; i++) {
+        n += dynamicCountNodes(HtmlNodeChild(pNode, i), nMax - n);
+    }
+    return n;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * dynamicCheckTree --
+ *
+ *     Call dynamicCheckNode() for each element in the sub-tree rooted at
+ *     pNode that has dynamic conditions attached.
+ *
+ * Results:
+ *     Number of conditions tested.
+ *
+ * Side effects:
+ *     May call HtmlCallbackRestyleNode().
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+dynamicCheckTree(pTree, pNode, flags)
+    HtmlTree *pTree;
+    HtmlNode *pNode;
+    int flags;
+{
+    int nChild = HtmlNodeNumChildren(pNode);
+    int nTest = 0;
+    int i;
+
+    if (!HtmlNodeIsText(pNode) && ((HtmlElementNode *)pNode)->pDynamic) {
+        nTest += dynamicCheckNode(pTree, (HtmlElementNode *)pNode, flags);
+    }
+    for (i = 0; i < nChild; i++) {
+        nTest += dynamicCheckTree(pTree, HtmlNodeChild(pNode, i), flags);
+    }
+    return nTest;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCssCheckDynamic --
+ *
+ *     Recheck the dynamic conditions that may have been affected by
+ *     changes to the dynamic flags of node HtmlCallback.pDynamic and it's
+ *     descendants since this function was last called (see
+ *     HtmlCallbackDynamic()). Each node with a condition that has
+ *     changed is scheduled for restyling.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Clears HtmlCallback.pDynamic and HtmlCallback.dynamicFlags. May
+ *     call HtmlCallbackRestyleNode().
+ *
+ *---------------------------------------------------------------------------
+ */
 void
 HtmlCssCheckDynamic(pTree)
     HtmlTree *pTree;
 {
-    if (pTree->cb.pDynamic) {
-        HtmlNode *pParent = HtmlNodeParent(pTree->cb.pDynamic);
+    HtmlNode *pChanged = pTree->cb.pDynamic;
+    int flags = pTree->cb.dynamicFlags;
+
+    if (pChanged) {
+        HtmlNode *pParent = HtmlNodeParent(pChanged);
+        int iChanged = 0;
+        int nChild = 1;
+        int nIndex = 0;
+        int nRegion = 0;
+        int nTest = 0;
+        int ii;
+
         if (pParent) {
-            int i;
-            int nChild = HtmlNodeNumChildren(pParent);
-            for (i = 0; HtmlNodeChild(pParent, i) != pTree->cb.pDynamic; i++);
-            for ( ; i < nChild; i++) {
-                HtmlWalkTree(pTree,HtmlNodeChild(pParent,i),checkDynamicCb,0);
+            while (HtmlNodeChild(pParent, iChanged) != pChanged) iChanged++;
+            nChild = HtmlNodeNumChildren(pParent);
+        }
+
+        /* Count the index entries for the modified flags. A node that
+         * depends on more than one of them is counted more than once.
+         */
+        for (ii = 0; ii < HTML_DYNAMIC_NINDEX; ii++) {
+            if (flags & (1 << ii)) {
+                nIndex += pTree->aDynamic[ii].numEntries;
+            }
+        }
+
+        /* Count the nodes in the affected region, giving up once there
+         * are more of them than index entries.
+         */
+        for (ii = iChanged; nIndex > 0 && ii < nChild; ii++) {
+            HtmlNode *pNode = pChanged;
+            if (pParent) pNode = HtmlNodeChild(pParent, ii);
+            nRegion += dynamicCountNodes(pNode, nIndex - nRegion);
+            if (nRegion > nIndex) break;
+        }
+
+        if (nIndex > 0 && nRegion <= nIndex) {
+            for (ii = iChanged; ii < nChild; ii++) {
+                HtmlNode *pNode = pChanged;
+                if (pParent) pNode = HtmlNodeChild(pParent, ii);
+                nTest += dynamicCheckTree(pTree, pNode, flags);
+            }
+        } else if (nIndex > 0) {
+            for (ii = 0; ii < HTML_DYNAMIC_NINDEX; ii++) {
+                Tcl_HashEntry *pEntry;
+                Tcl_HashSearch search;
+                Tcl_HashTable *pIndex = &pTree->aDynamic[ii];
+                if (!(flags & (1 << ii))) continue;
+
+                for (
+                    pEntry = Tcl_FirstHashEntry(pIndex, &search);
+                    pEntry;
+                    pEntry = Tcl_NextHashEntry(&search)
+                ) {
+                    HtmlElementNode *pElem;
+                    int jj;
+
+                    pElem = (HtmlElementNode *)Tcl_GetHashKey(pIndex, pEntry);
+
+                    /* Skip nodes already checked via an earlier index. */
+                    for (jj = 0; jj < ii; jj++) {
+                        if ((flags & (1 << jj)) && Tcl_FindHashEntry(
+                            &pTree->aDynamic[jj], (char *)pElem
+                        )) break;
+                    }
+                    if (jj < ii) continue;
+
+                    if (dynamicIsAffected(&pElem->node, pChanged, iChanged)) {
+                        nTest += dynamicCheckNode(pTree, pElem, flags);
+                    }
+                }
             }
-        } else {
-            HtmlWalkTree(pTree, pTree->cb.pDynamic, checkDynamicCb, 0);
         }
+
+        HtmlLog(pTree, "STYLEENGINE", "dynamic check: %d conditions tested",
+            nTest
+        );
         pTree->cb.pDynamic = 0;
+        pTree->cb.dynamicFlags = 0;
     }
 }
 
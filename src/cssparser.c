@@ -386,6 +386,40 @@ static int inputNextTokenIgnoreSpace(pInput)
 }
 
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * parseErrorLog --
+ *
+ *     Record a syntax error at byte offset iStart of the input, nLength
+ *     bytes in size, if the CssParse.isErrorLog flag is set. The Tcl 
+ *     list stored in the -errorvar variable is built from the CssParse.aError
+ *     array once the parse is finished, as the parse may be run by a
+ *     thread other than the one that owns the interpreter.
+ *
+ * Results: 
+ *     None.
+ *
+ * Side effects:
+ *     May reallocate pParse->aError.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void parseErrorLog(pParse, iStart, nLength)
+    CssParse *pParse;
+    int iStart;
+    int nLength;
+{
+    if (pParse->isErrorLog) {
+        int nByte = (pParse->nError + 2) * sizeof(int);
+        pParse->aError = (int *)HtmlRealloc(
+            "CssParse.aError", (char *)pParse->aError, nByte
+        );
+        pParse->aError[pParse->nError++] = iStart;
+        pParse->aError[pParse->nError++] = nLength;
+    }
+}
+
 /*
  *---------------------------------------------------------------------------
  *
@@ -442,11 +476,7 @@ static void parseSyntaxError(pInput, pParse, isStopAtSemiColon)
     }
     iErrorLength = pInput->iInput - iErrorStart;
 
-    if (pParse->pErrorLog) {
-        Tcl_Obj *pError = pParse->pErrorLog;
-        Tcl_ListObjAppendElement(0, pError, Tcl_NewIntObj(iErrorStart));
-        Tcl_ListObjAppendElement(0, pError, Tcl_NewIntObj(iErrorLength));
-    }
+    parseErrorLog(pParse, iErrorStart, iErrorLength);
 }
 
 /*
@@ -494,11 +524,7 @@ static int parseDeclarationError(pInput, pParse)
     iErrorLength = pInput->iInput - iErrorStart;
     inputNextToken(pInput);
 
-    if (pParse->pErrorLog) {
-        Tcl_Obj *pError = pParse->pErrorLog;
-        Tcl_ListObjAppendElement(0, pError, Tcl_NewIntObj(iErrorStart));
-        Tcl_ListObjAppendElement(0, pError, Tcl_NewIntObj(iErrorLength));
-    }
+    parseErrorLog(pParse, iErrorStart, iErrorLength);
 
     return ((eToken == CT_SEMICOLON) ? 0: 1);
 }
@@ -828,42 +854,204 @@ static int parseDeclarationBlock(CssInput *pInput, CssParse *pParse){
 /*
  *---------------------------------------------------------------------------
  *
- * parseMediaList --
+ * parseMediaLength --
  *
- *     Tkhtml3 uses rules suitable for the following media:
+ *     Parse the value of a media feature expression. Only lengths in 
+ *     pixels (or a unitless 0) are supported.
  *
  * Results:
+ *     The length in pixels, or -1 if the value is not understood.
  *
  * Side effects:
+ *     None.
  *
  *---------------------------------------------------------------------------
  */
-static int parseMediaList(pInput, pIsMatch)
+static int parseMediaLength(z, n)
+    const char *z;
+    int n;
+{
+    int iVal = 0;
+    int i;
+    for (i = 0; i < n && isdigit((u8)z[i]); i++) {
+        iVal = iVal * 10 + (z[i] - '0');
+    }
+    if (i == 0) return -1;
+    if (i == n && iVal == 0) return 0;
+    if (n - i == 2 && strnicmp(&z[i], "px", 2) == 0) return iVal;
+    return -1;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * parseMediaQuery --
+ *
+ *     Parse a single media query of the form:
+ *
+ *         ?only|not? MEDIA-TYPE ?and (FEATURE: VALUE)...?
+ *         (FEATURE: VALUE) ?and (FEATURE: VALUE)...?
+ *
+ *     The supported features are width, height and their min- and max-
+ *     variants. A query that uses any other feature, or a value that is
+ *     not understood, never matches.
+ *
+ *     When this function is called the current input token should be the
+ *     first token of the query. When it returns, the current token is the
+ *     first token following the query.
+ *
+ * Results:
+ *     Non-zero if a syntax error is encountered, otherwise zero.
+ *
+ * Side effects:
+ *     Populates *pQuery.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int parseMediaQuery(pInput, pQuery)
     CssInput *pInput;
-    int *pIsMatch;
+    CssMediaQuery *pQuery;
 {
-    int media_ok = 0;
+    CssTokenType eToken;
+    const char *zToken;
+    int nToken;
+    int isAnd = 0;
+
+    memset(pQuery, 0, sizeof(CssMediaQuery));
+    pQuery->iMinWidth = -1;
+    pQuery->iMaxWidth = -1;
+    pQuery->iMinHeight = -1;
+    pQuery->iMaxHeight = -1;
+
+    eToken = inputGetToken(pInput, &zToken, &nToken);
+    if (eToken == CT_IDENT && nToken == 4 && !strnicmp("only", zToken, 4)) {
+        inputNextTokenIgnoreSpace(pInput);
+    } else if (eToken == CT_IDENT && nToken==3 && !strnicmp("not",zToken,3)) {
+        pQuery->isNot = 1;
+        inputNextTokenIgnoreSpace(pInput);
+    }
+
+    eToken = inputGetToken(pInput, &zToken, &nToken);
+    if (eToken == CT_IDENT) {
+        if (nToken < sizeof(pQuery->zType)) {
+            memcpy(pQuery->zType, zToken, nToken);
+            pQuery->zType[nToken] = '\0';
+        } else {
+            pQuery->isNever = 1;
+        }
+        inputNextTokenIgnoreSpace(pInput);
+        isAnd = 1;
+    } else if (eToken != CT_LRP || pQuery->isNot) {
+        return 1;
+    }
 
     while (1) {
-        CssTokenType eToken;
-        char * zToken;
-        int nToken;
-        eToken = inputGetToken(pInput, &zToken, &nToken);
+        const char *zFeature;
+        int nFeature;
+        int iVal = -1;
+        int *piMin;
+        int *piMax;
 
-        if (eToken != CT_IDENT) return 1;
-        if ((nToken == 3 && strnicmp("all", zToken, nToken) == 0) ||
-            (nToken == 6 && strnicmp("screen", zToken, nToken) == 0)
-        ) {
-           media_ok = 1;
+        eToken = inputGetToken(pInput, &zToken, &nToken);
+        if (isAnd) {
+            if (eToken != CT_IDENT || nToken!=3 || strnicmp("and", zToken, 3)) {
+                break;
+            }
+            inputNextTokenIgnoreSpace(pInput);
+            eToken = inputGetToken(pInput, 0, 0);
         }
+        isAnd = 1;
 
+        /* Parse "(FEATURE)" or "(FEATURE: VALUE)". */
+        if (eToken != CT_LRP) return 1;
+        inputNextTokenIgnoreSpace(pInput);
+        if (CT_IDENT != inputGetToken(pInput, &zFeature, &nFeature)) return 1;
+        inputNextTokenIgnoreSpace(pInput);
+        if (CT_COLON == inputGetToken(pInput, 0, 0)) {
+            inputNextTokenIgnoreSpace(pInput);
+            if (CT_IDENT != inputGetToken(pInput, &zToken, &nToken)) return 1;
+            iVal = parseMediaLength(zToken, nToken);
+            inputNextTokenIgnoreSpace(pInput);
+        }
+        if (CT_RRP != inputGetToken(pInput, 0, 0)) return 1;
         inputNextTokenIgnoreSpace(pInput);
-        if (CT_COMMA != inputGetToken(pInput, 0, 0)) break;
 
+        if (iVal < 0) {
+            pQuery->isNever = 1;
+        }
+        #define FEATURE(z) \
+            (nFeature == strlen(z) && !strnicmp(z, zFeature, nFeature))
+        piMin = 0;
+        piMax = 0;
+        if (FEATURE("width") || FEATURE("min-width")) {
+            piMin = &pQuery->iMinWidth;
+        }
+        if (FEATURE("width") || FEATURE("max-width")) {
+            piMax = &pQuery->iMaxWidth;
+        }
+        if (FEATURE("height") || FEATURE("min-height")) {
+            piMin = &pQuery->iMinHeight;
+        }
+        if (FEATURE("height") || FEATURE("max-height")) {
+            piMax = &pQuery->iMaxHeight;
+        }
+        #undef FEATURE
+
+        if (piMin) *piMin = MAX(*piMin, iVal);
+        if (piMax) *piMax = (*piMax < 0) ? iVal : MIN(*piMax, iVal);
+        if (!piMin && !piMax) {
+            pQuery->isNever = 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * parseMediaList --
+ *
+ *     Parse a comma separated list of media queries (see parseMediaQuery())
+ *     into a new CssMedia structure, allocated with HtmlAlloc(). Media
+ *     lists are used by @media blocks and @import directives.
+ *
+ * Results:
+ *     Non-zero if a syntax error is encountered, otherwise zero. If 
+ *     successful, *ppMedia is set to point at the new CssMedia structure.
+ *     It is the responsibility of the caller to free it.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int parseMediaList(pInput, ppMedia)
+    CssInput *pInput;
+    CssMedia **ppMedia;
+{
+    CssMedia *pMedia = 0;
+    int nQuery = 0;
+
+    while (1) {
+        int nByte = sizeof(CssMedia) + nQuery * sizeof(CssMediaQuery);
+        pMedia = (CssMedia *)HtmlRealloc("CssMedia", (char *)pMedia, nByte);
+        if (parseMediaQuery(pInput, &pMedia->aQuery[nQuery])) {
+            HtmlFree(pMedia);
+            return 1;
+        }
+        nQuery++;
+
+        if (CT_COMMA != inputGetToken(pInput, 0, 0)) break;
         inputNextTokenIgnoreSpace(pInput);
     }
 
-    *pIsMatch = media_ok;
+    pMedia->pPriority = 0;
+    pMedia->isMatch = 0;
+    pMedia->isChanged = 0;
+    pMedia->pNext = 0;
+    pMedia->nQuery = nQuery;
+    *ppMedia = pMedia;
     return 0;
 }
 
@@ -889,7 +1077,7 @@ static int parseAtRule(CssInput *pInput, CssParse *pParse){
     if (nWord == 6 && strnicmp("import", zWord, nWord) == 0) {
         CssTokenType eToken;
         CssToken tToken;
-        int media_ok = 1;
+        CssMedia *pMedia = 0;
 
 	/* If we are already into the stylesheet "body", this is a 
          * syntax error 
@@ -907,29 +1095,46 @@ static int parseAtRule(CssInput *pInput, CssParse *pParse){
         inputNextTokenIgnoreSpace(pInput);
         eToken = inputGetToken(pInput, 0, 0);
         if (eToken != CT_SEMICOLON && eToken != CT_EOF) {
-            if (parseMediaList(pInput, &media_ok)) return 1;
+            /* Imported stylesheets are loaded by the -importcmd script,
+             * so the media list is tested by HtmlCssImport() before
+             * the script is invoked.
+             */
+            if (parseMediaList(pInput, &pMedia)) return 1;
         }
   
         eToken = inputGetToken(pInput, 0, 0);
-        if (eToken != CT_SEMICOLON && eToken != CT_EOF) return 1;
-  
-        if (media_ok) {
-            HtmlCssImport(pParse, &tToken);
+        if (eToken != CT_SEMICOLON && eToken != CT_EOF) {
+            HtmlFree(pMedia);
+            return 1;
         }
+  
+        /* HtmlCssImport() takes ownership of pMedia. */
+        HtmlCssImport(pParse, &tToken, pMedia);
     }
   
     else if (nWord == 5 && strnicmp("media", zWord, nWord) == 0) {
-        int media_ok;
+        CssMedia *pMedia;
         pParse->isBody = 1;
         inputNextTokenIgnoreSpace(pInput);
-        if (parseMediaList(pInput, &media_ok)) return 1;
-        if (CT_LP != inputGetToken(pInput, 0, 0)) return 1;
-        inputNextToken(pInput);
-        if (!media_ok) {
+        if (parseMediaList(pInput, &pMedia)) return 1;
+        if (CT_LP != inputGetToken(pInput, 0, 0)) {
+            HtmlFree(pMedia);
+            return 1;
+        }
+
+        /* HtmlCssMedia() takes ownership of pMedia. It returns false only 
+         * if the media condition cannot be stored with the rules (because
+         * this is not a stylesheet parse), and it does not match.
+         *
+         * Otherwise, leave the "{" as the current token. The caller 
+         * advances past it to the first token of the block body.
+         */
+        if (!HtmlCssMedia(pParse, pMedia)) {
             /* The media does not match. Skip tokens until the end of
              * the block.
              */
             int iNest = 1;
+            inputNextToken(pInput);
             while (
                 (inputGetToken(pInput, 0, 0) != CT_EOF) &&
                 (inputGetToken(pInput, 0, 0) != CT_RP || iNest != 1)
@@ -1003,7 +1208,9 @@ void HtmlCssRunParser(zInput, nInput, pParse)
         if (eToken == CT_SGML_OPEN || eToken == CT_SGML_CLOSE) {
             isSyntaxError = 0;
         } else if (eToken == CT_RP) {
+            /* End of an @media block */
             isSyntaxError = 0;
+            pParse->pMedia = 0;
         } else if (eToken == CT_AT) {
             isSyntaxError = parseAtRule(&sInput, pParse);
         } else {
@@ -21,16 +21,32 @@ static const char rcsid[] = "$Id: csssearch.c,v 1.7 2007/10/27 08:37:50 hkoba Ex
  *
  *         HtmlCssSearchInvalidateCache()
  *
+ *     Update the contents of the cache incrementally:
+ *
+ *         HtmlCssSearchNodeChanged()
+ *         HtmlCssSearchNodeDeleted()
+ *
  */
 
 #define SEARCH_MODE_ALL     1
 #define SEARCH_MODE_INDEX   2
 #define SEARCH_MODE_LENGTH  3
 
+/* Maximum number of changed regions recorded by HtmlCssSearchNodeChanged()
+ * before the whole cache is discarded instead.
+ */
+#define SEARCH_MAX_CHANGED 32
+
+/*
+ * The results of a search are stored in the apNode[] array, sorted in
+ * document order (by HtmlNode.iNode, see HtmlSequenceNodes()). The parsed
+ * selector is kept so that changed nodes can be tested against it.
+ */
 struct CssCachedSearch {
     int nAlloc;
     int nNode;
     HtmlNode **apNode;
+    CssStyleSheet *pStyle;     /* Parsed selector (pStyle->pUniversalRules) */
 };
 typedef struct CssCachedSearch CssCachedSearch;
 
@@ -40,12 +56,22 @@ struct HtmlSearchCache {
      * called. 
      */
     Tcl_HashTable aCache;
+
+    /* Nodes passed to HtmlCssSearchNodeChanged() since the cached results
+     * were last brought up to date. Each identifies a region of the
+     * document: the node, its descendants, its right-siblings and their
+     * descendants. These are the only nodes for which the result of 
+     * testing a selector may have changed. 
+     */
+    HtmlNode *apChanged[SEARCH_MAX_CHANGED];
+    int nChanged;
 };
 
 struct CssSearch {
   CssRule *pRuleList;        /* The list of CSS selectors */
   HtmlTree *pTree;
   HtmlNode *pSearchRoot;     /* Root of sub-tree to search */
+  int nLimit;                /* Stop after this many matches (0 = no limit) */
   CssCachedSearch *pCache;   /* Output */
 };
 typedef struct CssSearch CssSearch;
@@ -76,11 +102,139 @@ cssSearchCb(pTree, pNode, clientData)
             }
             pCache->apNode[pCache->nNode] = pNode;
             pCache->nNode++;
+            if (pCache->nNode == pSearch->nLimit) {
+                return HTML_WALK_ABANDON;
+            }
         }
     }
     return HTML_WALK_DESCEND;
 }
 
+/*
+ * Comparison function for qsort(). Sort nodes in document order.
+ */
+static int
+searchCompare(pLeft, pRight)
+    const void *pLeft;
+    const void *pRight;
+{
+    HtmlNode *p1 = *(HtmlNode **)pLeft;
+    HtmlNode *p2 = *(HtmlNode **)pRight;
+    return p1->iNode - p2->iNode;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * searchByIndex --
+ *
+ *     If the rightmost compound selector of each selector in the list
+ *     includes an id or class simple-selector, the candidate elements are
+ *     found using the HtmlTree.aIdIndex and HtmlTree.aClassIndex indexes
+ *     and tested in document order, instead of testing every node in the
+ *     tree. The time taken is then proportional to the number of 
+ *     candidates, not the size of the document.
+ *
+ * Results:
+ *     Non-zero if the search was done, or zero if the indexes cannot be
+ *     used for this search.
+ *
+ * Side effects:
+ *     Appends matching nodes to pSearch->pCache.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+searchByIndex(pSearch)
+    CssSearch *pSearch;
+{
+    HtmlTree *pTree = pSearch->pTree;
+    HtmlNode *pRoot = pSearch->pSearchRoot;
+    HtmlNode **apNode = 0;
+    int nNode = 0;
+    int nAlloc = 0;
+    CssRule *pRule;
+    int ii;
+
+    /* Nodes in orphan trees have no valid HtmlNode.iNode value. */
+    if (pRoot) {
+        HtmlNode *pA;
+        for (pA = pRoot; HtmlNodeParent(pA); pA = HtmlNodeParent(pA));
+        if (pA != pTree->pRoot) return 0;
+    }
+
+    for (pRule = pSearch->pRuleList; pRule; pRule = pRule->pNext) {
+        CssSelector *pKey = 0;
+        CssSelector *pS;
+        Tcl_HashTable *pSet;
+        Tcl_HashSearch sHash;
+        Tcl_HashEntry *pEntry;
+
+        for (pS = pRule->pSelector; pS; pS = pS->pNext) {
+            if (
+                pS->eSelector == CSS_SELECTORCHAIN_DESCENDANT ||
+                pS->eSelector == CSS_SELECTORCHAIN_CHILD ||
+                pS->eSelector == CSS_SELECTORCHAIN_ADJACENT
+            ) {
+                break;
+            }
+            if (pS->eSelector == CSS_SELECTOR_ID) {
+                pKey = pS;
+                break;
+            }
+            if (pS->eSelector == CSS_SELECTOR_CLASS && !pKey) {
+                pKey = pS;
+            }
+        }
+        if (!pKey) {
+            HtmlFree(apNode);
+            return 0;
+        }
+
+        pSet = HtmlNodeIndexLookup(
+            pTree, (pKey->eSelector == CSS_SELECTOR_CLASS), pKey->zValue
+        );
+        if (!pSet) continue;
+        for (
+            pEntry = Tcl_FirstHashEntry(pSet, &sHash); 
+            pEntry; 
+            pEntry = Tcl_NextHashEntry(&sHash)
+        ) {
+            HtmlNode *pNode = (HtmlNode *)Tcl_GetHashKey(pSet, pEntry);
+            HtmlNode *pA;
+
+            /* Skip nodes not in the tree, or not descended from pRoot */
+            for (pA = HtmlNodeParent(pNode); pA; pA = HtmlNodeParent(pA)) {
+                if (pA == pRoot) break;
+                if (pA == pTree->pRoot && !pRoot) break;
+            }
+            if (!pA && (pRoot || pNode != pTree->pRoot)) continue;
+
+            if (nNode == nAlloc) {
+                nAlloc = nAlloc * 2 + 16;
+                apNode = (HtmlNode **)HtmlRealloc("temp", 
+                    apNode, nAlloc * sizeof(HtmlNode *)
+                );
+            }
+            apNode[nNode++] = pNode;
+        }
+    }
+
+    HtmlSequenceNodes(pTree);
+    if (nNode > 1) {
+        qsort(apNode, nNode, sizeof(HtmlNode *), searchCompare);
+    }
+    for (ii = 0; ii < nNode; ii++) {
+        if (ii == 0 || apNode[ii] != apNode[ii - 1]) {
+            int rc = cssSearchCb(pTree, apNode[ii], (ClientData)pSearch);
+            if (rc == HTML_WALK_ABANDON) break;
+        }
+    }
+
+    HtmlFree(apNode);
+    return 1;
+}
+
 int 
 HtmlCssSearchInit(pTree)
     HtmlTree *pTree;
@@ -101,15 +255,266 @@ HtmlCssSearchInvalidateCache(pTree)
     while ((pEntry = Tcl_FirstHashEntry(p, &sSearch))) {
         CssCachedSearch *pCache = (CssCachedSearch *)Tcl_GetHashValue(pEntry);
 	if (pCache) {
+	  HtmlCssStyleSheetFree(pCache->pStyle);
 	  HtmlFree(pCache->apNode);
 	  HtmlFree(pCache);
 	}
         Tcl_DeleteHashEntry(pEntry);
     }
+    pTree->pSearchCache->nChanged = 0;
  
     return TCL_OK;
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * searchIsAttached --
+ *
+ *     Return true if pNode is part of the tree rooted at HtmlTree.pRoot.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+searchIsAttached(pTree, pNode)
+    HtmlTree *pTree;
+    HtmlNode *pNode;
+{
+    HtmlNode *p;
+    for (p = pNode; HtmlNodeParent(p); p = HtmlNodeParent(p));
+    return (p == pTree->pRoot);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * searchInRegion --
+ *
+ *     Return true if pNode is pRegion, a right-sibling of pRegion, or a 
+ *     descendant of either. Both nodes must be part of the document tree,
+ *     and the HtmlNode.iNode values must be up to date.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+searchInRegion(pNode, pRegion)
+    HtmlNode *pNode;
+    HtmlNode *pRegion;
+{
+    HtmlNode *pParent = HtmlNodeParent(pRegion);
+    HtmlNode *p;
+    for (p = pNode; p; p = HtmlNodeParent(p)) {
+        if (p == pRegion) return 1;
+        if (pParent && HtmlNodeParent(p) == pParent) {
+            return (p->iNode >= pRegion->iNode);
+        }
+    }
+    return 0;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * searchUpdate --
+ *
+ *     Bring the contents of the cache up to date after the nodes recorded
+ *     by HtmlCssSearchNodeChanged() have changed. For each cached search,
+ *     nodes that are no longer in the tree or that are part of a changed 
+ *     region are removed from the results, then the nodes in each changed
+ *     region are tested against the selector.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Modifies the cached search results.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+searchUpdate(pTree)
+    HtmlTree *pTree;
+{
+    HtmlSearchCache *p = pTree->pSearchCache;
+    Tcl_HashSearch sHash;
+    Tcl_HashEntry *pEntry;
+    int nRegion = 0;
+    int ii;
+    int jj;
+
+    HtmlSequenceNodes(pTree);
+
+    /* Drop changed nodes that are not part of the tree, or that are 
+     * part of another region.
+     */
+    for (ii = 0; ii < p->nChanged; ii++) {
+        HtmlNode *pNode = p->apChanged[ii];
+        if (searchIsAttached(pTree, pNode)) {
+            p->apChanged[nRegion++] = pNode;
+        }
+    }
+    p->nChanged = nRegion;
+    nRegion = 0;
+    for (ii = 0; ii < p->nChanged; ii++) {
+        for (jj = 0; jj < p->nChanged; jj++) {
+            if (jj != ii && searchInRegion(p->apChanged[ii], p->apChanged[jj])){
+                break;
+            }
+        }
+        if (jj == p->nChanged) {
+            p->apChanged[nRegion++] = p->apChanged[ii];
+        }
+    }
+    p->nChanged = 0;
+
+    for (
+        pEntry = Tcl_FirstHashEntry(&p->aCache, &sHash); 
+        pEntry; 
+        pEntry = Tcl_NextHashEntry(&sHash)
+    ) {
+        CssCachedSearch *pCache = (CssCachedSearch *)Tcl_GetHashValue(pEntry);
+        CssSearch sSearch;
+        int nKeep = 0;
+
+        for (ii = 0; ii < pCache->nNode; ii++) {
+            HtmlNode *pNode = pCache->apNode[ii];
+            if (!searchIsAttached(pTree, pNode)) continue;
+            for (jj = 0; jj < nRegion; jj++) {
+                if (searchInRegion(pNode, p->apChanged[jj])) break;
+            }
+            if (jj == nRegion) {
+                pCache->apNode[nKeep++] = pNode;
+            }
+        }
+        pCache->nNode = nKeep;
+
+        sSearch.pRuleList = pCache->pStyle->pUniversalRules;
+        sSearch.pTree = pTree;
+        sSearch.pSearchRoot = 0;
+        sSearch.nLimit = 0;
+        sSearch.pCache = pCache;
+        for (jj = 0; jj < nRegion; jj++) {
+            HtmlNode *pParent = HtmlNodeParent(p->apChanged[jj]);
+            int kk = HtmlNodeIndexOfChild(pParent, p->apChanged[jj]);
+            for ( ; kk < HtmlNodeNumChildren(pParent); kk++) {
+                HtmlNode *pSibling = HtmlNodeChild(pParent, kk);
+                HtmlWalkTree(pTree, pSibling, cssSearchCb, (ClientData)&sSearch);
+            }
+        }
+        if (pCache->nNode > nKeep) {
+            qsort(pCache->apNode, pCache->nNode, sizeof(HtmlNode *), 
+                searchCompare
+            );
+        }
+    }
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCssSearchNodeChanged --
+ *
+ *     This is called when node pNode is inserted into the document, or
+ *     when the attributes or dynamic flags of pNode change. Since a 
+ *     selector may depend on the ancestors and left-siblings of a node, 
+ *     the cached results are updated for the region consisting of pNode,
+ *     its right-siblings and their descendants before they are next used.
+ *
+ *     If pNode is a text node, the region starts at the next element.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Records pNode, or discards the cached results.
+ *
+ *---------------------------------------------------------------------------
+ */
+void
+HtmlCssSearchNodeChanged(pTree, pNode)
+    HtmlTree *pTree;
+    HtmlNode *pNode;
+{
+    HtmlSearchCache *p = pTree->pSearchCache;
+    int ii;
+
+    if (p->aCache.numEntries == 0) return;
+
+    while (pNode && HtmlNodeIsText(pNode)) {
+        pNode = HtmlNodeRightSibling(pNode);
+    }
+    if (!pNode || pNode->iNode == HTML_NODE_GENERATED) return;
+
+    /* If the region is the whole document, or too many regions have been
+     * recorded, it is faster to search again when required.
+     */
+    if (pNode == pTree->pRoot || p->nChanged == SEARCH_MAX_CHANGED) {
+        HtmlCssSearchInvalidateCache(pTree);
+        return;
+    }
+
+    for (ii = 0; ii < p->nChanged; ii++) {
+        if (p->apChanged[ii] == pNode) return;
+    }
+    p->apChanged[p->nChanged++] = pNode;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCssSearchNodeDeleted --
+ *
+ *     This is called before the sub-tree rooted at pNode is deleted. All
+ *     references to nodes in the sub-tree are removed from the cache.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Modifies the cached search results.
+ *
+ *---------------------------------------------------------------------------
+ */
+void
+HtmlCssSearchNodeDeleted(pTree, pNode)
+    HtmlTree *pTree;
+    HtmlNode *pNode;
+{
+    HtmlSearchCache *p = pTree->pSearchCache;
+    Tcl_HashSearch sHash;
+    Tcl_HashEntry *pEntry;
+    HtmlNode *pA;
+    int nKeep;
+    int ii;
+
+    for (
+        pEntry = Tcl_FirstHashEntry(&p->aCache, &sHash); 
+        pEntry; 
+        pEntry = Tcl_NextHashEntry(&sHash)
+    ) {
+        CssCachedSearch *pCache = (CssCachedSearch *)Tcl_GetHashValue(pEntry);
+        nKeep = 0;
+        for (ii = 0; ii < pCache->nNode; ii++) {
+            for (pA = pCache->apNode[ii]; pA && pA != pNode; ) {
+                pA = HtmlNodeParent(pA);
+            }
+            if (!pA) {
+                pCache->apNode[nKeep++] = pCache->apNode[ii];
+            }
+        }
+        pCache->nNode = nKeep;
+    }
+
+    nKeep = 0;
+    for (ii = 0; ii < p->nChanged; ii++) {
+        for (pA = p->apChanged[ii]; pA && pA != pNode; pA = HtmlNodeParent(pA));
+        if (!pA) {
+            p->apChanged[nKeep++] = p->apChanged[ii];
+        }
+    }
+    p->nChanged = nKeep;
+}
+
 int 
 HtmlCssSearchShutdown(pTree)
     HtmlTree *pTree;
@@ -133,6 +538,7 @@ HtmlCssSearchShutdown(pTree)
  *         -root NODE              (Search the sub-tree at NODE)
  *         -index IDX              (return the idx'th list entry only)
  *         -length                 (return the length of the result only)
+ *         -limit N                (return the first N matches only)
  *
  *     With no options, this command is used by the application to 
  *     query the widget for a list of node-handles that match the 
@@ -140,6 +546,12 @@ HtmlCssSearchShutdown(pTree)
  *
  *     The -index and -length options are mutually exclusive.
  *
+ *     Only searches of the whole document are cached. Others stop
+ *     walking the tree as soon as the result is known (for example after
+ *     the first match when "-limit 1" or "-index 0" is specified). A
+ *     search with the -limit option is only cached if the full result
+ *     is already in the cache.
+ *
  * Results:
  *     None.
  *
@@ -163,12 +575,14 @@ HtmlCssSearch(clientData, interp, objc, objv)
     HtmlNode *pSearchRoot = 0;
     int eMode = SEARCH_MODE_ALL;
     int iIndex = 0;
+    int nLimit = 0;
 
     int iArg;
 
     Tcl_HashEntry *pEntry = 0;
     CssCachedSearch *pCache = 0;
     int isNew;
+    int nNode;
 
     /* Options passed to this command. */
     struct HtmlCssOption {
@@ -179,6 +593,7 @@ HtmlCssSearch(clientData, interp, objc, objv)
         {"-root",   0, 0}, 
         {"-length", 1, 0}, 
         {"-index",  0, 0}, 
+        {"-limit",  0, 0}, 
         {0, 0, 0}
     };
 
@@ -226,10 +641,25 @@ HtmlCssSearch(clientData, interp, objc, objv)
             return TCL_ERROR;
         }
     }
+    if (aOption[3].pArg) {      /* Handle -limit option */
+        if (Tcl_GetIntFromObj(interp, aOption[3].pArg, &nLimit)) {
+            return TCL_ERROR;
+        }
+        if (nLimit <= 0) {
+            Tcl_SetObjResult(interp, 
+                eMode == SEARCH_MODE_LENGTH ? Tcl_NewIntObj(0) : Tcl_NewObj()
+            );
+            return TCL_OK;
+        }
+    }
 
     zOrig = Tcl_GetStringFromObj(objv[2], &n);
     if (pSearchRoot) {
         isNew = 1;
+    } else if (nLimit) {
+        Tcl_HashTable *pCacheTable = &pTree->pSearchCache->aCache;
+        pEntry = Tcl_FindHashEntry(pCacheTable, zOrig);
+        isNew = (pEntry ? 0 : 1);
     } else {
         pEntry = Tcl_CreateHashEntry(&pTree->pSearchCache->aCache, zOrig, &isNew);
     }
@@ -242,31 +672,58 @@ HtmlCssSearch(clientData, interp, objc, objv)
         z = (char *)HtmlAlloc("temp", n);
         sprintf(z, "%s {width:0}", zOrig);
         HtmlCssSelectorParse(pTree, n, z, &pStyle);
+        HtmlFree(z);
         if ( !pStyle || !pStyle->pUniversalRules) {
             Tcl_AppendResult(interp, "Bad css selector: \"", zOrig, "\"", NULL); 
+            if (pEntry) {
+                Tcl_DeleteHashEntry(pEntry);
+            }
+            HtmlCssStyleSheetFree(pStyle);
             return TCL_ERROR;
         }
         sSearch.pRuleList = pStyle->pUniversalRules;
         sSearch.pTree = pTree;
         sSearch.pSearchRoot = pSearchRoot;
+        sSearch.nLimit = 0;
         sSearch.pCache = HtmlNew(CssCachedSearch);
-        HtmlWalkTree(pTree, pSearchRoot, cssSearchCb, (ClientData)&sSearch);
+
+        /* If the results are not to be cached, stop searching once the
+         * requested nodes have been found.
+         */
+        if (!pEntry) {
+            sSearch.nLimit = nLimit;
+            if (eMode == SEARCH_MODE_INDEX && iIndex >= 0 && (
+                nLimit == 0 || iIndex < nLimit
+            )) {
+                sSearch.nLimit = iIndex + 1;
+            }
+        }
+        if (!searchByIndex(&sSearch)) {
+            HtmlWalkTree(pTree, pSearchRoot, cssSearchCb, (ClientData)&sSearch);
+        }
         pCache = sSearch.pCache;
-        HtmlCssStyleSheetFree(pStyle);
-        HtmlFree(z);
+        pCache->pStyle = pStyle;
 
         if (pEntry) {
             Tcl_SetHashValue(pEntry, sSearch.pCache);
         }
     } else {
+        if (pTree->pSearchCache->nChanged > 0) {
+            searchUpdate(pTree);
+        }
         pCache = (CssCachedSearch *)Tcl_GetHashValue(pEntry);
     }
 
+    nNode = pCache->nNode;
+    if (nLimit && nLimit < nNode) {
+        nNode = nLimit;
+    }
+
     switch (eMode) {
         case SEARCH_MODE_ALL: {
             Tcl_Obj *pRet = Tcl_NewObj();
             int ii;
-            for(ii = 0; ii < pCache->nNode; ii++){
+            for(ii = 0; ii < nNode; ii++){
                 Tcl_Obj *pCmd = HtmlNodeCommand(pTree, pCache->apNode[ii]);
                 Tcl_ListObjAppendElement(interp, pRet, pCmd);
             }
@@ -275,11 +732,11 @@ HtmlCssSearch(clientData, interp, objc, objv)
         }
 
         case SEARCH_MODE_LENGTH:
-            Tcl_SetObjResult(interp, Tcl_NewIntObj(pCache->nNode));
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(nNode));
             break;
 
         case SEARCH_MODE_INDEX:
-            if (iIndex >= 0 && iIndex < pCache->nNode) {
+            if (iIndex >= 0 && iIndex < nNode) {
                 Tcl_SetObjResult(
                     interp, HtmlNodeCommand(pTree, pCache->apNode[iIndex])
                 );
@@ -287,7 +744,8 @@ HtmlCssSearch(clientData, interp, objc, objv)
             break;
     }
 
-    if (pSearchRoot) {
+    if (!pEntry) {
+        HtmlCssStyleSheetFree(pCache->pStyle);
         HtmlFree(pCache->apNode);
         HtmlFree(pCache);
     }
@@ -347,6 +347,10 @@ struct HtmlElementNode {
 
     CssPropertySet *pStyle;                /* Parsed inline style */
 
+    /* Interned class names. See HtmlCssNodeClassesSet() */
+    int nClass;                            /* Size of azClass[] */
+    const char **azClass;                  /* Lower-case class names */
+
     /* Information generated by the style engine */
     HtmlComputedValues *pPropertyValues;   /* Current CSS property values */
     HtmlComputedValues *pPreviousValues;   /* Previous CSS property values */
@@ -355,10 +359,15 @@ struct HtmlElementNode {
     HtmlNodeStack *pStack;                 /* Stacking context */
     HtmlNode *pBefore;                     /* Generated :before content */
     HtmlNode *pAfter;                      /* Generated :after content */
+    char *zGenerated;                      /* 'content' of this :before or
+                                            * :after node, or NULL */
 
     /* Manipulated by the [nodeHandle dynamic] command */
     Html_u8 flags;                         /* HTML_DYNAMIC_XXX flags */
 
+    /* Set by HtmlCallbackRestyle() and HtmlCallbackRestyleNode() */
+    Html_u8 styleFlags;                    /* HTML_STYLE_XXX flags */
+
     HtmlNodeReplacement *pReplacement;     /* Replaced object, if any */
     HtmlLayoutCache *pLayoutCache;         /* Cached layout, if any */
     HtmlNodeScrollbars *pScrollbar;        /* Internal scrollbars, if any */
@@ -379,6 +388,24 @@ struct HtmlElementNode {
 #define HTML_DYNAMIC_VISITED  0x10
 #define HTML_DYNAMIC_USERFLAG 0x20
 
+/* Number of HTML_DYNAMIC_XXX flags that CSS selectors may depend on
+ * (all of the above except HTML_DYNAMIC_USERFLAG). This is the size of
+ * the HtmlTree.aDynamic[] array.
+ */
+#define HTML_DYNAMIC_NINDEX   5
+
+/* Values for HtmlElementNode.styleFlags. A node with the HTML_STYLE_NODE
+ * or HTML_STYLE_TREE flag set must be restyled by the next style pass.
+ * Each ancestor of such a node has the HTML_STYLE_CHILD flag set, so that
+ * the style pass need only visit the paths from the root to dirty nodes.
+ * The HTML_STYLE_CHILD flags are set by HtmlStyleApply() using the 
+ * HtmlCallback.apRestyle[] worklist.
+ */
+#define HTML_STYLE_NODE       0x01   /* Restyle this node */
+#define HTML_STYLE_TREE       0x02   /* And descendants and right-siblings */
+#define HTML_STYLE_CHILD      0x04   /* A descendant is to be restyled */
+#define HTML_STYLE_QUEUED     0x08   /* Node is in HtmlCallback.apRestyle[] */
+
 struct HtmlCanvas {
     int left;
     int right;
@@ -410,11 +437,15 @@ struct HtmlOptions {
     Tcl_Obj *fonttable;
     int      forcefontmetrics;
     int      forcewidth;
+    int      asyncimport;
+    int      urlcache;
     Tcl_Obj *imagecmd;
     int      imagecache;
     int      imagepixmapify;
+    Tcl_Obj *mediatype;
     int      mode;                      /* One of the HTML_MODE_XXX values */
     int      shrink;                    /* Boolean */
+    int      stylethreads;              /* Threads used to match selectors */
     double   zoom;                      /* Universal scaling factor. */
 
     int      parsemode;                 /* One of the HTML_PARSEMODE values */
@@ -466,12 +497,15 @@ struct HtmlCallback {
 
     /* HTML_DYNAMIC */
     HtmlNode *pDynamic;         /* Recalculate dynamic CSS for this node */
+    int dynamicFlags;           /* HTML_DYNAMIC_XXX flags that changed */
 
     /* HTML_DAMAGE */
     HtmlDamage *pDamage;
 
     /* HTML_RESTYLE */
-    HtmlNode *pRestyle;         /* Restyle this node */
+    HtmlNode **apRestyle;       /* Worklist of nodes to restyle */
+    int nRestyle;               /* Number of entries in apRestyle[] */
+    int nRestyleAlloc;          /* Allocated size of apRestyle[] */
 
     /* HTML_SCROLL */
     int iScrollX;               /* New HtmlTree.iScrollX value */
@@ -491,10 +525,12 @@ struct HtmlCallback {
  * Functions used to schedule callbacks and set the HtmlCallback state. 
  */
 void HtmlCallbackForce(HtmlTree *);
-void HtmlCallbackDynamic(HtmlTree *, HtmlNode *);
+void HtmlCallbackDynamic(HtmlTree *, HtmlNode *, int);
 void HtmlCallbackDamage(HtmlTree *, int, int, int, int);
 void HtmlCallbackLayout(HtmlTree *, HtmlNode *);
 void HtmlCallbackRestyle(HtmlTree *, HtmlNode *);
+void HtmlCallbackRestyleNode(HtmlTree *, HtmlNode *);
+void HtmlCallbackRestyleRemove(HtmlTree *, HtmlElementNode *);
 
 void HtmlCallbackScrollX(HtmlTree *, int);
 void HtmlCallbackScrollY(HtmlTree *, int);
@@ -580,12 +616,46 @@ struct HtmlTree {
      */
     Tcl_HashTable aOrphan;          /* Orphan nodes (see [$html fragment]) */
 
+    /* Each element node with one or more dynamic CSS conditions attached
+     * (HtmlElementNode.pDynamic) has an entry in table aDynamic[i] for
+     * each flag (1<<i) that at least one of the conditions depends on.
+     * The key is the pointer to the HtmlElementNode structure. Hash entry
+     * data is not used. See cssdynamic.c for details.
+     */
+    Tcl_HashTable aDynamic[HTML_DYNAMIC_NINDEX];
+
+    /* Indexes of element nodes by the values of their "id" and "class"
+     * attributes. The key of each entry is a value, folded to lower-case 
+     * (an id or one of the white-space separated class names). The data
+     * is a pointer to a Tcl_HashTable containing the set of elements. The
+     * indexes include elements in orphan trees. See HtmlNodeIndexAdd().
+     */
+    Tcl_HashTable aIdIndex;         /* Elements by "id" attribute */
+    Tcl_HashTable aClassIndex;      /* Elements by "class" attribute */
+
+    /* Parsed style attributes, keyed by the attribute text. Elements with
+     * identical style attributes share a single parsed declaration set.
+     * See HtmlCssInlineParse().
+     */
+    Tcl_HashTable aInlineStyle;
+
+    /* The element nodes most recently found under the pointer by the 
+     * [$html pointer hover] and [$html pointer active] commands. The
+     * HTML_DYNAMIC_HOVER (or ACTIVE) flag is set on each of these nodes
+     * and all of their ancestors. See HtmlTreePointerCmd().
+     */
+    HtmlNode *pPointerHover;
+    HtmlNode *pPointerActive;
+
     /* This pointer is used to store context during the exeuction of 
      * the [$html fragment] command. See htmltree.c for details.
      */
     HtmlFragmentContext *pFragment;
 
     int isFixed;                    /* True if any "fixed" graphics */
+    int isCounters;                 /* True once a counter is used */
+    int isInlineCounters;           /* True if style attributes use them */
+    int isStyleProfile;             /* True while [_styleprofile] is on */
 
     /*
      * Handler callbacks configured by the [$widget handler] command.
@@ -605,6 +675,10 @@ struct HtmlTree {
     Tcl_HashTable aAttributeHandler;  /* Attribute handler callbacks. */
 
     CssStyleSheet *pStyle;          /* Style sheet configuration */
+    CssPendingStyle *pPendingStyle; /* Queue of [style -async] sheets */
+    CssPendingStyle *pActiveStyle;  /* Sheet being merged by pendingStyleCb */
+    Tcl_Obj *pPendingImport;        /* List of queued -importcmd scripts */
+    Tcl_HashTable aUrlCache;        /* -urlcmd translations (-urlcache) */
 
     /* Used by code in HtmlStyleApply() */
     void *pStyleApply;
@@ -697,6 +771,7 @@ Tcl_ObjCmdProc HtmlTreeCollapseWhitespace;
 Tcl_ObjCmdProc HtmlStyleSyntaxErrs;
 Tcl_ObjCmdProc HtmlLayoutSize;
 Tcl_ObjCmdProc HtmlLayoutNode;
+Tcl_ObjCmdProc HtmlTreePointerCmd;
 Tcl_ObjCmdProc HtmlLayoutImage;
 Tcl_ObjCmdProc HtmlLayoutPrimitives;
 Tcl_ObjCmdProc HtmlCssStyleConfigDump;
@@ -713,15 +788,22 @@ Tcl_ObjCmdProc HtmlCreateUri;
 
 char *HtmlPropertyToString(CssProperty *, char **);
 
-int HtmlStyleApply(HtmlTree *, HtmlNode *);
+int HtmlStyleApply(HtmlTree *);
 int HtmlStyleCounter(HtmlTree *, const char *);
 int HtmlStyleCounters(HtmlTree *, const char *, int *, int);
 void HtmlStyleHandleCounters(HtmlTree *, HtmlComputedValues *);
 
 int HtmlLayout(HtmlTree *);
+HtmlNode *HtmlLayoutElementAt(HtmlTree *, int, int);
 void HtmlLayoutMarkerBox(int, int, int, char *);
 
-int HtmlStyleParse(HtmlTree*, Tcl_Obj*, Tcl_Obj*, Tcl_Obj*, Tcl_Obj*, Tcl_Obj*);
+int HtmlStyleParse(HtmlTree*,Tcl_Obj*,Tcl_Obj*,Tcl_Obj*,Tcl_Obj*,Tcl_Obj*,int);
+int HtmlStyleParseAsync(HtmlTree*,Tcl_Obj*,Tcl_Obj*,Tcl_Obj*,Tcl_Obj*,Tcl_Obj*,int);
+void HtmlStyleCancelAsync(HtmlTree *);
+void HtmlCssUrlCacheInit(HtmlTree *);
+void HtmlCssUrlCacheClear(HtmlTree *);
+void HtmlCssUrlCacheShutdown(HtmlTree *);
+void HtmlCssMediaUpdate(HtmlTree *);
 void HtmlTokenizerAppend(HtmlTree *, const char *, int, int);
 int HtmlNameToType(void *, char *);
 Html_u8 HtmlMarkupFlags(int);
@@ -739,11 +821,16 @@ HtmlNode *  HtmlNodeBefore(HtmlNode *);
 HtmlNode *  HtmlNodeAfter(HtmlNode *);
 HtmlNode *  HtmlNodeRightSibling(HtmlNode *);
 HtmlNode *  HtmlNodeLeftSibling(HtmlNode *);
+int         HtmlNodeIsEdgeChild(HtmlNode *, int);
 char CONST *HtmlNodeTagName(HtmlNode *);
 char CONST *HtmlNodeAttr(HtmlNode *, char CONST *);
 char *      HtmlNodeToString(HtmlNode *);
 HtmlNode *  HtmlNodeGetPointer(HtmlTree *, char CONST *);
 int         HtmlNodeIsOrphan(HtmlNode *);
+int         HtmlNodeIndexOfChild(HtmlNode *, HtmlNode *);
+void        HtmlNodeIndexAdd(HtmlTree *, HtmlNode *);
+void        HtmlNodeIndexRemove(HtmlTree *, HtmlNode *);
+Tcl_HashTable *HtmlNodeIndexLookup(HtmlTree *, int, const char *);
 
 int HtmlNodeAddChild(HtmlElementNode *, int, const char *, HtmlAttributes *);
 int HtmlNodeAddTextChild(HtmlNode *, HtmlTextNode *);
@@ -853,6 +940,7 @@ void HtmlWidgetRepair(HtmlTree *, int, int, int, int, int);
 
 int HtmlNodeClearStyle(HtmlTree *, HtmlElementNode *);
 int HtmlNodeClearGenerated(HtmlTree *, HtmlElementNode *);
+void HtmlNodeFreeGenerated(HtmlTree *, HtmlNode **);
 void HtmlNodeClearRecursive(HtmlTree *, HtmlNode *);
 
 void HtmlTranslateEscapes(char *);
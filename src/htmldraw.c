@@ -3689,6 +3689,43 @@ layoutNodeCompare(pVoidLeft, pVoidRight)
     return iLeft - iRight;
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * layoutNodeQuery --
+ *
+ *     Populate the NodeQuery structure pointed to by pQuery with the set
+ *     of nodes that are under document coordinates (x, y). The nodes are 
+ *     sorted in order of z-index, so that the top-most node is the last
+ *     in the pQuery->apNode array. The caller is responsible for freeing 
+ *     pQuery->apNode using HtmlFree().
+ *    
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+layoutNodeQuery(pTree, x, y, pQuery)
+    HtmlTree *pTree;
+    int x;
+    int y;
+    NodeQuery *pQuery;
+{
+    memset(pQuery, 0, sizeof(NodeQuery));
+    pQuery->x = x;
+    pQuery->y = y;
+    searchCanvas(pTree, y-1, y+1, layoutNodeCb, (ClientData)pQuery, 1);
+    if (pQuery->nNode > 1) {
+        qsort(pQuery->apNode, pQuery->nNode, sizeof(HtmlNode*), 
+            layoutNodeCompare
+        );
+    }
+}
+
 /*
  *---------------------------------------------------------------------------
  *
@@ -3714,19 +3751,13 @@ layoutNodeCmd(pTree, x, y)
     int y;
 {
     NodeQuery sQuery;
-    memset(&sQuery, 0, sizeof(NodeQuery));
-
-    sQuery.x = x;
-    sQuery.y = y;
-
-    searchCanvas(pTree, y-1, y+1, layoutNodeCb, (ClientData)&sQuery, 1);
+    layoutNodeQuery(pTree, x, y, &sQuery);
 
     if (sQuery.nNode == 1) {
         Tcl_SetObjResult(pTree->interp, HtmlNodeCommand(pTree, *sQuery.apNode));
     } else if (sQuery.nNode > 0) {
         int i;
         Tcl_Obj *pRet = Tcl_NewObj();
-        qsort(sQuery.apNode, sQuery.nNode, sizeof(HtmlNode*),layoutNodeCompare);
         for (i = 0; i < sQuery.nNode; i++) {
             Tcl_Obj *pCmd = HtmlNodeCommand(pTree, sQuery.apNode[i]);
             Tcl_ListObjAppendElement(0, pRet, pCmd);
@@ -3735,6 +3766,43 @@ layoutNodeCmd(pTree, x, y)
     }
     HtmlFree(sQuery.apNode);
 }
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlLayoutElementAt --
+ *
+ *     Return the top-most element node under viewport coordinates (x, y),
+ *     or NULL if there is no such node. If the top-most node is a text
+ *     node, it's parent is returned.
+ *    
+ * Results:
+ *     Pointer to element node, or NULL.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+HtmlNode *
+HtmlLayoutElementAt(pTree, x, y)
+    HtmlTree *pTree;
+    int x;
+    int y;
+{
+    HtmlNode *pRet = 0;
+    NodeQuery sQuery;
+
+    layoutNodeQuery(pTree, x + pTree->iScrollX, y + pTree->iScrollY, &sQuery);
+    if (sQuery.nNode > 0) {
+        pRet = sQuery.apNode[sQuery.nNode - 1];
+        if (HtmlNodeIsText(pRet)) {
+            pRet = HtmlNodeParent(pRet);
+        }
+    }
+    HtmlFree(sQuery.apNode);
+    return pRet;
+}
   
 
 /*
@@ -1325,6 +1325,74 @@ HtmlLayoutMarkerBox(eStyle, iList, isList, zBuf)
 }
 
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * markerBoxOrdinal --
+ *
+ *     Return the number of list-item pNode within it's parent pParent,
+ *     not accounting for any 'value' attribute of pNode itself.
+ *
+ *     List-items are usually laid out in document order, so the number
+ *     of the previous list-item numbered is cached in the layout context. 
+ *     If pNode is a later child of the same parent, counting resumes from
+ *     the cached list-item instead of the first child of pParent. This 
+ *     keeps the cost of numbering a long ordered list linear.
+ *
+ * Results:
+ *     List item number.
+ *
+ * Side effects:
+ *     Updates the cached list-item number in pLayout.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+markerBoxOrdinal(pLayout, pParent, pNode)
+    LayoutContext *pLayout;
+    HtmlNode *pParent;
+    HtmlNode *pNode;
+{
+    int nChild = HtmlNodeNumChildren(pParent);
+    int iStart = HtmlNodeComputedValues(pParent)->iOrderedListStart;
+    int iList = ((iStart != PIXELVAL_AUTO) ? iStart : 1);
+    int iFirst = 0;
+    int ii;
+
+    if (pLayout->pListParent == pParent && pLayout->iListChild < nChild) {
+        iFirst = pLayout->iListChild;
+        iList = pLayout->iListValue;
+    }
+
+    for (ii = iFirst; ii < nChild; ii++) {
+        HtmlNode *pSibling = HtmlNodeChild(pParent, ii);
+        HtmlComputedValues *pSibProp = HtmlNodeComputedValues(pSibling);
+        if (pSibling == pNode) {
+            break;
+        }
+        if (DISPLAY(pSibProp) == CSS_CONST_LIST_ITEM) {
+            iList++;
+            if (pSibProp->iOrderedListValue != PIXELVAL_AUTO) {
+                iList = pSibProp->iOrderedListValue;
+            }
+        }
+    }
+
+    if (ii == nChild) {
+        /* pNode precedes the cached list-item. Count from the start. */
+        pLayout->pListParent = 0;
+        if (iFirst > 0) {
+            return markerBoxOrdinal(pLayout, pParent, pNode);
+        }
+        return iList;
+    }
+
+    pLayout->pListParent = pParent;
+    pLayout->iListChild = ii;
+    pLayout->iListValue = iList;
+    return iList;
+}
+
 /*
  *---------------------------------------------------------------------------
  *
@@ -1387,24 +1455,7 @@ markerBoxLayout(pLayout, pBox, pNode, pVerticalOffset)
          * "decimal". Store the value in local variable iList.
          */
         if (pParent) {
-            int ii;
-            int iStart = HtmlNodeComputedValues(pParent)->iOrderedListStart;
-            if (iStart != PIXELVAL_AUTO) {
-                iList = iStart;
-            }
-            for (ii = 0; ii < HtmlNodeNumChildren(pParent); ii++) {
-                HtmlNode *pSibling = HtmlNodeChild(pParent, ii);
-                HtmlComputedValues *pSibProp = HtmlNodeComputedValues(pSibling);
-                if (pSibling == pNode) {
-                    break;
-                }
-                if (DISPLAY(pSibProp) == CSS_CONST_LIST_ITEM) {
-                    iList++;
-                    if (pSibProp->iOrderedListValue != PIXELVAL_AUTO) {
-                        iList = pSibProp->iOrderedListValue;
-                    }
-                }
-            }
+            iList = markerBoxOrdinal(pLayout, pParent, pNode);
         }
         if (pComputed->iOrderedListValue != PIXELVAL_AUTO) {
             iList = pComputed->iOrderedListValue;
@@ -35,6 +35,13 @@ struct LayoutContext {
 
     NodeList *pAbsolute;     /* List of nodes with "absolute" 'position' */
     NodeList *pFixed;        /* List of nodes with "fixed" 'position' */
+
+    /* The number of the most recently numbered list-item. Used by
+     * markerBoxOrdinal() to avoid rescanning earlier list-items.
+     */
+    HtmlNode *pListParent;   /* Parent node of list-item */
+    int iListChild;          /* Index of list-item in pListParent */
+    int iListValue;          /* Number before 'value' attribute applied */
 };
 
 /* Values for LayoutContext.minmaxTest */
@@ -2288,6 +2288,17 @@ HtmlComputedValuesSet(p, eProp, pProp)
         return 0;
     }
 
+    /* If a property that is not inherited by default is copied from the
+     * parent, or set by a script that may read it, flag the values so that
+     * the styler restyles this node whenever the parent changes.
+     */
+    if (
+        (pProp->eType == CSS_CONST_INHERIT && !(pDef && pDef->isInherit)) ||
+        pProp->eType == CSS_TYPE_TCL
+    ) {
+        p->values.mask |= PROP_MASK_INHERIT_EXPLICIT;
+    }
+
     /* Special case - a Tcl script to evaluate */
     if (pProp->eType == CSS_TYPE_TCL) {
         return propertyValuesTclScript(p, eProp, pProp->v.zVal);
@@ -2347,6 +2358,51 @@ HtmlComputedValuesSet(p, eProp, pProp)
     return 1;
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlComputedValuesCompile --
+ *
+ *     Determine if setting property eProp to value pProp using 
+ *     HtmlComputedValuesSet() does nothing more than store an enumerated
+ *     value (the value of pProp->eType) in a single byte field of the 
+ *     HtmlComputedValues structure. This is true of the valid keyword
+ *     values of ENUM properties, i.e. 'display', 'float', 'white-space'.
+ *
+ * Results:
+ *     The offset of the field within HtmlComputedValues in bytes, or -1.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+int
+HtmlComputedValuesCompile(eProp, pProp)
+    int eProp;
+    CssProperty *pProp;
+{
+    PropertyDef *pDef;
+    unsigned char *pOpt;
+
+    if (!pProp || eProp < 0 || eProp > CSS_PROPERTY_MAX_PROPERTY) return -1;
+    pDef = getPropertyDef(eProp);
+    if (!pDef || pDef->eType != ENUM) return -1;
+
+    switch (pProp->eType) {
+        case CSS_CONST_INHERIT:
+        case CSS_TYPE_TCL:
+        case CSS_TYPE_ATTR:
+            return -1;
+    }
+    for (pOpt = HtmlCssEnumeratedValues(eProp); *pOpt; pOpt++) {
+        if (*pOpt == pProp->eType) {
+            return pDef->iOffset;
+        }
+    }
+    return -1;
+}
+
 /*
  *---------------------------------------------------------------------------
  *
@@ -3418,10 +3474,32 @@ HtmlNodeProperties(interp, pValues)
     return TCL_OK;
 }
 
-#define HTML_REQUIRE_CONTENT 3
-#define HTML_REQUIRE_LAYOUT 2
-#define HTML_REQUIRE_PAINT  1
-#define HTML_OK     0
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlComputedValuesCompare --
+ *
+ *     Compare the computed values pV1 of a node with the values pV2 it 
+ *     had before it was restyled. Either argument may be NULL.
+ *
+ * Results:
+ *     A mask of the HTML_CHANGE_XXX bits defined in htmlprop.h:
+ *
+ *       HTML_CHANGE_PAINT:   The node must be repainted.
+ *       HTML_CHANGE_LAYOUT:  The node must be laid out again.
+ *       HTML_CHANGE_CONTENT: A counter property changed, so the generated
+ *                            content of the rest of the document may change.
+ *       HTML_CHANGE_STACK:   The stacking context order may change.
+ *       HTML_CHANGE_INHERIT: A value that is inherited by child nodes
+ *                            changed, so the children must be restyled.
+ *
+ *     Zero is returned if the values are identical.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
 int 
 HtmlComputedValuesCompare(pV1, pV2) 
     HtmlComputedValues *pV1;
@@ -3429,10 +3507,12 @@ HtmlComputedValuesCompare(pV1, pV2)
 {
     unsigned char *v1 = (unsigned char *)pV1;
     unsigned char *v2 = (unsigned char *)pV2;
+    int iInherit = Tk_Offset(HtmlComputedValues, eListStyleType);
+    int mask = HTML_CHANGE_PAINT;
     int ii;
 
     if (pV1 == pV2) {
-        return HTML_OK;
+        return 0;
     }
 
     /* 
@@ -3448,7 +3528,32 @@ HtmlComputedValuesCompare(pV1, pV2)
         (pV1 && pV2 && pV2->clCounterIncrement != pV1->clCounterIncrement) ||
         (pV1 && pV2 && pV2->clCounterReset != pV1->clCounterReset)
     ) {
-        return HTML_REQUIRE_CONTENT;
+        mask |= (HTML_CHANGE_CONTENT|HTML_CHANGE_LAYOUT);
+    }
+
+    if (!pV1 || !pV2) {
+        return (mask|HTML_CHANGE_LAYOUT|HTML_CHANGE_STACK|HTML_CHANGE_INHERIT);
+    }
+
+    /* The properties inherited by default are stored at the end of the
+     * structure, starting with 'list-style-type'. The font and the
+     * background color are also copied from the parent (see
+     * HtmlComputedValuesInit()).
+     */
+    if (
+        pV1->fFont != pV2->fFont ||
+        pV1->cBackgroundColor != pV2->cBackgroundColor ||
+        memcmp(&v1[iInherit], &v2[iInherit], sizeof(HtmlComputedValues)-iInherit)
+    ) {
+        mask |= HTML_CHANGE_INHERIT;
+    }
+
+    if (
+        pV1->ePosition != pV2->ePosition ||
+        pV1->eFloat != pV2->eFloat ||
+        pV1->iZIndex != pV2->iZIndex
+    ) {
+        mask |= HTML_CHANGE_STACK;
     }
 
     /* 
@@ -3460,14 +3565,13 @@ HtmlComputedValuesCompare(pV1, pV2)
      *     'vertical-align'
      */
     if (
-        !pV1 || !pV2 ||
         pV1->imReplacementImage != pV2->imReplacementImage ||
         pV1->imListStyleImage != pV2->imListStyleImage     ||
         pV1->fFont != pV2->fFont ||
         pV1->eVerticalAlign != pV2->eVerticalAlign ||
-        (!pV1->eVerticalAlign && pV1->iVerticalAlign != pV1->iVerticalAlign)
+        (!pV1->eVerticalAlign && pV1->iVerticalAlign != pV2->iVerticalAlign)
     ) {
-        return HTML_REQUIRE_LAYOUT;
+        return (mask | HTML_CHANGE_LAYOUT);
     }
 
     for (ii = 0; ii < sizeof(propdef) / sizeof(propdef[0]); ii++){
@@ -3477,7 +3581,7 @@ HtmlComputedValuesCompare(pV1, pV2)
 
             case ENUM: {
                 if (*(v1 + pDef->iOffset) != *(v2 + pDef->iOffset)) {
-                    return HTML_REQUIRE_LAYOUT;
+                    return (mask | HTML_CHANGE_LAYOUT);
                 }
                 break;
             }
@@ -3491,7 +3595,7 @@ HtmlComputedValuesCompare(pV1, pV2)
                     *pL1 != *pL2 || 
                     ((pDef->mask & pV1->mask) != (pDef->mask & pV2->mask))
                 ) {
-                    return HTML_REQUIRE_LAYOUT;
+                    return (mask | HTML_CHANGE_LAYOUT);
                 }
  
                 break;
@@ -3505,7 +3609,7 @@ HtmlComputedValuesCompare(pV1, pV2)
                 int *pI1 = (int *)(v1 + pDef->iOffset);
                 int *pI2 = (int *)(v2 + pDef->iOffset);
                 if (*pI1 != *pI2) {
-                    return HTML_REQUIRE_LAYOUT;
+                    return (mask | HTML_CHANGE_LAYOUT);
                 }
                 break;
             }
@@ -3520,6 +3624,6 @@ HtmlComputedValuesCompare(pV1, pV2)
         }
     }
 
-    return HTML_REQUIRE_PAINT;
+    return mask;
 }
 
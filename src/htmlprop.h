@@ -383,6 +383,13 @@ struct HtmlComputedValuesCreator {
 #define PROP_MASK_WORD_SPACING            0x20000000
 #define PROP_MASK_LETTER_SPACING          0x40000000
 
+/*
+ * The PROP_MASK_INHERIT_EXPLICIT bit is set if a property that is not
+ * inherited by default was set to 'inherit' (or by a Tcl script), so that
+ * a change to any property of the parent may change the values.
+ */
+#define PROP_MASK_INHERIT_EXPLICIT        0x80000000
+
 /*
  * Pixel values in the HtmlComputedValues struct may also take the following
  * special values. These are all very large negative numbers, unlikely to be
@@ -440,6 +447,16 @@ HtmlComputedValues *HtmlComputedValuesFinish(HtmlComputedValuesCreator *);
 
 void HtmlComputedValuesFreeProperty(HtmlComputedValuesCreator*, CssProperty *);
 
+/*
+ * HtmlComputedValuesCompile() is used by the stylesheet code to resolve
+ * the declarations of each rule once, when the rule is parsed. If it 
+ * returns a non-negative offset, then HtmlComputedValuesSet() may be 
+ * replaced by HtmlComputedValuesSetCompiled() for that property and value.
+ */
+int HtmlComputedValuesCompile(int, CssProperty *);
+#define HtmlComputedValuesSetCompiled(p, iOffset, eValue) \
+    (((unsigned char *)&(p)->values)[iOffset] = (unsigned char)(eValue))
+
 void HtmlComputedValuesRelease(HtmlTree *, HtmlComputedValues*);
 void HtmlComputedValuesReference(HtmlComputedValues *);
 
@@ -472,12 +489,18 @@ int HtmlNodeProperties(Tcl_Interp *, HtmlComputedValues *);
 int HtmlNodeGetProperty(Tcl_Interp *, Tcl_Obj *, HtmlComputedValues *);
 
 /*
- * Determine if changing the computed properties of a node from one
- * argument structure to the other requires a re-layout. Return 1 if it
- * does, or 0 otherwise.
+ * Determine what must be updated if the computed properties of a node
+ * change from one argument structure to the other. The return value is
+ * a mask of the following bits (0 if nothing has changed).
  */
 int HtmlComputedValuesCompare(HtmlComputedValues *, HtmlComputedValues *);
 
+#define HTML_CHANGE_PAINT    0x01     /* Node must be repainted */
+#define HTML_CHANGE_LAYOUT   0x02     /* Layout must be recalculated */
+#define HTML_CHANGE_CONTENT  0x04     /* Counters or generated content */
+#define HTML_CHANGE_STACK    0x08     /* 'position', 'float' or 'z-index' */
+#define HTML_CHANGE_INHERIT  0x10     /* Values children inherit changed */
+
 
 #define HTML_COMPUTED_MARGIN_TOP      margin.iTop
 #define HTML_COMPUTED_MARGIN_RIGHT    margin.iRight
@@ -176,6 +176,91 @@ addStackingInfo(pTree, pElem)
     assert(pElem->pStack);
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * setDescendantStack --
+ *
+ *     Set the HtmlElementNode.pStack pointer of each descendant of pElem
+ *     that currently points to pOld to pElem->pStack. Descendants that 
+ *     point to some other stacking context (their own, or one belonging
+ *     to a node between them and pElem) are not modified. pOld may be a
+ *     pointer to memory that has been freed, so it is never dereferenced.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Modifies the pStack pointers of descendants of pElem and of their 
+ *     generated :before and :after nodes.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+setDescendantStack(pElem, pOld)
+    HtmlElementNode *pElem;
+    HtmlNodeStack *pOld;
+{
+    int ii;
+    for (ii = 0; ii < pElem->nChild; ii++) {
+        HtmlElementNode *pChild = HtmlNodeAsElement(pElem->apChildren[ii]);
+        if (pChild && pChild->pStack == pOld) {
+            pChild->pStack = pElem->pStack;
+            if (pChild->pBefore) {
+                ((HtmlElementNode *)(pChild->pBefore))->pStack = pElem->pStack;
+            }
+            if (pChild->pAfter) {
+                ((HtmlElementNode *)(pChild->pAfter))->pStack = pElem->pStack;
+            }
+            setDescendantStack(pChild, pOld);
+        }
+    }
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * updateStackingInfo --
+ *
+ *     This is called for element pElem after it's computed values have
+ *     been recalculated by styleNode(). It sets pElem->pStack.
+ *
+ *     If pElem was a stacking element and still is, it's HtmlNodeStack
+ *     is updated in place. The descendants of pElem that point to it do
+ *     not need to be modified. Otherwise, if pElem has become or ceased
+ *     to be a stacking element, the descendants that belonged to the old
+ *     stacking context are moved to the new one by setDescendantStack().
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May allocate or free an HtmlNodeStack. Sets the HTML_STACK flag in
+ *     HtmlTree.cb.flags if pElem is a stacking element.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+updateStackingInfo(pTree, pElem)
+    HtmlTree *pTree;
+    HtmlElementNode *pElem;
+{
+    HtmlNodeStack *pOld = pElem->pStack;
+    int isStack = (pOld && pOld->pElem == pElem);
+    int eStack = stackType((HtmlNode *)pElem);
+
+    if (isStack && eStack != STACK_NONE) {
+        pOld->eType = eStack;
+        pTree->cb.flags |= HTML_STACK;
+    } else {
+        HtmlDelStackingInfo(pTree, pElem);
+        addStackingInfo(pTree, pElem);
+        if (pOld && (isStack || pElem->pStack->pElem == pElem)) {
+            setDescendantStack(pElem, pOld);
+        }
+    }
+}
+
 #define STACK_STACKING  1
 #define STACK_BLOCK     3
 #define STACK_INLINE    5
@@ -463,39 +548,215 @@ printf("Stack %d: %s %s\n", iTmp,
     HtmlFree(apTmp);
 }
 
+/* Number of siblings searched by styleShare() */
+#define STYLE_SHARE_SIZE 4
+
+/* Minimum number of elements to restyle before the stylesheet rules are
+ * matched by worker threads (see styleMatchParallel()).
+ */
+#define STYLE_THREAD_MIN_ELEMENTS 1000
+
+/*
+ * When the stylesheet rules are matched by worker threads, the elements
+ * to restyle are divided into tasks. Each task is a range of the array
+ * of elements in document order, made up of one or more complete
+ * sub-trees. Elements that are not part of any task are matched by 
+ * HtmlCssStyleSheetApply() as usual.
+ */
+typedef struct StyleTask StyleTask;
+struct StyleTask {
+  HtmlNode *pFirst;           /* First element of the task */
+  int iStart;                 /* Index of first element of the task */
+  int iEnd;                   /* Index of element after the last */
+  CssMatchList match;         /* Results of matching for each element */
+};
+
+typedef struct StyleCounter StyleCounter;
+struct StyleCounter {
+  char *zName;
+  int iValue;
+};
+
+struct StyleApply {
+  /* True if currently traversing a node with the HTML_STYLE_TREE flag
+   * set, or a descendent, right-sibling or descendent of a right-sibling
+   * of such a node.
+   */
+  int doStyle;
+
+  int doContent;
+
+  /* True if the whole tree is being restyled. */
+  int isRoot;
+
+  /* Mask of HTML_CHANGE_XXX bits returned by HtmlComputedValuesCompare()
+   * for the parent of the current node, or 0 if it was not restyled.
+   */
+  int eParentChange;
+
+  /* True if the stylesheet or any style attribute uses counters. If 
+   * not, no counter state is maintained during the style pass.
+   */
+  int isCounters;
+
+  StyleCounter **apCounter;
+  int nCounter;
+  int nCounterAlloc;
+  int nCounterStartScope;
+
+  /* True if we have seen one or more "fixed" items */
+  int isFixed;
+
+  /* Bloom filter of the ancestors of the node currently being styled */
+  CssAncestorFilter filter;
+
+  /* Recently styled siblings of the current node that may share their
+   * computed values with it. See styleShare().
+   */
+  HtmlNode *apShare[STYLE_SHARE_SIZE];
+  int nShare;
+  int nShared;          /* Number of nodes styled by styleShare() */
+
+  /* Rules matched in advance by worker threads. See styleMatchParallel() */
+  StyleTask *aTask;     /* Array of tasks in document order */
+  int nTask;            /* Size of aTask[] */
+  int iTask;            /* Index of next task in aTask[] to begin */
+  CssMatchList *pMatch; /* Match list of the current task, or NULL */
+};
+typedef struct StyleApply StyleApply;
+
 /*
  *---------------------------------------------------------------------------
  *
- * styleNode --
+ * styleShareable --
+ *
+ *     Check if element pElem may share its computed values with, or
+ *     reuse the computed values of, a sibling. This is only possible if
+ *     the element has no properties set by [$node override] or 
+ *     [$node replace -stylecmd]. A "style" attribute does not prevent
+ *     sharing, as siblings with identical attributes also share the
+ *     same interned declarations (see HtmlCssInlineParse()).
+ *
+ * Results:
+ *     True if pElem may share computed values.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+styleShareable(pElem)
+    HtmlElementNode *pElem;
+{
+    return (!pElem->pOverride && !pElem->pReplacement);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * styleShare --
+ *
+ *     Search the StyleApply.apShare[] array for a sibling of pElem with
+ *     the same tag name, attributes and :link/:visited state. Siblings 
+ *     are only added to the array if HtmlCssStyleSheetApply() reported 
+ *     that their computed values depend on nothing else (apart from the
+ *     ancestors they share with pElem). 
  *
  * Results:
+ *     If a suitable sibling is found, a pointer to its computed values
+ *     is returned. Otherwise NULL.
+ *
+ * Side effects:
  *     None.
  *
+ *---------------------------------------------------------------------------
+ */
+#define STYLE_SHARE_FLAGS (HTML_DYNAMIC_LINK|HTML_DYNAMIC_VISITED)
+static HtmlComputedValues *
+styleShare(p, pElem)
+    StyleApply *p;
+    HtmlElementNode *pElem;
+{
+    HtmlAttributes *pAttr = pElem->pAttributes;
+    int ii;
+
+    /* The last child of a parent may match :last-child rules that the
+     * siblings in apShare[] do not. So it never shares computed values.
+     */
+    if (
+        p->nShare == 0 || 
+        !styleShareable(pElem) || 
+        HtmlNodeIsEdgeChild((HtmlNode *)pElem, 1)
+    ) {
+        return 0;
+    }
+
+    for (ii = 0; ii < p->nShare; ii++) {
+        HtmlElementNode *pSibling = (HtmlElementNode *)p->apShare[ii];
+        HtmlAttributes *pSiblingAttr = pSibling->pAttributes;
+        int jj;
+
+        if (
+            strcmp(pSibling->node.zTag, pElem->node.zTag) ||
+            (pSibling->flags & STYLE_SHARE_FLAGS) != 
+                (pElem->flags & STYLE_SHARE_FLAGS) ||
+            (pAttr ? pAttr->nAttr : 0) != 
+                (pSiblingAttr ? pSiblingAttr->nAttr : 0)
+        ) {
+            continue;
+        }
+        for (jj = 0; pAttr && jj < pAttr->nAttr; jj++) {
+            if (
+                strcmp(pAttr->a[jj].zName, pSiblingAttr->a[jj].zName) ||
+                strcmp(pAttr->a[jj].zValue, pSiblingAttr->a[jj].zValue)
+            ) {
+                break;
+            }
+        }
+        if (!pAttr || jj == pAttr->nAttr) {
+            return pSibling->pPropertyValues;
+        }
+    }
+    return 0;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * styleNode --
+ *
+ * Results:
+ *     A mask of HTML_CHANGE_XXX bits describing how the computed values of
+ *     the node changed (see HtmlComputedValuesCompare()).
+ *
  * Side effects:
  *     None.
  *
  *---------------------------------------------------------------------------
  */
 static int 
-styleNode(pTree, pNode, clientData)
+styleNode(pTree, pNode, p, pIsShareable)
     HtmlTree *pTree;
     HtmlNode *pNode;
-    ClientData clientData;
+    StyleApply *p;
+    int *pIsShareable;       /* OUT: True to add pNode to share cache */
 {
     CONST char *zStyle;      /* Value of "style" attribute for node */
-    int trashDynamics = (int)((size_t) clientData);
+    int trashDynamics = p->isRoot;
+    HtmlComputedValues *pShare;
 
     HtmlElementNode *pElem = (HtmlElementNode *)pNode;
     HtmlComputedValues *pV = pElem->pPropertyValues;
+
     pElem->pPropertyValues = 0;
-    HtmlDelStackingInfo(pTree, pElem);
 
     /* If the clientData was set to a non-zero value, then the 
      * stylesheet configuration has changed. In this case we need to
      * recalculate the nodes list of dynamic conditions.
      */
     if (trashDynamics) {
-        HtmlCssFreeDynamics(pElem);
+        HtmlCssFreeDynamics(pTree, pElem);
     }
 
     /* If there is a "style" attribute on this node, parse the attribute
@@ -518,53 +779,38 @@ styleNode(pTree, pNode, clientData)
         }
     }
 
-    /* Recalculate the properties for this node */
-    HtmlCssStyleSheetApply(pTree, pNode);
+    /* Recalculate the properties for this node. If a sibling with the
+     * same tag and attributes has just been styled, and no rule that might
+     * distinguish between the two exists, reuse the siblings computed
+     * values instead of matching the stylesheet rules again.
+     */
+    pShare = styleShare(p, pElem);
+    if (pShare) {
+        HtmlComputedValuesReference(pShare);
+        pElem->pPropertyValues = pShare;
+        *pIsShareable = 0;
+        p->nShared++;
+        HtmlCssMatchListSkip(p->pMatch, pNode);
+    } else {
+        int isShareable = HtmlCssStyleSheetApply(
+            pTree, pNode, &p->filter, p->pMatch
+        );
+        *pIsShareable = (isShareable && styleShareable(pElem));
+    }
     HtmlComputedValuesRelease(pTree, pElem->pPreviousValues);
     pElem->pPreviousValues = pV;
 
-    addStackingInfo(pTree, pElem);
+    updateStackingInfo(pTree, pElem);
 
     /* Compare the new computed property set with the old. If
      * ComputedValuesCompare() returns 0, then the properties have
-     * not changed (in any way that affects rendering). If it
-     * returns 1, then some aspect has changed that does not
-     * require a relayout (i.e. 'color', or 'text-decoration'). 
-     * If it returns 2, then something has changed that does require
-     * relayout (i.e. 'display', 'font-size').
+     * not changed (in any way that affects rendering). Otherwise the
+     * HTML_CHANGE_XXX bits indicate whether a repaint or relayout is
+     * required, and whether or not the children must be restyled.
      */
     return HtmlComputedValuesCompare(pElem->pPropertyValues, pV);
 }
 
-typedef struct StyleCounter StyleCounter;
-struct StyleCounter {
-  char *zName;
-  int iValue;
-};
-
-struct StyleApply {
-  /* Node to begin recalculating style at */
-  HtmlNode *pRestyle;
-
-  /* True if currently traversing pRestyle, or a descendent, right-sibling
-   * or descendent of a right-sibling of pRestyle.
-   */
-  int doStyle;
-
-  int doContent;
-
-  /* True if the whole tree is being restyled. */
-  int isRoot;
-
-  StyleCounter **apCounter;
-  int nCounter;
-  int nCounterAlloc;
-  int nCounterStartScope;
-
-  /* True if we have seen one or more "fixed" items */
-  int isFixed;
-};
-typedef struct StyleApply StyleApply;
 
 static void 
 styleApply(pTree, pNode, p)
@@ -574,22 +820,60 @@ styleApply(pTree, pNode, p)
 {
     int i;
     int doStyle;
+    int isStyle;
+    int eParentChange;
     int nCounterStartScope;
-    int redrawmode = 0;
+    int eChange = 0;
+    int isShareable = 0;
+    int isChild;
+    unsigned char aBit[sizeof(p->filter.aBit)];
+    HtmlNode *apShare[STYLE_SHARE_SIZE];
+    int nShare;
     HtmlElementNode *pElem = HtmlNodeAsElement(pNode);
 
     /* Text nodes do not have an associated style. */
     if (!pElem) return;
 
-    if (p->pRestyle == pNode) {
+    if (pElem->styleFlags & HTML_STYLE_TREE) {
         p->doStyle = 1;
     }
 
-    if (p->doStyle) {
-        redrawmode = styleNode(pTree, pNode, (ClientData) ((size_t) p->isRoot));
+    /* Outside of the sub-trees that are restyled entirely (see 
+     * HtmlCallbackRestyle()), a node is restyled if it was passed to
+     * HtmlCallbackRestyleNode(), or if its parent was restyled and the
+     * change may affect the values of this node. This is the case if
+     * an inherited value of the parent changed, if the parent's stacking
+     * context changed, or if this node explicitly inherits a property
+     * that is not inherited by default.
+     */
+    isStyle = (
+        p->doStyle || !pElem->pPropertyValues ||
+        (pElem->styleFlags & HTML_STYLE_NODE)
+    );
+    if (!isStyle && p->eParentChange) {
+        isStyle = (
+            (p->eParentChange & (HTML_CHANGE_INHERIT|HTML_CHANGE_STACK)) ||
+            (pElem->pPropertyValues->mask & PROP_MASK_INHERIT_EXPLICIT)
+        );
+    }
+    isChild = (pElem->styleFlags & HTML_STYLE_CHILD);
+    pElem->styleFlags &= HTML_STYLE_QUEUED;
+
+    /* If this is the first element of the next task matched in advance,
+     * use the results of that task from here on.
+     */
+    if (p->iTask < p->nTask && p->aTask[p->iTask].pFirst == pNode) {
+        p->pMatch = &p->aTask[p->iTask].match;
+        p->iTask++;
+    }
+
+    if (isStyle) {
+        eChange = styleNode(pTree, pNode, p, &isShareable);
 
         /* If there has been a style-callback configured (-stylecmd option to
          * the [nodeHandle replace] command) for this node, invoke it now.
+         * The script may modify the document, so do not use any more of
+         * the rules matched in advance.
          */
         if (pElem->pReplacement && pElem->pReplacement->pStyleCmd) {
             Tcl_Obj *pCmd = pElem->pReplacement->pStyleCmd;
@@ -597,50 +881,89 @@ styleApply(pTree, pNode, p)
             if (rc != TCL_OK) {
                 Tcl_BackgroundError(pTree->interp);
             }
+            p->iTask = p->nTask;
+            p->pMatch = 0;
         }
     }
 
-    HtmlStyleHandleCounters(pTree, HtmlNodeComputedValues(pNode));
+    /* A style attribute parsed by styleNode() may have introduced the
+     * first use of counters in the document.
+     */
+    p->isCounters |= pTree->isInlineCounters;
+    if (p->isCounters) {
+        HtmlStyleHandleCounters(pTree, HtmlNodeComputedValues(pNode));
+    }
     nCounterStartScope = p->nCounterStartScope;
     p->nCounterStartScope = p->nCounter;
 
-    if (p->doStyle || p->doContent) {
-        /* Destroy current generated content */
-        if (pElem->pBefore || pElem->pAfter) {
-            HtmlNodeClearGenerated(pTree, pElem);
-            redrawmode = MAX(redrawmode, 2);
+    if (isStyle || p->doContent) {
+        /* Generate :before content. An existing :before node is reused if
+         * the content is unchanged, so layout is only required if the
+         * generated content was actually modified.
+         */
+        if (HtmlCssStyleGenerateContent(pTree, pElem, 1)) {
+            eChange |= HTML_CHANGE_LAYOUT;
         }
-
-        /* Generate :before content */
-        HtmlCssStyleGenerateContent(pTree, pElem, 1);
         if (pElem->pBefore) {
             ((HtmlElementNode *)(pElem->pBefore))->pStack = pElem->pStack;
             pElem->pBefore->pParent = pNode;
             pElem->pBefore->iNode = -1;
         }
-    } else if (pElem->pBefore) {
+    } else if (pElem->pBefore && p->isCounters) {
         HtmlStyleHandleCounters(pTree, HtmlNodeComputedValues(pElem->pBefore));
     }
 
+    /* Add this node to the ancestor filter while its children are styled.
+     * The filter is restored afterwards from the copy in aBit[]. The
+     * children start with an empty style-sharing cache, and the cache
+     * of this node's own siblings is restored afterwards.
+     *
+     * The children are skipped altogether if none of them can require
+     * restyling: this node is not part of a sub-tree being restyled, 
+     * no descendant is in the restyle worklist (HTML_STYLE_CHILD), the
+     * computed values of this node did not change and no counters are
+     * in use by the document.
+     */
     doStyle = p->doStyle;
-    for (i = 0; i < HtmlNodeNumChildren(pNode); i++) {
-        styleApply(pTree, HtmlNodeChild(pNode, i), p);
+    if (HtmlNodeNumChildren(pNode) > 0 && (
+        doStyle || isChild || eChange || p->doContent || pTree->isCounters
+    )) {
+        memcpy(aBit, p->filter.aBit, sizeof(aBit));
+        memcpy(apShare, p->apShare, sizeof(apShare));
+        nShare = p->nShare;
+        eParentChange = p->eParentChange;
+        HtmlCssFilterAdd(&p->filter, pNode);
+        p->nShare = 0;
+        p->eParentChange = eChange;
+        for (i = 0; i < HtmlNodeNumChildren(pNode); i++) {
+            styleApply(pTree, HtmlNodeChild(pNode, i), p);
+        }
+        memcpy(p->filter.aBit, aBit, sizeof(aBit));
+        memcpy(p->apShare, apShare, sizeof(apShare));
+        p->nShare = nShare;
+        p->eParentChange = eParentChange;
     }
     p->doStyle = doStyle;
 
-    if (p->doStyle || p->doContent) {
+    /* Make this node available to styleShare() for its right-siblings. */
+    if (isShareable) {
+        int nMove = MIN(p->nShare, STYLE_SHARE_SIZE - 1);
+        memmove(&p->apShare[1], &p->apShare[0], nMove * sizeof(HtmlNode *));
+        p->apShare[0] = pNode;
+        p->nShare = nMove + 1;
+    }
+
+    if (isStyle || p->doContent) {
         /* Generate :after content */
-        HtmlCssStyleGenerateContent(pTree, pElem, 0);
+        if (HtmlCssStyleGenerateContent(pTree, pElem, 0)) {
+            eChange |= HTML_CHANGE_LAYOUT;
+        }
         if (pElem->pAfter) {
             ((HtmlElementNode *)(pElem->pAfter))->pStack = pElem->pStack;
             pElem->pAfter->pParent = pNode;
             pElem->pAfter->iNode = -1;
         }
-
-        if (pElem->pBefore || pElem->pAfter) {
-            redrawmode = MAX(redrawmode, 2);
-        }
-    } else if(pElem->pAfter) {
+    } else if (pElem->pAfter && p->isCounters) {
         HtmlStyleHandleCounters(pTree, HtmlNodeComputedValues(pElem->pAfter));
     }
 
@@ -650,17 +973,18 @@ styleApply(pTree, pNode, p)
     p->nCounter = p->nCounterStartScope;
     p->nCounterStartScope = nCounterStartScope;
 
-    if (redrawmode == 3) {
-        HtmlCallbackLayout(pTree, pNode);
-        HtmlCallbackDamageNode(pTree, pNode);
-        p->doContent = 1;
-    } else if (redrawmode == 2) {
+    /* Changes that do not affect layout (i.e. 'color') only require
+     * the node to be repainted.
+     */
+    if (eChange & HTML_CHANGE_LAYOUT) {
         HtmlCallbackLayout(pTree, pNode);
         HtmlCallbackDamageNode(pTree, pNode);
-    } else if (redrawmode == 1) {
-        /* HtmlCallbackLayout(pTree, pNode); */
+    } else if (eChange) {
         HtmlCallbackDamageNode(pTree, pNode);
     }
+    if (eChange & HTML_CHANGE_CONTENT) {
+        p->doContent = 1;
+    }
 
     /* If this element was either the <body> or <html> nodes,
      * go ahead and repaint the entire display. The worst that
@@ -668,7 +992,7 @@ styleApply(pTree, pNode, p)
      * area if the document background is set by the <HTML>
      * element.
      */
-    if (redrawmode && (
+    if (eChange && (
             (HtmlNode *)pElem == pTree->pRoot || 
             (HtmlNode *)pElem == HtmlNodeChild(pTree->pRoot, 1)
         )
@@ -720,6 +1044,16 @@ HtmlStyleHandleCounters(pTree, pComputed)
     HtmlCounterList *pReset = pComputed->clCounterReset;
     HtmlCounterList *pIncr = pComputed->clCounterIncrement;
 
+    if (!p->isCounters) {
+        return;
+    }
+
+    /* Once a counter has been seen, styleApply() may no longer skip 
+     * sub-trees that do not require restyling.
+     */
+    if (pReset || pIncr) {
+        pTree->isCounters = 1;
+    }
 
     /* Section 12.4.3 of CSS 2.1: Elements with "display:none" neither
      * increment or reset counters.
@@ -810,11 +1144,389 @@ int HtmlStyleCounter(pTree, zName)
     return 0;
 }
 
+/*
+ * Context shared by the threads that run the tasks created by
+ * styleMatchParallel(). The iNext, nTest and nReject fields are protected
+ * by the mutex.
+ */
+typedef struct StyleMatchContext StyleMatchContext;
+struct StyleMatchContext {
+  HtmlTree *pTree;
+  HtmlNode **apNode;          /* Array of elements in document order */
+  int *aSize;                 /* Size of the sub-tree rooted at each */
+  StyleTask *aTask;           /* Array of tasks */
+  int nTask;                  /* Size of aTask[] */
+  int iNext;                  /* Index of next task to run */
+  int nTest;                  /* Total of CssAncestorFilter.nTest */
+  int nReject;                /* Total of CssAncestorFilter.nReject */
+  Tcl_Mutex mutex;
+};
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * styleMatchSubtree --
+ *
+ *     Match the stylesheet rules against element pNode and each element
+ *     descended from it, appending the results to match list pMatch
+ *     in document order. 
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Modifies *pMatch. *pFilter is modified while the descendants of
+ *     pNode are matched, but is restored before returning.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+styleMatchSubtree(pTree, pNode, pFilter, pMatch)
+    HtmlTree *pTree;
+    HtmlNode *pNode;
+    CssAncestorFilter *pFilter;
+    CssMatchList *pMatch;
+{
+    if (HtmlNodeAsElement(pNode)) {
+        HtmlCssStyleSheetMatch(pTree, pNode, pFilter, pMatch);
+        if (HtmlNodeNumChildren(pNode) > 0) {
+            unsigned char aBit[sizeof(pFilter->aBit)];
+            int ii;
+            memcpy(aBit, pFilter->aBit, sizeof(aBit));
+            HtmlCssFilterAdd(pFilter, pNode);
+            for (ii = 0; ii < HtmlNodeNumChildren(pNode); ii++) {
+                styleMatchSubtree(pTree,HtmlNodeChild(pNode,ii),pFilter,pMatch);
+            }
+            memcpy(pFilter->aBit, aBit, sizeof(aBit));
+        }
+    }
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * styleMatchTasks --
+ *
+ *     Run tasks from the shared context until there are none left. This
+ *     is called by the Tk thread and by each worker thread. 
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Populates the CssMatchList of each task run.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+styleMatchTasks(pCtx)
+    StyleMatchContext *pCtx;
+{
+    CssAncestorFilter filter;
+    memset(&filter, 0, sizeof(CssAncestorFilter));
+
+    while (1) {
+        StyleTask *pTask = 0;
+        int ii;
+
+        Tcl_MutexLock(&pCtx->mutex);
+        if (pCtx->iNext < pCtx->nTask) {
+            pTask = &pCtx->aTask[pCtx->iNext++];
+        }
+        Tcl_MutexUnlock(&pCtx->mutex);
+        if (!pTask) break;
+
+        /* A task is a sequence of complete sub-trees. Before each is
+         * matched, build the ancestor filter for the root of the sub-tree.
+         */
+        ii = pTask->iStart;
+        while (ii < pTask->iEnd) {
+            HtmlNode *pRoot = pCtx->apNode[ii];
+            HtmlNode *pParent;
+            memset(filter.aBit, 0, sizeof(filter.aBit));
+            for (pParent = HtmlNodeParent(pRoot); pParent; ) {
+                HtmlCssFilterAdd(&filter, pParent);
+                pParent = HtmlNodeParent(pParent);
+            }
+            styleMatchSubtree(pCtx->pTree, pRoot, &filter, &pTask->match);
+            ii += pCtx->aSize[ii];
+        }
+    }
+
+    Tcl_MutexLock(&pCtx->mutex);
+    pCtx->nTest += filter.nTest;
+    pCtx->nReject += filter.nReject;
+    Tcl_MutexUnlock(&pCtx->mutex);
+}
+
+#if defined(TCL_THREADS) && !defined(HTML_DEBUG)
+static Tcl_ThreadCreateType
+styleMatchThread(clientData)
+    ClientData clientData;
+{
+    styleMatchTasks((StyleMatchContext *)clientData);
+    Tcl_ExitThread(0);
+    TCL_THREAD_CREATE_RETURN;
+}
+#endif
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * styleListElements --
+ *
+ *     Append pNode and each element descended from it to array apNode[]
+ *     in document order, starting at index i. The size of the sub-tree 
+ *     rooted at each element is written to the corresponding entry of 
+ *     aSize[]. If apNode is NULL, the elements are only counted.
+ *
+ *     Entries of aIn[] are set to true for elements that will be restyled
+ *     because they are part of a sub-tree passed to HtmlCallbackRestyle().
+ *     Argument isIn is true if pNode is such an element.
+ *
+ * Results:
+ *     Index of the entry after the last element appended.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static int
+styleListElements(pNode, apNode, aSize, aIn, i, isIn)
+    HtmlNode *pNode;
+    HtmlNode **apNode;
+    int *aSize;
+    char *aIn;
+    int i;
+    int isIn;
+{
+    int iStart = i;
+    int isChildIn = isIn;
+    int ii;
+    if (!HtmlNodeAsElement(pNode)) return i;
+    i++;
+    for (ii = 0; ii < HtmlNodeNumChildren(pNode); ii++) {
+        HtmlNode *pChild = HtmlNodeChild(pNode, ii);
+        HtmlElementNode *pElem = HtmlNodeAsElement(pChild);
+        if (pElem && (pElem->styleFlags & HTML_STYLE_TREE)) {
+            isChildIn = 1;
+        }
+        i = styleListElements(pChild, apNode, aSize, aIn, i, isChildIn);
+    }
+    if (apNode) {
+        apNode[iStart] = pNode;
+        aSize[iStart] = i - iStart;
+        aIn[iStart] = (char)isIn;
+    }
+    return i;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * styleMatchParallel --
+ *
+ *     This is called before the tree is traversed by styleApply(). If
+ *     the number of elements to restyle is large enough, and the 
+ *     -stylethreads option is set to more than 1, the elements are
+ *     divided into tasks and the stylesheet rules matched against them
+ *     by worker threads (and the calling thread). The results are stored
+ *     in the p->aTask[] array and used by styleApply().
+ *
+ *     Only selector matching is done by the worker threads. It does not
+ *     modify any shared structure. Computed values are still created by
+ *     the Tk thread, as they use Tk fonts and colors and Tcl objects.
+ *
+ *     If Tkhtml is not compiled for a threaded Tcl, or HTML_DEBUG is 
+ *     defined (the debugging allocator is not thread-safe), this function
+ *     is a no-op. It is also a no-op while [$html _styleprofile] is 
+ *     collecting per-rule statistics, as the counters are not updated
+ *     atomically.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May set p->aTask and p->nTask.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+styleMatchParallel(pTree, p)
+    HtmlTree *pTree;
+    StyleApply *p;
+{
+#if defined(TCL_THREADS) && !defined(HTML_DEBUG)
+    int nThread = pTree->options.stylethreads;
+    StyleMatchContext ctx;
+    Tcl_ThreadId *aThread;
+    HtmlElementNode *pRoot;
+    char *aIn;
+    int nElem;
+    int nIn;
+    int nTarget;
+    int nTaskAlloc;
+    int ii;
+
+    if (nThread <= 1 || !pTree->pRoot || !pTree->pStyle) return;
+    if (pTree->isStyleProfile) return;
+
+    nElem = styleListElements(pTree->pRoot, 0, 0, 0, 0, 0);
+    if (nElem < STYLE_THREAD_MIN_ELEMENTS) return;
+
+    memset(&ctx, 0, sizeof(StyleMatchContext));
+    ctx.pTree = pTree;
+    ctx.apNode = (HtmlNode **)HtmlAlloc("temp", nElem * sizeof(HtmlNode *));
+    ctx.aSize = (int *)HtmlAlloc("temp", nElem * sizeof(int));
+    aIn = (char *)HtmlAlloc("temp", nElem);
+    pRoot = (HtmlElementNode *)pTree->pRoot;
+    styleListElements(pTree->pRoot, ctx.apNode, ctx.aSize, aIn, 0,
+        (pRoot->styleFlags & HTML_STYLE_TREE)
+    );
+
+    /* Only elements in the sub-trees passed to HtmlCallbackRestyle() are
+     * matched in advance. Others are rarely restyled.
+     */
+    for (nIn = 0, ii = 0; ii < nElem; ii++) {
+        if (aIn[ii]) nIn++;
+    }
+    if (nIn < STYLE_THREAD_MIN_ELEMENTS) {
+        goto match_out;
+    }
+
+    /* Divide the elements into tasks. Each task is made up of complete
+     * sub-trees of no more than nTarget elements. Sub-trees too large
+     * to be part of a task are split into their root element, which is
+     * matched by the Tk thread, and sub-trees rooted at its children.
+     */
+    nTarget = MAX(nIn / (nThread * 8), 64);
+    nTaskAlloc = 0;
+    ii = 0;
+    while (ii < nElem) {
+        StyleTask *pTask;
+        if (!aIn[ii] || ctx.aSize[ii] > nTarget) {
+            ii++;
+            continue;
+        }
+        if (ctx.nTask == nTaskAlloc) {
+            nTaskAlloc = nTaskAlloc * 2 + 16;
+            ctx.aTask = (StyleTask *)HtmlRealloc("StyleTask", 
+                ctx.aTask, nTaskAlloc * sizeof(StyleTask)
+            );
+        }
+        pTask = &ctx.aTask[ctx.nTask++];
+        memset(pTask, 0, sizeof(StyleTask));
+        pTask->pFirst = ctx.apNode[ii];
+        pTask->iStart = ii;
+        while (
+            ii < nElem && aIn[ii] && ctx.aSize[ii] <= nTarget &&
+            ii - pTask->iStart + ctx.aSize[ii] <= nTarget
+        ) {
+            ii += ctx.aSize[ii];
+        }
+        pTask->iEnd = ii;
+    }
+
+    nThread = MIN(nThread, ctx.nTask);
+    aThread = (Tcl_ThreadId *)HtmlAlloc("temp", nThread*sizeof(Tcl_ThreadId));
+    for (ii = 1; ii < nThread; ii++) {
+        int rc = Tcl_CreateThread(&aThread[ii], styleMatchThread, 
+            (ClientData)&ctx, TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE
+        );
+        if (rc != TCL_OK) break;
+    }
+    nThread = ii;
+    styleMatchTasks(&ctx);
+    for (ii = 1; ii < nThread; ii++) {
+        int rc;
+        Tcl_JoinThread(aThread[ii], &rc);
+    }
+    Tcl_MutexFinalize(&ctx.mutex);
+    HtmlFree(aThread);
+
+    HtmlLog(pTree, "STYLEENGINE", 
+        "%d threads matched %d tasks (%d elements each)",
+        nThread, ctx.nTask, nTarget
+    );
+    p->aTask = ctx.aTask;
+    p->nTask = ctx.nTask;
+    p->filter.nTest += ctx.nTest;
+    p->filter.nReject += ctx.nReject;
+
+match_out:
+    HtmlFree(ctx.apNode);
+    HtmlFree(ctx.aSize);
+    HtmlFree(aIn);
+#endif
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * styleMarkWorklist --
+ *
+ *     Set the HTML_STYLE_CHILD flag on the ancestors of each node in the
+ *     restyle worklist (HtmlCallback.apRestyle[]), so that styleApply() 
+ *     can find them, and empty the worklist. Nodes that are no longer 
+ *     part of the tree rooted at HtmlTree.pRoot are dropped.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Modifies HtmlElementNode.styleFlags and HtmlTree.cb.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+styleMarkWorklist(pTree)
+    HtmlTree *pTree;
+{
+    HtmlCallback *pCb = &pTree->cb;
+    int ii;
+
+    for (ii = 0; ii < pCb->nRestyle; ii++) {
+        HtmlNode *pNode = pCb->apRestyle[ii];
+        HtmlElementNode *pElem = (HtmlElementNode *)pNode;
+        HtmlNode *pA;
+
+        pElem->styleFlags &= ~HTML_STYLE_QUEUED;
+
+        /* Stop at the first ancestor already marked by an earlier entry.
+         * If the root is not reached, pNode has been removed.
+         */
+        for (pA = HtmlNodeParent(pNode); pA; pA = HtmlNodeParent(pA)) {
+            if (((HtmlElementNode *)pA)->styleFlags & HTML_STYLE_CHILD) break;
+            if (pA == pTree->pRoot) break;
+        }
+        if (!pA && pNode != pTree->pRoot) {
+            pElem->styleFlags = 0;
+            continue;
+        }
+
+        for (pA = HtmlNodeParent(pNode); pA; pA = HtmlNodeParent(pA)) {
+            HtmlElementNode *pParent = (HtmlElementNode *)pA;
+            if (pParent->styleFlags & HTML_STYLE_CHILD) break;
+            pParent->styleFlags |= HTML_STYLE_CHILD;
+        }
+    }
+    pCb->nRestyle = 0;
+}
+
 /*
  *---------------------------------------------------------------------------
  *
  * HtmlStyleApply --
  *
+ *     Recalculate the computed values of the nodes in the restyle
+ *     worklist (see HtmlCallbackRestyle() and HtmlCallbackRestyleNode()),
+ *     and of the descendants of those nodes that depend on them.
+ *
+ *     Sub-trees that contain no node from the worklist are not visited,
+ *     so the cost of a restyle depends on the number of nodes affected,
+ *     not on the size of the document.
+ *
  * Results:
  *     None.
  *
@@ -824,24 +1536,49 @@ int HtmlStyleCounter(pTree, zName)
  *---------------------------------------------------------------------------
  */
 int 
-HtmlStyleApply(pTree, pNode)
+HtmlStyleApply(pTree)
     HtmlTree *pTree;
-    HtmlNode *pNode;
 {
     StyleApply sApply;
-    int isRoot = ((pNode == pTree->pRoot) ? 1 : 0);
+    HtmlElementNode *pRoot = (HtmlElementNode *)pTree->pRoot;
+    int isRoot;
+    int ii;
     HtmlLog(pTree, "STYLEENGINE", "START");
 
+    if (!pRoot) {
+        pTree->cb.nRestyle = 0;
+        return TCL_OK;
+    }
+    isRoot = ((pRoot->styleFlags & HTML_STYLE_TREE) ? 1 : 0);
+
     memset(&sApply, 0, sizeof(StyleApply));
-    sApply.pRestyle = pNode;
     sApply.isRoot = isRoot;
+    sApply.isCounters = (
+        pTree->isInlineCounters || HtmlCssStyleSheetCounters(pTree->pStyle)
+    );
 
     assert(pTree->pStyleApply == 0);
+    styleMatchParallel(pTree, &sApply);
+    styleMarkWorklist(pTree);
     pTree->pStyleApply = (void *)&sApply;
     styleApply(pTree, pTree->pRoot, &sApply);
     pTree->pStyleApply = 0;
-    pTree->isFixed = sApply.isFixed;
+
+    /* Sub-trees that are not visited may contain fixed items. Unless
+     * the whole tree was restyled, the flag is never cleared.
+     */
+    pTree->isFixed = (sApply.isFixed || (!isRoot && pTree->isFixed));
+    HtmlLog(pTree, "STYLEENGINE", "ancestor filter rejected %d/%d rules",
+        sApply.filter.nReject, sApply.filter.nTest
+    );
+    HtmlLog(pTree, "STYLEENGINE", "%d nodes shared sibling styles",
+        sApply.nShared
+    );
     HtmlFree(sApply.apCounter);
+    for (ii = 0; ii < sApply.nTask; ii++) {
+        HtmlCssMatchListClear(&sApply.aTask[ii].match);
+    }
+    HtmlFree(sApply.aTask);
     return TCL_OK;
 }
 
@@ -236,7 +236,7 @@ doLoadDefaultStyle(pTree)
     Tcl_Obj *pId = Tcl_NewStringObj("agent", 5);
     assert(pObj);
     Tcl_IncrRefCount(pId);
-    HtmlStyleParse(pTree, pObj, pId, 0, 0, 0);
+    HtmlStyleParse(pTree, pObj, pId, 0, 0, 0, 0);
     Tcl_DecrRefCount(pId);
 }
 
@@ -345,9 +345,10 @@ doScrollCallback(pTree)
  *
  *       1. The node is a text node, or
  *       2. The node has a computed style (HtmlElementNode.pComputed!=0), or
- *       3. The node is HtmlTree.cb.pRestyle, or
- *       4. The node is a descendant of a pRestyle or a descendent of
- *          a right-sibling of pRestyle.
+ *       3. The node has the HTML_STYLE_NODE flag set, or
+ *       4. The node, an ancestor of the node, or a left-sibling of
+ *          the node or of one of its ancestors has the HTML_STYLE_TREE
+ *          flag set.
  *
  * Results:
  *     None.
@@ -363,7 +364,6 @@ checkRestylePointCb(pTree, pNode, clientData)
     HtmlNode *pNode;
     ClientData clientData;
 {
-    HtmlNode *pParent;
     HtmlNode *p;
 
     /* Condition 1 */
@@ -373,15 +373,17 @@ checkRestylePointCb(pTree, pNode, clientData)
     if (HtmlNodeComputedValues(pNode)) goto ok_out;
 
     /* Condition 3 */
-    if (pNode==pTree->cb.pRestyle) goto ok_out;
+    if (((HtmlElementNode *)pNode)->styleFlags & HTML_STYLE_NODE) goto ok_out;
 
     /* Condition 4 */
-    assert(pTree->cb.pRestyle);
-    pParent = HtmlNodeParent(pTree->cb.pRestyle);
-    for (p = pNode; p && HtmlNodeParent(p) != pParent; p = HtmlNodeParent(p));
-    assert(p);
-    for ( ; p && p != pTree->cb.pRestyle; p = HtmlNodeLeftSibling(p));
-    assert(p);
+    for (p = pNode; p; p = HtmlNodeParent(p)) {
+        HtmlNode *pSibling;
+        for (pSibling = p; pSibling; pSibling = HtmlNodeLeftSibling(pSibling)) {
+            HtmlElementNode *pElem = HtmlNodeAsElement(pSibling);
+            if (pElem && (pElem->styleFlags & HTML_STYLE_TREE)) goto ok_out;
+        }
+    }
+    assert(!"Node has no style and is not scheduled for restyle");
 
 ok_out:
     return HTML_WALK_DESCEND;
@@ -426,13 +428,9 @@ INSTRUMENTED(runDynamicStyleEngine, HTML_INSTRUMENT_DYNAMIC_STYLE_ENGINE)
 INSTRUMENTED(runStyleEngine, HTML_INSTRUMENT_STYLE_ENGINE)
 {
     HtmlTree *pTree = (HtmlTree *)clientData;
-    HtmlNode *pRestyle = pTree->cb.pRestyle;
-
-    pTree->cb.pRestyle = 0;
     assert(pTree->cb.pSnapshot);
-    assert(pRestyle);
 
-    HtmlStyleApply(pTree, pRestyle);
+    HtmlStyleApply(pTree);
     HtmlRestackNodes(pTree);
     HtmlCheckRestylePoint(pTree);
 
@@ -497,7 +495,7 @@ INSTRUMENTED(callbackHandler, HTML_INSTRUMENT_CALLBACK)
     assert(
         !pTree->pRoot ||
         HtmlNodeComputedValues(pTree->pRoot) ||
-        pTree->cb.pRestyle==pTree->pRoot
+        (((HtmlElementNode *)pTree->pRoot)->styleFlags & HTML_STYLE_TREE)
     );
 
     while( pTree->cb.inProgress ) {
@@ -507,14 +505,14 @@ INSTRUMENTED(callbackHandler, HTML_INSTRUMENT_CALLBACK)
     HtmlCheckRestylePoint(pTree);
 
     HtmlLog(pTree, "CALLBACK", 
-        "flags=( %s%s%s%s%s) pDynamic=%s pRestyle=%s scroll=(+%d+%d) ",
+        "flags=( %s%s%s%s%s) pDynamic=%s nRestyle=%d scroll=(+%d+%d) ",
         (p->flags & HTML_DYNAMIC ? "Dynamic " : ""),
         (p->flags & HTML_RESTYLE ? "Style " : ""),
         (p->flags & HTML_LAYOUT ? "Layout " : ""),
         (p->flags & HTML_DAMAGE ? "Damage " : ""),
         (p->flags & HTML_SCROLL ? "Scroll " : ""),
         (p->pDynamic?Tcl_GetString(HtmlNodeCommand(pTree,p->pDynamic)):"N/A"),
-        (p->pRestyle?Tcl_GetString(HtmlNodeCommand(pTree,p->pRestyle)):"N/A"),
+        p->nRestyle,
          p->iScrollX, p->iScrollY
     );
 
@@ -533,9 +531,9 @@ INSTRUMENTED(callbackHandler, HTML_INSTRUMENT_CALLBACK)
     HtmlCheckRestylePoint(pTree);
     pTree->cb.flags &= ~HTML_DYNAMIC;
 
-    /* If the HtmlCallback.pRestyle variable is set, then recalculate 
-     * style information for the sub-tree rooted at HtmlCallback.pRestyle,
-     * and the sub-trees rooted at all right-siblings of pRestyle. 
+    /* If the HTML_RESTYLE flag is set, then recalculate style information
+     * for the nodes in the HtmlCallback.apRestyle[] worklist. See 
+     * HtmlCallbackRestyle() and HtmlCallbackRestyleNode().
      * Note that restyling a node may invoke the -imagecmd callback.
      *
      * Todo: This seems dangerous.  What happens if the -imagecmd calls
@@ -763,16 +761,78 @@ snapshotZero(pTree)
     }
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * restyleQueue --
+ *
+ *     Set the HTML_STYLE_NODE or HTML_STYLE_TREE flag (argument flag) on 
+ *     element pElem, add it to the HtmlCallback.apRestyle[] worklist and
+ *     schedule a callback. Nothing is done if pElem is part of an orphan 
+ *     tree.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May modify HtmlTree.cb and/or register for an idle callback with
+ *     the Tcl event loop.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+restyleQueue(pTree, pElem, flag)
+    HtmlTree *pTree;
+    HtmlElementNode *pElem;
+    int flag;
+{
+    HtmlCallback *p = &pTree->cb;
+    HtmlNode *pA;
+
+    /* Do nothing if pElem is part of an orphan tree */
+    for (pA = (HtmlNode *)pElem; pA; pA = HtmlNodeParent(pA)) {
+        if (pA->iNode == HTML_NODE_ORPHAN) return;
+    }
+
+    snapshotLayout(pTree);
+    pElem->styleFlags |= flag;
+    if (!(pElem->styleFlags & HTML_STYLE_QUEUED)) {
+        if (p->nRestyle == p->nRestyleAlloc) {
+            int nByte;
+            p->nRestyleAlloc = p->nRestyleAlloc * 2 + 16;
+            nByte = p->nRestyleAlloc * sizeof(HtmlNode *);
+            p->apRestyle = (HtmlNode **)HtmlRealloc(
+                "HtmlCallback.apRestyle", p->apRestyle, nByte
+            );
+        }
+        p->apRestyle[p->nRestyle++] = (HtmlNode *)pElem;
+        pElem->styleFlags |= HTML_STYLE_QUEUED;
+    }
+
+    if (!p->flags) {
+        Tcl_DoWhenIdle(callbackHandler, (ClientData)pTree);
+    }
+    p->flags |= HTML_RESTYLE;
+    assert(p->pSnapshot);
+}
+
 /*
  *---------------------------------------------------------------------------
  *
  * HtmlCallbackRestyle --
  *
  *     Next widget idle-callback, recalculate style information for the
- *     sub-tree rooted at pNode. This function is a no-op if (pNode==0).
- *     If pNode is the root of the document, then the list of dynamic
- *     conditions (HtmlNode.pDynamic) that apply to each node is also
- *     recalculated.
+ *     sub-tree rooted at pNode, and the sub-trees rooted at each of its
+ *     right-siblings. This function is a no-op if (pNode==0). If pNode
+ *     is the root of the document, then the list of dynamic conditions
+ *     (HtmlNode.pDynamic) that apply to each node is also recalculated.
+ *
+ *     If pNode is a text node, the sub-trees rooted at its right-siblings
+ *     are restyled.
+ *
+ *     Each call adds an entry to the HtmlCallback.apRestyle[] worklist.
+ *     Requests for unrelated nodes are not merged, so that only the nodes
+ *     that may have changed are restyled.
  *
  * Results:
  *     None.
@@ -788,15 +848,11 @@ HtmlCallbackRestyle(pTree, pNode)
     HtmlTree *pTree;
     HtmlNode *pNode;
 {
-    if (pNode) {
-        snapshotLayout(pTree);
-        if (upgradeRestylePoint(&pTree->cb.pRestyle, pNode)) {
-            if (!pTree->cb.flags) {
-                Tcl_DoWhenIdle(callbackHandler, (ClientData)pTree);
-            }
-            pTree->cb.flags |= HTML_RESTYLE;
-            assert(pTree->cb.pSnapshot);
-        }
+    while (pNode && HtmlNodeIsText(pNode)) {
+        pNode = HtmlNodeRightSibling(pNode);
+    }
+    if (pNode && pNode->iNode != HTML_NODE_GENERATED) {
+        restyleQueue(pTree, (HtmlElementNode *)pNode, HTML_STYLE_TREE);
     }
 
     /* This is also where the text-representation of the document is
@@ -805,7 +861,77 @@ HtmlCallbackRestyle(pTree, pNode)
      * is clearly suspect.
      */
     HtmlTextInvalidate(pTree);
-    HtmlCssSearchInvalidateCache(pTree);
+    HtmlCssSearchNodeChanged(pTree, pNode);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCallbackRestyleNode --
+ *
+ *     Next widget idle-callback, recalculate the computed values of
+ *     element pNode. This is used instead of HtmlCallbackRestyle() when 
+ *     the change cannot affect the selectors matched by any other node,
+ *     for example when a dynamic condition of pNode changes. The
+ *     descendants of pNode are only restyled if the change affects the
+ *     values they inherit. This function is a no-op if pNode is not an
+ *     element.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May modify HtmlTree.cb and/or register for an idle callback with
+ *     the Tcl event loop.
+ *
+ *---------------------------------------------------------------------------
+ */
+void
+HtmlCallbackRestyleNode(pTree, pNode)
+    HtmlTree *pTree;
+    HtmlNode *pNode;
+{
+    HtmlElementNode *pElem = HtmlNodeAsElement(pNode);
+
+    if (!pElem || pNode->iNode == HTML_NODE_GENERATED) return;
+    restyleQueue(pTree, pElem, HTML_STYLE_NODE);
+
+    HtmlTextInvalidate(pTree);
+    HtmlCssSearchNodeChanged(pTree, pNode);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlCallbackRestyleRemove --
+ *
+ *     Remove element pElem from the HtmlCallback.apRestyle[] worklist.
+ *     This is called before the node is deleted.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May modify HtmlTree.cb.
+ *
+ *---------------------------------------------------------------------------
+ */
+void
+HtmlCallbackRestyleRemove(pTree, pElem)
+    HtmlTree *pTree;
+    HtmlElementNode *pElem;
+{
+    HtmlCallback *p = &pTree->cb;
+    if (pElem->styleFlags & HTML_STYLE_QUEUED) {
+        int ii;
+        for (ii = 0; ii < p->nRestyle; ii++) {
+            if (p->apRestyle[ii] == (HtmlNode *)pElem) {
+                p->apRestyle[ii] = p->apRestyle[--p->nRestyle];
+                break;
+            }
+        }
+        pElem->styleFlags &= ~HTML_STYLE_QUEUED;
+    }
 }
 
 /*
@@ -818,6 +944,10 @@ HtmlCallbackRestyle(pTree, pNode)
  *     have changed. If so, restyle the affected nodes.  This function
  *     is a no-op if (pNode==0).
  *
+ *     Argument flags is the mask of HTML_DYNAMIC_XXX flags that have
+ *     been modified on pNode. Only dynamic conditions that depend on
+ *     one of these flags are rechecked.
+ *
  * Results:
  *     None.
  *
@@ -828,11 +958,13 @@ HtmlCallbackRestyle(pTree, pNode)
  *---------------------------------------------------------------------------
  */
 void 
-HtmlCallbackDynamic(pTree, pNode)
+HtmlCallbackDynamic(pTree, pNode, flags)
     HtmlTree *pTree;
     HtmlNode *pNode;
+    int flags;
 {
     if (pNode) {
+        pTree->cb.dynamicFlags |= flags;
         if (upgradeRestylePoint(&pTree->cb.pDynamic, pNode)) {
             if (!pTree->cb.flags) {
                 Tcl_DoWhenIdle(callbackHandler, (ClientData)pTree);
@@ -1054,6 +1186,29 @@ cleanupHandlerTable(pHash)
     Tcl_DeleteHashTable(pHash);
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * freeWidget --
+ *
+ *     Tcl_FreeProc used to free the HtmlTree structure once it is no
+ *     longer preserved. See deleteWidget().
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+freeWidget(p)
+    char *p;
+{
+    HtmlFree(p);
+}
+
 /*
  *---------------------------------------------------------------------------
  *
@@ -1075,6 +1230,7 @@ deleteWidget(clientData)
 {
     HtmlDamage *pDamage;
     HtmlTree *pTree = (HtmlTree *)clientData;
+    int ii;
     HtmlTreeClear(pTree);
 
     /* Delete the contents of the three "handler" hash tables */
@@ -1093,8 +1249,9 @@ deleteWidget(clientData)
     HtmlImageServerDoGC(pTree);
     HtmlImageServerShutdown(pTree);
 
-    /* Delete the search cache. */
+    /* Delete the search cache and the -urlcmd cache. */
     HtmlCssSearchShutdown(pTree);
+    HtmlCssUrlCacheShutdown(pTree);
 
     /* Cancel any pending idle callback */
     Tcl_CancelIdleCall(callbackHandler, (ClientData)pTree);
@@ -1110,8 +1267,31 @@ deleteWidget(clientData)
     /* Atoms table */
     Tcl_DeleteHashTable(&pTree->aAtom);
 
-    /* Delete the structure itself */
-    HtmlFree(pTree);
+    /* Restyle worklist. Empty by now, as all nodes are freed. */
+    assert(pTree->cb.nRestyle == 0);
+    HtmlFree(pTree->cb.apRestyle);
+
+    /* Dynamic conditions indexes. Empty by now, as all nodes are freed. */
+    for (ii = 0; ii < HTML_DYNAMIC_NINDEX; ii++) {
+        assert(pTree->aDynamic[ii].numEntries == 0);
+        Tcl_DeleteHashTable(&pTree->aDynamic[ii]);
+    }
+
+    /* Id and class indexes. Also empty. */
+    assert(pTree->aIdIndex.numEntries == 0);
+    assert(pTree->aClassIndex.numEntries == 0);
+    Tcl_DeleteHashTable(&pTree->aIdIndex);
+    Tcl_DeleteHashTable(&pTree->aClassIndex);
+
+    /* Interned style attributes. Also empty. */
+    assert(pTree->aInlineStyle.numEntries == 0);
+    Tcl_DeleteHashTable(&pTree->aInlineStyle);
+
+    /* Delete the structure itself. This is deferred if the structure is
+     * in use by a callback that invoked the script that destroyed the
+     * widget (see pendingStyleCb() in css.c).
+     */
+    Tcl_EventuallyFree((ClientData)pTree, freeWidget);
 }
 
 /*
@@ -1177,6 +1357,7 @@ eventHandler(clientData, pEvent)
                 iWidth != pTree->iCanvasWidth || 
                 iHeight != pTree->iCanvasHeight
             ) {
+                HtmlCssMediaUpdate(pTree);
                 HtmlCallbackLayout(pTree, pTree->pRoot);
                 snapshotZero(pTree);
                 HtmlCallbackDamage(pTree, 0, 0, iWidth, iHeight);
@@ -1318,6 +1499,7 @@ configureCmd(clientData, interp, objc, objv)
     #define S_MASK         0x00000008    
     #define F_MASK         0x00000010   
     #define L_MASK         0x00000020   
+    #define M_MASK         0x00000040
 
     /*
      * Macros to generate static Tk_OptionSpec structures for the
@@ -1344,6 +1526,9 @@ configureCmd(clientData, interp, objc, objv)
     #define DOUBLE(v, s1, s2, s3, f) \
         {TK_OPTION_DOUBLE, "-" #v, s1, s2, s3, -1, \
          Tk_Offset(HtmlOptions, v), 0, 0, f}
+    #define NUMBER(v, s1, s2, s3, f) \
+        {TK_OPTION_INT, "-" #v, s1, s2, s3, -1, \
+         Tk_Offset(HtmlOptions, v), 0, 0, f}
     
     /* Option table definition for the html widget. */
     static Tk_OptionSpec htmlOptionSpec[] = {
@@ -1357,6 +1542,7 @@ STRING  (xscrollcommand, "xScrollCommand", "ScrollCommand", ""),
 STRING  (yscrollcommand, "yScrollCommand", "ScrollCommand", ""),
 
 /* Non-debugging, non-standard options in alphabetical order. */
+BOOLEAN (asyncimport, "asyncImport", "AsyncImport", "0", 0),
 OBJ     (defaultstyle, "defaultStyle", "DefaultStyle", HTML_DEFAULT_CSS, 0),
 DOUBLE  (fontscale, "fontScale", "FontScale", "1.0", F_MASK),
 OBJ     (fonttable, "fontTable", "FontTable", "8 9 10 11 13 15 17", FT_MASK),
@@ -1365,9 +1551,12 @@ BOOLEAN (forcewidth, "forceWidth", "ForceWidth", "0", L_MASK),
 BOOLEAN (imagecache, "imageCache", "ImageCache", "1", S_MASK),
 BOOLEAN (imagepixmapify, "imagePixmapify", "ImagePixmapify", "0", 0),
 STRING  (imagecmd, "imageCmd", "ImageCmd", ""),
+OBJ     (mediatype, "mediaType", "MediaType", "screen", M_MASK),
 STRINGT (mode, "mode", "Mode", "standards", azModes),
 STRINGT (parsemode, "parsemode", "Parsemode", "html", azParseModes),
 BOOLEAN (shrink, "shrink", "Shrink", "0", S_MASK),
+NUMBER  (stylethreads, "styleThreads", "StyleThreads", "1", 0),
+BOOLEAN (urlcache, "urlCache", "UrlCache", "0", 0),
 DOUBLE  (zoom, "zoom", "Zoom", "1.0", F_MASK),
 
 /* Debugging options */
@@ -1472,6 +1661,13 @@ STRING  (timercmd, "timerCmd", "TimerCmd", ""),
              */
             HtmlCallbackLayout(pTree, pTree->pRoot);
         }
+        if (!init && (mask & (GEOMETRY_MASK|L_MASK|M_MASK))) {
+            /* The -mediatype option or the size of the viewport (if the 
+             * widget is not mapped, or -forcewidth is set) may have
+             * changed. Reevaluate any @media conditions.
+             */
+            HtmlCssMediaUpdate(pTree);
+        }
 
         if (rc != TCL_OK) {
             assert(!init);
@@ -2152,6 +2348,9 @@ handlerCmd(clientData, interp, objc, objv)
  *             -importcmd IMPORT-CMD
  *             -id ID
  *             -urlcmd URL-CMD
+ *             -errorvar VARNAME
+ *             -replace
+ *             -async
  *
  * Results:
  *     Tcl result (i.e. TCL_OK, TCL_ERROR).
@@ -2167,17 +2366,21 @@ styleCmd(clientData, interp, objc, objv)
     int objc;                          /* Number of arguments. */
     Tcl_Obj *CONST objv[];             /* Argument strings. */
 {
-    SwprocConf aConf[5 + 1] = {
+    SwprocConf aConf[7 + 1] = {
         {SWPROC_OPT, "id", "author", 0},      /* -id <style-sheet id> */
         {SWPROC_OPT, "importcmd", 0, 0},      /* -importcmd <cmd> */
         {SWPROC_OPT, "urlcmd", 0, 0},         /* -urlcmd <cmd> */
         {SWPROC_OPT, "errorvar", 0, 0},       /* -errorvar <varname> */
+        {SWPROC_SWITCH, "replace", "0", "1"}, /* -replace */
+        {SWPROC_SWITCH, "async", "0", "1"},   /* -async */
         {SWPROC_ARG, 0, 0, 0},                /* STYLE-SHEET-TEXT */
         {SWPROC_END, 0, 0, 0}
     };
-    Tcl_Obj *apObj[5];
+    Tcl_Obj *apObj[7];
     int rc = TCL_OK;
     int n;
+    int isReplace = 0;
+    int isAsync = 0;
     HtmlTree *pTree = (HtmlTree *)clientData;
 
     /* First assert() that the sizes of the aConf and apObj array match. Then
@@ -2188,19 +2391,34 @@ styleCmd(clientData, interp, objc, objv)
      *     apObj[1] -> Value passed to -importcmd option (or default "")
      *     apObj[2] -> Value passed to -urlcmd option (or default "")
      *     apObj[3] -> Variable to store error log in
-     *     apObj[4] -> Text of stylesheet to parse
+     *     apObj[4] -> "1" if -replace was specified, otherwise "0"
+     *     apObj[5] -> "1" if -async was specified, otherwise "0"
+     *     apObj[6] -> Text of stylesheet to parse
      *
      * Pass these on to the HtmlStyleParse() command to actually parse the
-     * stylesheet.
+     * stylesheet. Or, if -async was specified, to HtmlStyleParseAsync()
+     * to queue the stylesheet for parsing from an idle callback.
      */
     assert(sizeof(apObj)/sizeof(apObj[0])+1 == sizeof(aConf)/sizeof(aConf[0]));
     if (TCL_OK != SwprocRt(interp, objc - 2, &objv[2], aConf, apObj)) {
         return TCL_ERROR;
     }
+    rc = Tcl_GetBooleanFromObj(interp, apObj[4], &isReplace);
+    if (rc == TCL_OK) {
+        rc = Tcl_GetBooleanFromObj(interp, apObj[5], &isAsync);
+    }
 
-    Tcl_GetStringFromObj(apObj[4], &n);
-    if (n > 0) {
-        rc = HtmlStyleParse(pTree,apObj[4],apObj[0],apObj[1],apObj[2],apObj[3]);
+    Tcl_GetStringFromObj(apObj[6], &n);
+    if (rc != TCL_OK) {
+        /* Do nothing */
+    } else if (isAsync) {
+        rc = HtmlStyleParseAsync(pTree, 
+            apObj[6], apObj[0], apObj[1], apObj[2], apObj[3], isReplace
+        );
+    } else if (n > 0 || isReplace) {
+        rc = HtmlStyleParse(pTree, 
+            apObj[6], apObj[0], apObj[1], apObj[2], apObj[3], isReplace
+        );
     } else {
         /* For a zero length stylesheet, we don't need to run the parser.
          * But we do need to set the error-log variable to an empty string
@@ -2214,7 +2432,11 @@ styleCmd(clientData, interp, objc, objv)
     /* Clean up object references created by SwprocRt() */
     SwprocCleanup(apObj, sizeof(apObj)/sizeof(Tcl_Obj *));
 
-    if (rc == TCL_OK) {
+    /* If the -replace switch was used, HtmlStyleParse() has already
+     * scheduled a restyle of the affected nodes only. If -async was used,
+     * the restyle is scheduled when the queued stylesheet is parsed.
+     */
+    if (rc == TCL_OK && !isReplace && !isAsync) {
         HtmlCallbackRestyle(pTree, pTree->pRoot);
     }
     return rc;
@@ -2440,6 +2662,15 @@ nodeCmd(clientData, interp, objc, objv)
     return HtmlLayoutNode(clientData, interp, objc, objv);
 }
 static int 
+pointerCmd(clientData, interp, objc, objv)
+    ClientData clientData;             /* The HTML widget data structure */
+    Tcl_Interp *interp;                /* Current interpreter. */
+    int objc;                          /* Number of arguments. */
+    Tcl_Obj *CONST objv[];             /* Argument strings. */
+{
+    return HtmlTreePointerCmd(clientData, interp, objc, objv);
+}
+static int 
 primitivesCmd(clientData, interp, objc, objv)
     ClientData clientData;             /* The HTML widget data structure */
     Tcl_Interp *interp;                /* Current interpreter. */
@@ -2476,6 +2707,15 @@ styleconfigCmd(clientData, interp, objc, objv)
     return HtmlCssStyleConfigDump(clientData, interp, objc, objv);
 }
 static int 
+styleprofileCmd(clientData, interp, objc, objv)
+    ClientData clientData;             /* The HTML widget data structure */
+    Tcl_Interp *interp;                /* Current interpreter. */
+    int objc;                          /* Number of arguments. */
+    Tcl_Obj *CONST objv[];             /* Argument strings. */
+{
+    return HtmlCssStyleProfile(clientData, interp, objc, objv);
+}
+static int 
 stylereportCmd(clientData, interp, objc, objv)
     ClientData clientData;             /* The HTML widget data structure */
     Tcl_Interp *interp;                /* Current interpreter. */
@@ -2572,6 +2812,7 @@ int widgetCmd(clientData, interp, objc, objv)
         {"image",        imageCmd},
         {"node",         nodeCmd},
         {"parse",        parseCmd},
+        {"pointer",      pointerCmd},
         {"preload",      preloadCmd},
         {"reset",        resetCmd},
         {"search",       searchCmd},
@@ -2591,6 +2832,7 @@ int widgetCmd(clientData, interp, objc, objv)
         {"_primitives",  primitivesCmd},
         {"_relayout",    relayoutCmd},
         {"_styleconfig", styleconfigCmd},
+        {"_styleprofile", styleprofileCmd},
         {"_stylereport", stylereportCmd},
 #ifndef NDEBUG
         {"_hashstats",  hashstatsCmd},
@@ -2629,6 +2871,7 @@ newWidget(clientData, interp, objc, objv)
     HtmlTree *pTree;
     CONST char *zCmd;
     int rc;
+    int ii;
     Tk_Window mainwin;           /* Main window of application */
     Tcl_HashKeyType *pType;
 
@@ -2666,6 +2909,12 @@ newWidget(clientData, interp, objc, objv)
     Tcl_InitHashTable(&pTree->aNodeHandler, TCL_ONE_WORD_KEYS);
     Tcl_InitHashTable(&pTree->aAttributeHandler, TCL_ONE_WORD_KEYS);
     Tcl_InitHashTable(&pTree->aOrphan, TCL_ONE_WORD_KEYS);
+    for (ii = 0; ii < HTML_DYNAMIC_NINDEX; ii++) {
+        Tcl_InitHashTable(&pTree->aDynamic[ii], TCL_ONE_WORD_KEYS);
+    }
+    Tcl_InitHashTable(&pTree->aIdIndex, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&pTree->aClassIndex, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&pTree->aInlineStyle, TCL_STRING_KEYS);
     Tcl_InitHashTable(&pTree->aTag, TCL_STRING_KEYS);
     pTree->cmd = Tcl_CreateObjCommand(interp,zCmd,widgetCmd,pTree,widgetCmdDel);
 
@@ -2673,6 +2922,7 @@ newWidget(clientData, interp, objc, objv)
     Tcl_InitCustomHashTable(&pTree->aAtom, TCL_CUSTOM_TYPE_KEYS, pType);
 
     HtmlCssSearchInit(pTree);
+    HtmlCssUrlCacheInit(pTree);
 
     /* Initialise the hash tables used by styler code */
     HtmlComputedValuesSetupTables(pTree);
@@ -42,6 +42,7 @@ static const char rcsid[] = "$Id: htmltree.c,v 1.161 2008/02/14 08:39:14 danielk
 #include "swproc.h"
 #include <assert.h>
 #include <string.h>
+#include <ctype.h>
 
 
 struct HtmlFragmentContext {
@@ -232,7 +233,7 @@ HtmlNodeClearStyle(pTree, pElem)
         HtmlComputedValuesRelease(pTree, pElem->pPropertyValues);
         HtmlComputedValuesRelease(pTree, pElem->pPreviousValues);
         HtmlCssInlineFree(pElem->pStyle);
-        HtmlCssFreeDynamics(pElem);
+        HtmlCssFreeDynamics(pTree, pElem);
         pElem->pStyle = 0;
         pElem->pPropertyValues = 0;
         pElem->pPreviousValues = 0;
@@ -293,11 +294,14 @@ freeNode(pTree, pNode)
         if (!HtmlNodeIsText(pNode)) {
             /* Do HtmlElementNode specific destruction */
             HtmlElementNode *pElem = (HtmlElementNode *)pNode;
+            HtmlNodeIndexRemove(pTree, pNode);
             HtmlFree(pElem->pAttributes);
+            HtmlFree(pElem->zGenerated);
 
             /* Delete the computed values caches. */
             HtmlNodeClearStyle(pTree, pElem);
-            HtmlCssFreeDynamics(pElem);
+            HtmlCssFreeDynamics(pTree, pElem);
+            HtmlCallbackRestyleRemove(pTree, pElem);
 
             if (pElem->pOverride) {
                 Tcl_DecrRefCount(pElem->pOverride);
@@ -310,6 +314,18 @@ freeNode(pTree, pNode)
             }
             HtmlFree(pElem->apChildren);
 
+            /* If this node is the innermost of a chain maintained by the 
+             * [$html pointer] command, the parent becomes the innermost.
+             * Child nodes have already been deleted, so the parent is
+             * still valid here.
+             */
+            if (pTree->pPointerHover == pNode) {
+                pTree->pPointerHover = HtmlNodeParent(pNode);
+            }
+            if (pTree->pPointerActive == pNode) {
+                pTree->pPointerActive = HtmlNodeParent(pNode);
+            }
+
             clearReplacement(pTree, pElem);
 
             HtmlDrawCanvasItemRelease(pTree, pElem->pBox);
@@ -336,13 +352,36 @@ HtmlNodeClearGenerated(pTree, pElem)
     HtmlElementNode *pElem;
 {
     assert(!pElem->pBefore || !HtmlNodeIsText(pElem->pBefore));
-    freeNode(pTree, pElem->pBefore);
-    freeNode(pTree, pElem->pAfter);
-    pElem->pBefore = 0;
-    pElem->pAfter = 0;
+    HtmlNodeFreeGenerated(pTree, &pElem->pBefore);
+    HtmlNodeFreeGenerated(pTree, &pElem->pAfter);
     return 0;
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlNodeFreeGenerated --
+ *
+ *     Free the generated content node *ppGenerated (either the pBefore 
+ *     or pAfter member of an HtmlElementNode), if any.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Sets *ppGenerated to NULL.
+ *
+ *---------------------------------------------------------------------------
+ */
+void
+HtmlNodeFreeGenerated(pTree, ppGenerated)
+    HtmlTree *pTree;
+    HtmlNode **ppGenerated;
+{
+    freeNode(pTree, *ppGenerated);
+    *ppGenerated = 0;
+}
+
 static Tcl_Obj *
 nodeGetPreText(pTextNode)
     HtmlTextNode *pTextNode;
@@ -423,6 +462,57 @@ nodeRemoveChild(pElem, pChild)
     return eSeen;
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * pointerNodeRemoved --
+ *
+ *     This is called before node pChild is removed from it's parent in
+ *     the document tree (by [$node remove], [$node destroy], or by 
+ *     [$node insert] moving it to a new parent). If the innermost node of
+ *     the :hover or :active chain maintained by the [$html pointer] 
+ *     command is pChild or one of it's descendants, the flag is cleared
+ *     from the part of the chain inside the removed sub-tree and the 
+ *     parent of pChild becomes the innermost node. Otherwise the next
+ *     [$html pointer] command would walk the chain through the removed
+ *     sub-tree, and never clear the flag from the ancestors of pChild.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May modify HtmlTree.pPointerHover, pPointerActive and the flags of
+ *     nodes within the sub-tree rooted at pChild.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+pointerNodeRemoved(pTree, pChild)
+    HtmlTree *pTree;
+    HtmlNode *pChild;
+{
+    HtmlNode **apPointer[2];
+    int aFlag[2];
+    int ii;
+
+    apPointer[0] = &pTree->pPointerHover;
+    apPointer[1] = &pTree->pPointerActive;
+    aFlag[0] = HTML_DYNAMIC_HOVER;
+    aFlag[1] = HTML_DYNAMIC_ACTIVE;
+
+    for (ii = 0; ii < 2; ii++) {
+        HtmlNode *p;
+        for (p = *apPointer[ii]; p && p != pChild; p = HtmlNodeParent(p));
+        if (p) {
+            for (p = *apPointer[ii]; p != pChild; p = HtmlNodeParent(p)) {
+                ((HtmlElementNode *)p)->flags &= ~aFlag[ii];
+            }
+            ((HtmlElementNode *)pChild)->flags &= ~aFlag[ii];
+            *apPointer[ii] = HtmlNodeParent(pChild);
+        }
+    }
+}
+
 /*
  *---------------------------------------------------------------------------
  *
@@ -630,6 +720,207 @@ nodeDeorphanize(pTree, pNode)
     Tcl_DeleteHashEntry(pEntry);
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * nodeIndexKey --
+ *
+ *     Return the key used in the id and class indexes for the nValue byte
+ *     value zValue: a nul-terminated copy folded to lower-case. The copy 
+ *     is written to zBuf if it is large enough (nBuf bytes). Otherwise it
+ *     is allocated and must be freed by the caller using HtmlFree().
+ *
+ *---------------------------------------------------------------------------
+ */
+static char *
+nodeIndexKey(zValue, nValue, zBuf, nBuf)
+    const char *zValue;
+    int nValue;
+    char *zBuf;
+    int nBuf;
+{
+    char *zKey = zBuf;
+    int ii;
+    if (nValue >= nBuf) {
+        zKey = (char *)HtmlAlloc("temp", nValue + 1);
+    }
+    for (ii = 0; ii < nValue; ii++) {
+        zKey[ii] = tolower((unsigned char)zValue[ii]);
+    }
+    zKey[nValue] = '\0';
+    return zKey;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * nodeIndexUpdate --
+ *
+ *     Add element pNode to (if isAdd is true) or remove it from (if isAdd 
+ *     is false) the entry for value zValue in index pIndex. nValue is the
+ *     length of zValue in bytes.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     May modify *pIndex.
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+nodeIndexUpdate(pIndex, zValue, nValue, pNode, isAdd)
+    Tcl_HashTable *pIndex;
+    const char *zValue;
+    int nValue;
+    HtmlNode *pNode;
+    int isAdd;
+{
+    char zBuf[128];
+    char *zKey;
+    Tcl_HashEntry *pEntry;
+    Tcl_HashTable *pSet;
+
+    if (nValue <= 0) return;
+    zKey = nodeIndexKey(zValue, nValue, zBuf, sizeof(zBuf));
+
+    if (isAdd) {
+        int isNew;
+        pEntry = Tcl_CreateHashEntry(pIndex, zKey, &isNew);
+        if (isNew) {
+            pSet = HtmlNew(Tcl_HashTable);
+            Tcl_InitHashTable(pSet, TCL_ONE_WORD_KEYS);
+            Tcl_SetHashValue(pEntry, pSet);
+        }
+        pSet = (Tcl_HashTable *)Tcl_GetHashValue(pEntry);
+        Tcl_CreateHashEntry(pSet, (const char *)pNode, &isNew);
+    } else if ((pEntry = Tcl_FindHashEntry(pIndex, zKey))) {
+        Tcl_HashEntry *pNodeEntry;
+        pSet = (Tcl_HashTable *)Tcl_GetHashValue(pEntry);
+        pNodeEntry = Tcl_FindHashEntry(pSet, (const char *)pNode);
+        if (pNodeEntry) {
+            Tcl_DeleteHashEntry(pNodeEntry);
+        }
+        if (pSet->numEntries == 0) {
+            Tcl_DeleteHashTable(pSet);
+            HtmlFree(pSet);
+            Tcl_DeleteHashEntry(pEntry);
+        }
+    }
+
+    if (zKey != zBuf) {
+        HtmlFree(zKey);
+    }
+}
+
+static void
+nodeIndex(pTree, pNode, isAdd)
+    HtmlTree *pTree;
+    HtmlNode *pNode;
+    int isAdd;
+{
+    HtmlElementNode *pElem = (HtmlElementNode *)pNode;
+    const char *zId;
+    int ii;
+
+    if (HtmlNodeIsText(pNode) || pNode->iNode == HTML_NODE_GENERATED) return;
+
+    zId = HtmlNodeAttr(pNode, "id");
+    if (zId) {
+        nodeIndexUpdate(&pTree->aIdIndex, zId, strlen(zId), pNode, isAdd);
+    }
+
+    /* The interned class names of the element are created when it is 
+     * added to the indexes and released when it is removed.
+     */
+    if (isAdd) {
+        HtmlCssNodeClassesSet(pElem);
+    }
+    for (ii = 0; ii < pElem->nClass; ii++) {
+        const char *zClass = pElem->azClass[ii];
+        int n = strlen(zClass);
+        nodeIndexUpdate(&pTree->aClassIndex, zClass, n, pNode, isAdd);
+    }
+    if (!isAdd) {
+        HtmlCssNodeClassesFree(pElem);
+    }
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlNodeIndexAdd --
+ * HtmlNodeIndexRemove --
+ *
+ *     Add element pNode to, or remove it from, the HtmlTree.aIdIndex and
+ *     HtmlTree.aClassIndex indexes, according to the current values of
+ *     its "id" and "class" attributes. HtmlNodeIndexRemove() must be 
+ *     called before either attribute of an element is modified, and 
+ *     HtmlNodeIndexAdd() afterwards. Both functions may be called more
+ *     than once for the same element.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Modifies the indexes. Also sets or releases the interned class
+ *     names of the element (HtmlElementNode.azClass).
+ *
+ *---------------------------------------------------------------------------
+ */
+void
+HtmlNodeIndexAdd(pTree, pNode)
+    HtmlTree *pTree;
+    HtmlNode *pNode;
+{
+    nodeIndex(pTree, pNode, 1);
+}
+void
+HtmlNodeIndexRemove(pTree, pNode)
+    HtmlTree *pTree;
+    HtmlNode *pNode;
+{
+    nodeIndex(pTree, pNode, 0);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlNodeIndexLookup --
+ *
+ *     Find the set of elements with an "id" attribute (if isClass is 
+ *     false) or a class name (if isClass is true) equal to zValue, 
+ *     compared case-insensitively. The elements in the set are the keys 
+ *     of the returned hash table. Elements in orphan trees are included.
+ *
+ * Results:
+ *     Pointer to a hash table owned by the widget, or NULL if there
+ *     are no such elements.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+Tcl_HashTable *
+HtmlNodeIndexLookup(pTree, isClass, zValue)
+    HtmlTree *pTree;
+    int isClass;
+    const char *zValue;
+{
+    Tcl_HashTable *pIndex = (isClass ? &pTree->aClassIndex : &pTree->aIdIndex);
+    Tcl_HashEntry *pEntry;
+    char zBuf[128];
+    char *zKey;
+
+    zKey = nodeIndexKey(zValue, strlen(zValue), zBuf, sizeof(zBuf));
+    pEntry = Tcl_FindHashEntry(pIndex, zKey);
+    if (zKey != zBuf) {
+        HtmlFree(zKey);
+    }
+    return (pEntry ? (Tcl_HashTable *)Tcl_GetHashValue(pEntry) : 0);
+}
+
 int
 HtmlNodeIndexOfChild(pParent, pChild)
     HtmlNode *pParent;
@@ -674,6 +965,7 @@ nodeInsertChild(pTree, pElem, pBefore, pAfter, pChild)
          * moved to the orphan tree has all style/layout info cleared.
          */
         HtmlNodeClearRecursive(pTree, pChild);
+        pointerNodeRemoved(pTree, pChild);
         nodeRemoveChild(HtmlNodeAsElement(pParent), pChild);
     }
 
@@ -810,7 +1102,8 @@ HtmlNodeAddTextChild(pNode, pTextNode)
  *---------------------------------------------------------------------------
  */
 static void
-setNodeAttribute(pNode, zAttrName, zAttrVal)
+setNodeAttribute(pTree, pNode, zAttrName, zAttrVal)
+    HtmlTree *pTree;
     HtmlNode *pNode;
     const char *zAttrName;
     const char *zAttrVal;
@@ -824,11 +1117,18 @@ setNodeAttribute(pNode, zAttrName, zAttrVal)
     int nArgs;
     HtmlElementNode *pElem;
     HtmlAttributes *pAttr;
+    int isIndexed;
 
     pElem = HtmlNodeAsElement(pNode);
     if (!pElem) return;
     pAttr = pElem->pAttributes;
 
+    /* Only the "id" and "class" attributes are indexed. */
+    isIndexed = (!strcmp(zAttrName, "id") || !strcmp(zAttrName, "class"));
+    if (isIndexed) {
+        HtmlNodeIndexRemove(pTree, pNode);
+    }
+
     for (i = 0; pAttr && i < pAttr->nAttr && i < MAX_NUM_ATTRIBUTES; i++) {
         azPtr[i*2] = pAttr->a[i].zName;
         if (0 != strcmp(pAttr->a[i].zName, zAttrName)) {
@@ -852,6 +1152,9 @@ setNodeAttribute(pNode, zAttrName, zAttrVal)
 
     pElem->pAttributes = HtmlAttributesNew(nArgs, azPtr, aLen, 0);
     HtmlFree(pAttr);
+    if (isIndexed) {
+        HtmlNodeIndexAdd(pTree, pNode);
+    }
 
     /* If this was a call to set the "style" attribute, discard the
      * compiled version at version HtmlElementNode.pStyle.
@@ -863,13 +1166,14 @@ setNodeAttribute(pNode, zAttrName, zAttrVal)
 }
 
 static void
-mergeAttributes(pNode, pAttr)
+mergeAttributes(pTree, pNode, pAttr)
+    HtmlTree *pTree;
     HtmlNode *pNode;
     HtmlAttributes *pAttr;
 {
     int ii;
     for (ii = 0; pAttr && ii < pAttr->nAttr; ii++) {
-        setNodeAttribute(pNode, pAttr->a[ii].zName, pAttr->a[ii].zValue);
+        setNodeAttribute(pTree, pNode, pAttr->a[ii].zName, pAttr->a[ii].zValue);
     }
     HtmlFree(pAttr);
 }
@@ -1294,17 +1598,17 @@ HtmlTreeAddElement(pTree, eType, zType, pAttr, iOffset)
     switch (eType) {
         case Html_HTML:
             pParsed = pTree->pRoot;
-            mergeAttributes(pParsed, pAttr);
+            mergeAttributes(pTree, pParsed, pAttr);
             HtmlCallbackRestyle(pTree, pParsed);
             break;
         case Html_HEAD:
             pParsed = pHeadNode;
-            mergeAttributes(pParsed, pAttr);
+            mergeAttributes(pTree, pParsed, pAttr);
             HtmlCallbackRestyle(pTree, pParsed);
             break;
         case Html_BODY:
             pParsed = pBodyNode;
-            mergeAttributes(pParsed, pAttr);
+            mergeAttributes(pTree, pParsed, pAttr);
             HtmlCallbackRestyle(pTree, pParsed);
             break;
 
@@ -1333,6 +1637,7 @@ HtmlTreeAddElement(pTree, eType, zType, pAttr, iOffset)
             int n = HtmlNodeAddChild(pHeadElem, eType, 0, pAttr);
             HtmlNode *p = HtmlNodeChild(pHeadNode, n);
             p->iNode = pTree->iNextNode++;
+            HtmlNodeIndexAdd(pTree, p);
             nodeHandlerCallbacks(pTree, p);
             if (pTree->eWriteState != HTML_WRITE_INHANDLERRESET) {
                 pParsed = p;
@@ -1396,6 +1701,7 @@ HtmlTreeAddElement(pTree, eType, zType, pAttr, iOffset)
     }
 
     if (pParsed) {
+        HtmlNodeIndexAdd(pTree, pParsed);
         if (HtmlNodeComputedValues(pParsed)) {
             HtmlCallbackRestyle(pTree, pParsed);
         }
@@ -1798,6 +2104,45 @@ HtmlNode *HtmlNodeLeftSibling(pNode)
     return 0;
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlNodeIsEdgeChild --
+ * 
+ *     Check if pNode is the first (if isLast is false) or last (if isLast
+ *     is true) child of its parent, not counting white-space text nodes.
+ *     This is the test used for the :first-child and :last-child 
+ *     pseudo-classes.
+ *
+ * Results:
+ *     Non-zero if pNode is the first or last child, otherwise zero.
+ *
+ * Side effects:
+ *     None.
+ *
+ *---------------------------------------------------------------------------
+ */
+int HtmlNodeIsEdgeChild(pNode, isLast)
+    HtmlNode *pNode;
+    int isLast;
+{
+    HtmlElementNode *pParent = (HtmlElementNode *)pNode->pParent;
+    if (pParent) {
+        int i;
+        int iDir = (isLast ? -1 : 1);
+        for (
+            i = (isLast ? pParent->nChild - 1 : 0); 
+            i >= 0 && i < pParent->nChild; 
+            i += iDir
+        ) {
+            HtmlNode *pChild = pParent->apChildren[i];
+            if (pChild == pNode) return 1;
+            if (!HtmlNodeIsWhitespace(pChild)) break;
+        }
+    }
+    return 0;
+}
+
 /*
  *---------------------------------------------------------------------------
  *
@@ -1985,8 +2330,19 @@ nodeRemoveCmd(pNode, objc, objv)
             int e;
             Tcl_Obj *pObj = apNode[jj];
             HtmlNode *pChild = HtmlNodeGetPointer(pTree, Tcl_GetString(pObj));
+            HtmlNode *pNext = pChild;
+            while (pNext && (pNext = HtmlNodeRightSibling(pNext))) {
+                if (!HtmlNodeIsText(pNext)) break;
+            }
+            if (pChild && HtmlNodeParent(pChild) == pNode) {
+                pointerNodeRemoved(pTree, pChild);
+            }
             e = nodeRemoveChild((HtmlElementNode *)pNode, pChild);
             if (e) {
+                /* Update the [search] cache for the right-siblings of
+                 * the removed node. Or, if there are none, for pNode.
+                 */
+                HtmlCssSearchNodeChanged(pTree, pNext ? pNext : pNode);
                 nodeOrphanize(pTree, pChild);
                 HtmlNodeClearRecursive(pTree, pChild);
             }
@@ -2036,11 +2392,13 @@ nodeDestroyCmd(pNode, objc, objv)
     } else if (pNode->pParent) {
         HtmlCallbackRestyle(pTree, pNode->pParent);
         HtmlCallbackLayout(pTree, pNode->pParent);
+        pointerNodeRemoved(pTree, pNode);
         nodeRemoveChild(HtmlNodeAsElement(pNode->pParent), pNode);
     } else {
         assert(!"TODO: Delete the root node?");
     }
     
+    HtmlCssSearchNodeDeleted(pTree, pNode);
     freeNode(pTree, pNode);
 
     HtmlCheckRestylePoint(pTree);
@@ -2434,6 +2792,7 @@ nodeCommand(clientData, interp, objc, objv)
                  *     eval $handler [list $attribute-name] [list $new-value]
                  */
                 int rc;
+                int mask;
                 char *zCopy; 
 
                 assert(!zDefault);
@@ -2447,8 +2806,25 @@ nodeCommand(clientData, interp, objc, objv)
                 if (rc != TCL_OK) {
                     return rc;
                 }
-                setNodeAttribute(pNode, zAttrName, zAttrVal);
-                HtmlCallbackRestyle(pTree, pNode);
+
+                /* Restyle only as much of the tree as the stylesheets say
+                 * may be affected by the change: nothing if the attribute
+                 * (or class name, or id) is not used by any rule, just
+                 * this node if it is only used by the rightmost compound
+                 * selectors or values of rules, or the node, its 
+                 * descendants and right-hand siblings otherwise.
+                 */
+                mask = HtmlCssAttributeDepends(pTree, pNode, 
+                    zAttrName, HtmlNodeAttr(pNode, zAttrName), zAttrVal
+                );
+                setNodeAttribute(pTree, pNode, zAttrName, zAttrVal);
+                if (mask & (CSS_DEPEND_ANCESTOR|CSS_DEPEND_SIBLING)) {
+                    HtmlCallbackRestyle(pTree, pNode);
+                } else if (mask) {
+                    HtmlCallbackRestyleNode(pTree, pNode);
+                } else {
+                    HtmlCssSearchNodeChanged(pTree, pNode);
+                }
             }
 
             if (zAttrName) {
@@ -2783,7 +3159,7 @@ node_attr_usage:
                 ) {
                     HtmlCallbackRestyle(pTree, pNode);
                 } else {
-                    HtmlCallbackDynamic(pTree, pNode);
+                    HtmlCallbackDynamic(pTree, pNode, mask);
                 }
             }
 
@@ -2830,7 +3206,7 @@ node_attr_usage:
             if (pElem->pOverride) {
                 Tcl_SetObjResult(interp, pElem->pOverride);
             }
-            HtmlCallbackRestyle(pTree, pNode);
+            HtmlCallbackRestyleNode(pTree, pNode);
             return TCL_OK;
         }
 
@@ -2984,6 +3360,168 @@ int HtmlNodeScrollbarDoCallback(pTree, pNode)
 }
 
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * pointerChainUpdate --
+ *
+ *     The dynamic flag "flag" is currently set on node *ppNode and all of
+ *     it's ancestors. This function clears the flag from those nodes that
+ *     are not ancestors-or-self of pNew, and sets it on pNew and those of 
+ *     it's ancestors that did not already have it set. *ppNode is set to
+ *     pNew before returning.
+ *
+ *     The Tcl commands for nodes that the flag is set on are appended
+ *     to list pEntered, and for those that it is cleared from to list
+ *     pLeft, innermost node first.
+ *
+ * Results:
+ *     None.
+ *
+ * Side effects:
+ *     Modifies HtmlElementNode.flags and may call HtmlCallbackDynamic().
+ *
+ *---------------------------------------------------------------------------
+ */
+static void
+pointerChainUpdate(pTree, ppNode, pNew, flag, pEntered, pLeft)
+    HtmlTree *pTree;
+    HtmlNode **ppNode;
+    HtmlNode *pNew;
+    int flag;
+    Tcl_Obj *pEntered;
+    Tcl_Obj *pLeft;
+{
+    HtmlNode *pOld = *ppNode;
+    HtmlNode *pA;
+    HtmlNode *pB;
+    HtmlNode *pOuterLeft = 0;
+    HtmlNode *pOuterEntered = 0;
+    int nOld = 0;
+    int nNew = 0;
+
+    for (pA = pOld; pA; pA = HtmlNodeParent(pA)) nOld++;
+    for (pB = pNew; pB; pB = HtmlNodeParent(pB)) nNew++;
+
+    /* Walk up both chains until the common ancestor is found. Nodes 
+     * visited on the old chain have been left by the pointer, nodes
+     * visited on the new chain have been entered.
+     */
+    pA = pOld;
+    pB = pNew;
+    while (pA != pB) {
+        if (nOld >= nNew) {
+            ((HtmlElementNode *)pA)->flags &= ~flag;
+            Tcl_ListObjAppendElement(0, pLeft, HtmlNodeCommand(pTree, pA));
+            pOuterLeft = pA;
+            pA = HtmlNodeParent(pA);
+            nOld--;
+        }
+        if (nNew > nOld) {
+            ((HtmlElementNode *)pB)->flags |= flag;
+            Tcl_ListObjAppendElement(0, pEntered, HtmlNodeCommand(pTree, pB));
+            pOuterEntered = pB;
+            pB = HtmlNodeParent(pB);
+            nNew--;
+        }
+    }
+
+    /* The dynamic conditions that may be affected by the changes are
+     * those attached to the descendants and right-hand siblings of the
+     * outermost modified nodes. It is not necessary to call
+     * HtmlCallbackDynamic() for the inner nodes of each chain.
+     */
+    HtmlCallbackDynamic(pTree, pOuterLeft, flag);
+    HtmlCallbackDynamic(pTree, pOuterEntered, flag);
+    *ppNode = pNew;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * HtmlTreePointerCmd --
+ *
+ *         $html pointer hover|active ?X Y?
+ *
+ *     Set the :hover (or :active) dynamic flag on the top-most element
+ *     under viewport coordinates (X, Y) and all of it's ancestors, and
+ *     clear it from the nodes it was set on by the previous invocation 
+ *     of this command that are not part of the new chain. If X and Y are
+ *     omitted, the flag is cleared from all nodes it was set on by this
+ *     command.
+ *
+ *     This is equivalent to a [$html node X Y] command followed by a 
+ *     [$node dynamic set|clear] for each node entered or left, but
+ *     does not require a Tcl round trip for each node.
+ *
+ * Results:
+ *     A list of two lists. The first contains the nodes that the flag has
+ *     been set on (entered), the second the nodes it was cleared from
+ *     (left). Within each list, the innermost node comes first.
+ *
+ * Side effects:
+ *     Modifies HtmlTree.pPointerHover or pPointerActive and the flags of
+ *     the nodes entered and left.
+ *
+ *---------------------------------------------------------------------------
+ */
+int 
+HtmlTreePointerCmd(clientData, interp, objc, objv)
+    ClientData clientData;             /* The HTML widget data structure */
+    Tcl_Interp *interp;                /* Current interpreter. */
+    int objc;                          /* Number of arguments. */
+    Tcl_Obj *CONST objv[];             /* Argument strings. */
+{
+    HtmlTree *pTree = (HtmlTree *)clientData;
+    static const char *azFlag[] = {"hover", "active", 0};
+    HtmlNode *pNew = 0;
+    HtmlNode **ppNode;
+    Tcl_Obj *pEntered;
+    Tcl_Obj *pLeft;
+    Tcl_Obj *pRet;
+    int iFlag;
+    int flag;
+
+    if (objc != 3 && objc != 5) {
+        Tcl_WrongNumArgs(interp, 2, objv, "hover|active ?X Y?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[2], azFlag, "flag", 0, &iFlag)) {
+        return TCL_ERROR;
+    }
+    if (iFlag == 0) {
+        flag = HTML_DYNAMIC_HOVER;
+        ppNode = &pTree->pPointerHover;
+    } else {
+        flag = HTML_DYNAMIC_ACTIVE;
+        ppNode = &pTree->pPointerActive;
+    }
+
+    if (objc == 5) {
+        int x;
+        int y;
+        if (TCL_OK != Tcl_GetIntFromObj(interp, objv[3], &x) ||
+            TCL_OK != Tcl_GetIntFromObj(interp, objv[4], &y) 
+        ) {
+            return TCL_ERROR;
+        }
+        pNew = HtmlLayoutElementAt(pTree, x, y);
+    }
+
+    pEntered = Tcl_NewObj();
+    pLeft = Tcl_NewObj();
+    if (pNew != *ppNode) {
+        pointerChainUpdate(pTree, ppNode, pNew, flag, pEntered, pLeft);
+    }
+
+    pRet = Tcl_NewObj();
+    Tcl_ListObjAppendElement(0, pRet, pEntered);
+    Tcl_ListObjAppendElement(0, pRet, pLeft);
+    Tcl_SetObjResult(interp, pRet);
+    return TCL_OK;
+}
+
+
 /*
  *---------------------------------------------------------------------------
  *
@@ -3017,6 +3555,11 @@ int HtmlTreeClear(pTree)
     /* Free the contents of the search-cache */
     HtmlCssSearchInvalidateCache(pTree);
 
+    /* Empty the restyle worklist, as every node in it is about to be
+     * deleted (see HtmlCallbackRestyleRemove()).
+     */
+    pTree->cb.nRestyle = 0;
+
     /* Free the tree representation - pTree->pRoot */
     freeNode(pTree, pTree->pRoot);
     pTree->pRoot = 0;
@@ -3046,9 +3589,11 @@ int HtmlTreeClear(pTree)
     pTree->nParsed = 0;
     pTree->pDocument = 0;
 
-    /* Free the stylesheets */
+    /* Free the stylesheets, and any that are queued but not yet parsed */
     HtmlCssStyleSheetFree(pTree->pStyle);
     pTree->pStyle = 0;
+    HtmlStyleCancelAsync(pTree);
+    HtmlCssUrlCacheClear(pTree);
 
     /* Set the scroll position to top-left and clear the selection */
     pTree->iScrollX = 0;
@@ -3056,10 +3601,12 @@ int HtmlTreeClear(pTree)
 
     /* Deschedule any dynamic, style or layout callback. */
     pTree->cb.pDynamic = 0;
-    pTree->cb.pRestyle = 0;
+    pTree->cb.dynamicFlags = 0;
     pTree->cb.flags &= ~(HTML_DYNAMIC|HTML_RESTYLE|HTML_LAYOUT);
 
     pTree->iNextNode = 0;
+    pTree->isCounters = 0;
+    pTree->isInlineCounters = 0;
     return TCL_OK;
 }
 
@@ -3188,6 +3735,7 @@ fragmentAddElement(pTree, eType, zType, pAttributes, iOffset)
         zType = HtmlTypeToName(0, eType);
     }
     pElem->node.zTag = zType;
+    HtmlNodeIndexAdd(pTree, (HtmlNode *)pElem);
 
     if (pFragment->pCurrent) {
         nodeInsertChild(pTree, pFragment->pCurrent, 0, 0, (HtmlNode *)pElem);